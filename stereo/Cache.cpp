@@ -0,0 +1,590 @@
+#include "Cache.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+using namespace Eigen;
+
+/*
+	Map a file into memory, read-only.
+
+	For the caches, this means the OS pages the data in straight from the file cache,
+	and a warm cache costs little more than the copy out of it.
+*/
+bool OpenMappedFile(_In_ const string& filename, _Out_ MappedFile& file)
+{
+	file = MappedFile();
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(fileHandle);
+		return false;
+	}
+	HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle == NULL)
+	{
+		CloseHandle(fileHandle);
+		return false;
+	}
+	void* view = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL)
+	{
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+		return false;
+	}
+	file.fileHandle = fileHandle;
+	file.mappingHandle = mappingHandle;
+	file.data = (const uchar*)view;
+	file.size = (size_t)fileSize.QuadPart;
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* view = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (view == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+	file.fd = fd;
+	file.data = (const uchar*)view;
+	file.size = (size_t)fileStat.st_size;
+#endif
+	return true;
+}
+
+void CloseMappedFile(_Inout_ MappedFile& file)
+{
+	if (file.data == nullptr)
+	{
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle((HANDLE)file.mappingHandle);
+	CloseHandle((HANDLE)file.fileHandle);
+#else
+	munmap((void*)file.data, file.size);
+	close(file.fd);
+#endif
+	file = MappedFile();
+}
+
+/*
+	Caches are written to a temporary and renamed into place,
+	so a crash mid-write never leaves a file that looks valid.
+*/
+bool CommitCacheFile(ofstream& file, const string& tempFilename, const string& filename, const char* what)
+{
+	file.close();
+	if (file.fail())
+	{
+		cout << "Failed writing the " << what << " cache to " << tempFilename << endl;
+		remove(tempFilename.c_str());
+		return false;
+	}
+
+	remove(filename.c_str());
+	if (rename(tempFilename.c_str(), filename.c_str()) != 0)
+	{
+		cout << "Couldn't move the " << what << " cache to " << filename << endl;
+		remove(tempFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+/*
+	Rectification cache
+
+	The rectification rotations and the remap tables only depend on the rig: the two
+	calibration matrices and the essential matrix between them, and the image sizes.
+	For batch jobs over many pairs from the same rig, we save them once and map them
+	back in on every later run.
+
+	The file is a fixed header followed by the arrays of each map, written straight
+	from memory, so it is only valid on the same kind of machine that wrote it. The
+	header stores the key and the version, so a stale or foreign file is just a miss.
+*/
+// Support functions
+struct RectificationCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t interBits;
+	int32_t sizes[2][4];
+	float R0[9];
+	float R1[9];
+};
+
+// FNV-1a, 64 bit
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+	const uchar* bytes = (const uchar*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+size_t RectificationMapBytes(const RectificationMap& map)
+{
+	size_t numPixels = (size_t)map.width * map.height;
+	return numPixels * (sizeof(int) + 3 * sizeof(uchar));
+}
+
+bool ReadRectificationMap(const uchar*& data, const uchar* end, const int32_t size[4], RectificationMap& map)
+{
+	map.width = size[0];
+	map.height = size[1];
+	map.originalWidth = size[2];
+	map.originalHeight = size[3];
+	if (map.width <= 0 || map.height <= 0 || map.originalWidth < 2 || map.originalHeight < 2)
+	{
+		return false;
+	}
+	size_t numPixels = (size_t)map.width * map.height;
+	if ((size_t)(end - data) < RectificationMapBytes(map))
+	{
+		return false;
+	}
+
+	map.offsets.resize(numPixels);
+	memcpy(map.offsets.data(), data, numPixels * sizeof(int));
+	data += numPixels * sizeof(int);
+	map.fracX.assign(data, data + numPixels);
+	data += numPixels;
+	map.fracY.assign(data, data + numPixels);
+	data += numPixels;
+	map.valid.assign(data, data + numPixels);
+	data += numPixels;
+
+	// Don't trust anything we didn't just compute. Each offset has to leave room for the pixel
+	// to its right and the one below, and the fractions can go at most a whole pixel
+	if ((int64_t)map.originalWidth * map.originalHeight > INT32_MAX)
+	{
+		return false;
+	}
+	int maxOffset = (map.originalHeight - 1) * map.originalWidth - 2;
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		if (map.offsets[i] < 0 || map.offsets[i] > maxOffset || map.offsets[i] % map.originalWidth > map.originalWidth - 2 ||
+			map.fracX[i] > RECTIFY_INTER_SCALE || map.fracY[i] > RECTIFY_INTER_SCALE || map.valid[i] > 1)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void WriteRectificationMap(ofstream& file, const RectificationMap& map)
+{
+	size_t numPixels = (size_t)map.width * map.height;
+	file.write((const char*)map.offsets.data(), numPixels * sizeof(int));
+	file.write((const char*)map.fracX.data(), numPixels);
+	file.write((const char*)map.fracY.data(), numPixels);
+	file.write((const char*)map.valid.data(), numPixels);
+}
+
+// Actual functions
+uint64_t HashRectificationKey(
+	_In_ const Matrix3f& K0,
+	_In_ const Matrix3f& K1,
+	_In_ const Matrix3f& E,
+	_In_ const Size& size0,
+	_In_ const Size& size1)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	hash = HashBytes(K0.data(), 9 * sizeof(float), hash);
+	hash = HashBytes(K1.data(), 9 * sizeof(float), hash);
+	hash = HashBytes(E.data(), 9 * sizeof(float), hash);
+	int sizes[4] = { size0.width, size0.height, size1.width, size1.height };
+	hash = HashBytes(sizes, sizeof(sizes), hash);
+	return hash;
+}
+
+string GetRectificationCacheFilename(_In_ const string& folder, _In_ uint64_t key)
+{
+	stringstream name;
+	name << folder << "/rectification_" << hex << setw(16) << setfill('0') << key << ".bin";
+	return name.str();
+}
+
+bool LoadRectificationCache(
+	_In_ const string& filename,
+	_In_ uint64_t key,
+	_Out_ Matrix3f& R0,
+	_Out_ Matrix3f& R1,
+	_Out_ RectificationMap& map0,
+	_Out_ RectificationMap& map1)
+{
+	MappedFile file;
+	if (!OpenMappedFile(filename, file))
+	{
+		return false;
+	}
+
+	bool success = false;
+	const uchar* data = file.data;
+	const uchar* end = file.data + file.size;
+	RectificationCacheHeader header;
+	if (file.size >= sizeof(header))
+	{
+		memcpy(&header, data, sizeof(header));
+		data += sizeof(header);
+
+		if (memcmp(header.magic, "RECT", 4) != 0 || header.version != RECTIFICATION_CACHE_VERSION)
+		{
+			cout << "Rectification cache " << filename << " is from a different version, ignoring it" << endl;
+		}
+		else if (header.key != key || header.interBits != RECTIFY_INTER_BITS)
+		{
+			cout << "Rectification cache " << filename << " doesn't match this calibration, ignoring it" << endl;
+		}
+		else
+		{
+			R0 = Map<const Matrix3f>(header.R0);
+			R1 = Map<const Matrix3f>(header.R1);
+			success = ReadRectificationMap(data, end, header.sizes[0], map0) &&
+				ReadRectificationMap(data, end, header.sizes[1], map1);
+			if (!success)
+			{
+				cout << "Rectification cache " << filename << " is corrupt, ignoring it" << endl;
+			}
+		}
+	}
+
+	CloseMappedFile(file);
+	return success;
+}
+
+bool SaveRectificationCache(
+	_In_ const string& filename,
+	_In_ uint64_t key,
+	_In_ const Matrix3f& R0,
+	_In_ const Matrix3f& R1,
+	_In_ const RectificationMap& map0,
+	_In_ const RectificationMap& map1)
+{
+	RectificationCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RECT", 4);
+	header.version = RECTIFICATION_CACHE_VERSION;
+	header.key = key;
+	header.interBits = RECTIFY_INTER_BITS;
+	const RectificationMap* maps[2] = { &map0, &map1 };
+	for (int i = 0; i < 2; ++i)
+	{
+		header.sizes[i][0] = maps[i]->width;
+		header.sizes[i][1] = maps[i]->height;
+		header.sizes[i][2] = maps[i]->originalWidth;
+		header.sizes[i][3] = maps[i]->originalHeight;
+	}
+	Map<Matrix3f>(header.R0) = R0;
+	Map<Matrix3f>(header.R1) = R1;
+
+	string tempFilename = filename + ".tmp";
+	ofstream file(tempFilename, ios::out | ios::binary | ios::trunc);
+	if (!file.is_open())
+	{
+		cout << "Couldn't open " << tempFilename << " to write the rectification cache" << endl;
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	WriteRectificationMap(file, map0);
+	WriteRectificationMap(file, map1);
+	return CommitCacheFile(file, tempFilename, filename, "rectification");
+}
+
+/*
+	Feature cache
+
+	The features of every image in a dataset, in a binary file that is mapped in and used
+	where it lies: the matcher reads the descriptors straight out of the mapping, so
+	opening the cache costs a header check per image, however many features there are.
+
+	The layout is
+	- a header, with the version and the number of images
+	- a directory entry per image: its size, calibration, where its name is, and where
+	  its blocks are
+	- the image names
+	- for each image, the x, y, score, angle and scale arrays of a FeatureSet, then its
+	  descriptor matrix, each block starting on a FEATURE_SET_ALIGNMENT boundary.
+	  The header says whether the descriptors are floats or quantised bytes. The sets are
+	  written as they are, so a cache of quantised sets is quantised too, and a quarter the size
+
+	Like the rectification cache, it's written straight from memory, so it's only
+	valid on the same kind of machine that wrote it. Anything that doesn't check out is a miss.
+*/
+// Support functions
+struct FeatureCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t numImages;
+	uint32_t descriptorLength;
+	uint32_t quantised;
+};
+
+struct FeatureCacheEntry
+{
+	uint64_t nameOffset;
+	uint64_t geometryOffset;
+	uint64_t descriptorOffset;
+	uint32_t nameLength;
+	uint32_t numFeatures;
+	int32_t width;
+	int32_t height;
+	float K[9];
+	float E[9];
+};
+
+inline uint64_t AlignCacheOffset(uint64_t offset)
+{
+	return (offset + FEATURE_SET_ALIGNMENT - 1) / FEATURE_SET_ALIGNMENT * FEATURE_SET_ALIGNMENT;
+}
+
+// Each geometry array is padded out to the alignment, so the next one starts aligned too
+inline uint64_t FeatureCacheArrayBytes(uint64_t numFeatures)
+{
+	return AlignCacheOffset(numFeatures * sizeof(float));
+}
+
+inline uint64_t FeatureCacheGeometryBytes(uint64_t numFeatures)
+{
+	return 5 * FeatureCacheArrayBytes(numFeatures);
+}
+
+inline uint64_t FeatureCacheDescriptorBytes(uint64_t numFeatures, bool quantised)
+{
+	return numFeatures * DESC_LENGTH * (quantised ? sizeof(uint8_t) : sizeof(float));
+}
+
+// A block must be aligned and lie wholly within the file
+inline bool IsValidCacheBlock(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+	return offset % FEATURE_SET_ALIGNMENT == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+void WriteCachePadding(ofstream& file, uint64_t bytes)
+{
+	static const char zeros[FEATURE_SET_ALIGNMENT] = {};
+	file.write(zeros, (streamsize)bytes);
+}
+
+// Write an array and pad it out to its block size
+template <typename T>
+void WriteCacheArray(ofstream& file, const T* data, uint64_t count, uint64_t blockBytes)
+{
+	file.write((const char*)data, (streamsize)(count * sizeof(T)));
+	WriteCachePadding(file, blockBytes - count * sizeof(T));
+}
+
+// Actual functions
+bool OpenFeatureCache(_In_ const string& filename, _Out_ FeatureCache& cache)
+{
+	cache.images.clear();
+	if (!OpenMappedFile(filename, cache.file))
+	{
+		return false;
+	}
+
+	const uchar* data = cache.file.data;
+	uint64_t fileSize = cache.file.size;
+	FeatureCacheHeader header;
+	if (fileSize < sizeof(header))
+	{
+		cout << "Feature cache " << filename << " is corrupt, ignoring it" << endl;
+		CloseFeatureCache(cache);
+		return false;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, "FEAT", 4) != 0 || header.version != FEATURE_CACHE_VERSION || header.descriptorLength != DESC_LENGTH || header.quantised > 1)
+	{
+		cout << "Feature cache " << filename << " is from a different version, ignoring it" << endl;
+		CloseFeatureCache(cache);
+		return false;
+	}
+	if ((fileSize - sizeof(header)) / sizeof(FeatureCacheEntry) < header.numImages)
+	{
+		cout << "Feature cache " << filename << " is corrupt, ignoring it" << endl;
+		CloseFeatureCache(cache);
+		return false;
+	}
+
+	cache.images.resize(header.numImages);
+	for (uint32_t i = 0; i < header.numImages; ++i)
+	{
+		FeatureCacheEntry entry;
+		memcpy(&entry, data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+		if (entry.nameOffset > fileSize || entry.nameLength > fileSize - entry.nameOffset ||
+			!IsValidCacheBlock(entry.geometryOffset, FeatureCacheGeometryBytes(entry.numFeatures), fileSize) ||
+			!IsValidCacheBlock(entry.descriptorOffset, FeatureCacheDescriptorBytes(entry.numFeatures, header.quantised != 0), fileSize))
+		{
+			cout << "Feature cache " << filename << " is corrupt, ignoring it" << endl;
+			CloseFeatureCache(cache);
+			return false;
+		}
+
+		CachedImage& image = cache.images[i];
+		image.filename.assign((const char*)data + entry.nameOffset, entry.nameLength);
+		image.width = entry.width;
+		image.height = entry.height;
+		image.K = Map<const Matrix3f>(entry.K);
+		image.E = Map<const Matrix3f>(entry.E);
+
+		// The arrays are used where they are in the mapping
+		uint64_t arrayBytes = FeatureCacheArrayBytes(entry.numFeatures);
+		const uchar* geometry = data + entry.geometryOffset;
+		FeatureSetView& features = image.features;
+		features.numFeatures = entry.numFeatures;
+		features.x = (const float*)geometry;
+		features.y = (const float*)(geometry + arrayBytes);
+		features.score = (const float*)(geometry + 2 * arrayBytes);
+		features.angle = (const float*)(geometry + 3 * arrayBytes);
+		features.scale = (const int*)(geometry + 4 * arrayBytes);
+		features.quantised = header.quantised != 0;
+		if (features.quantised)
+		{
+			features.quantisedDescriptors = data + entry.descriptorOffset;
+		}
+		else
+		{
+			features.descriptors = (const float*)(data + entry.descriptorOffset);
+		}
+	}
+
+	return true;
+}
+
+void CloseFeatureCache(_Inout_ FeatureCache& cache)
+{
+	cache.images.clear();
+	CloseMappedFile(cache.file);
+}
+
+bool SaveFeatureCache(
+	_In_ const string& filename,
+	_In_ const vector<ImageDescriptor>& images,
+	_In_ const vector<FeatureSetView>& sets)
+{
+	// One header covers every image, so their descriptors all have to be stored the same way
+	bool quantised = !sets.empty() && sets[0].quantised;
+	for (auto& set : sets)
+	{
+		if (set.quantised != quantised)
+		{
+			cout << "Can't cache a mix of quantised and float descriptors" << endl;
+			return false;
+		}
+	}
+	if (sets.size() != images.size())
+	{
+		cout << "Need a feature set for every image to cache" << endl;
+		return false;
+	}
+
+	FeatureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "FEAT", 4);
+	header.version = FEATURE_CACHE_VERSION;
+	header.numImages = (uint32_t)images.size();
+	header.descriptorLength = DESC_LENGTH;
+	header.quantised = quantised ? 1 : 0;
+
+	// Lay the file out first, so the directory can be written before the blocks
+	vector<FeatureCacheEntry> entries(images.size());
+	uint64_t offset = sizeof(header) + images.size() * sizeof(FeatureCacheEntry);
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		FeatureCacheEntry& entry = entries[i];
+		memset(&entry, 0, sizeof(entry));
+		entry.nameOffset = offset;
+		entry.nameLength = (uint32_t)images[i].filename.size();
+		offset += entry.nameLength;
+	}
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		FeatureCacheEntry& entry = entries[i];
+		const ImageDescriptor& image = images[i];
+		entry.numFeatures = (uint32_t)sets[i].size();
+		entry.width = image.width;
+		entry.height = image.height;
+		Map<Matrix3f>(entry.K) = image.K;
+		Map<Matrix3f>(entry.E) = image.E;
+		entry.geometryOffset = AlignCacheOffset(offset);
+		entry.descriptorOffset = entry.geometryOffset + FeatureCacheGeometryBytes(entry.numFeatures);
+		offset = entry.descriptorOffset + FeatureCacheDescriptorBytes(entry.numFeatures, quantised);
+	}
+
+	string tempFilename = filename + ".tmp";
+	ofstream file(tempFilename, ios::out | ios::binary | ios::trunc);
+	if (!file.is_open())
+	{
+		cout << "Couldn't open " << tempFilename << " to write the feature cache" << endl;
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)entries.data(), entries.size() * sizeof(FeatureCacheEntry));
+	offset = sizeof(header) + images.size() * sizeof(FeatureCacheEntry);
+	for (auto& image : images)
+	{
+		file.write(image.filename.data(), image.filename.size());
+		offset += image.filename.size();
+	}
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		const FeatureCacheEntry& entry = entries[i];
+		WriteCachePadding(file, entry.geometryOffset - offset);
+
+		const FeatureSetView& set = sets[i];
+		uint64_t arrayBytes = FeatureCacheArrayBytes(entry.numFeatures);
+		WriteCacheArray(file, set.x, entry.numFeatures, arrayBytes);
+		WriteCacheArray(file, set.y, entry.numFeatures, arrayBytes);
+		WriteCacheArray(file, set.score, entry.numFeatures, arrayBytes);
+		WriteCacheArray(file, set.angle, entry.numFeatures, arrayBytes);
+		WriteCacheArray(file, set.scale, entry.numFeatures, arrayBytes);
+		uint64_t descriptorBytes = FeatureCacheDescriptorBytes(entry.numFeatures, quantised);
+		if (quantised)
+		{
+			WriteCacheArray(file, set.quantisedDescriptors, (uint64_t)entry.numFeatures * DESC_LENGTH, descriptorBytes);
+		}
+		else
+		{
+			WriteCacheArray(file, set.descriptors, (uint64_t)entry.numFeatures * DESC_LENGTH, descriptorBytes);
+		}
+		offset = entry.descriptorOffset + descriptorBytes;
+	}
+	return CommitCacheFile(file, tempFilename, filename, "feature");
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <Eigen/Dense>
+#include <string>
+#include <cstdint>
+#include "Stereography.h"
+
+// Bump this whenever the layout of a cache file changes, so old files are ignored rather than misread
+#define RECTIFICATION_CACHE_VERSION 1
+#define FEATURE_CACHE_VERSION 2
+
+/*
+	A read-only view of a whole file, mapped into memory.
+	The data stays valid until CloseMappedFile is called.
+*/
+struct MappedFile
+{
+	const uchar* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+/*
+	The features of one image in a feature cache.
+	The arrays are viewed in place in the mapped file, and stay valid until the cache is closed.
+*/
+struct CachedImage
+{
+	std::string filename;
+	int width = 0;
+	int height = 0;
+	Eigen::Matrix3f K;
+	Eigen::Matrix3f E;
+	FeatureSetView features;
+};
+
+struct FeatureCache
+{
+	MappedFile file;
+	std::vector<CachedImage> images;
+};
+
+/*
+	Cache functions
+*/
+bool OpenMappedFile(_In_ const std::string& filename, _Out_ MappedFile& file);
+
+void CloseMappedFile(_Inout_ MappedFile& file);
+
+uint64_t HashRectificationKey(
+	_In_ const Eigen::Matrix3f& K0,
+	_In_ const Eigen::Matrix3f& K1,
+	_In_ const Eigen::Matrix3f& E,
+	_In_ const cv::Size& size0,
+	_In_ const cv::Size& size1);
+
+std::string GetRectificationCacheFilename(_In_ const std::string& folder, _In_ uint64_t key);
+
+bool LoadRectificationCache(
+	_In_ const std::string& filename,
+	_In_ uint64_t key,
+	_Out_ Eigen::Matrix3f& R0,
+	_Out_ Eigen::Matrix3f& R1,
+	_Out_ RectificationMap& map0,
+	_Out_ RectificationMap& map1);
+
+bool SaveRectificationCache(
+	_In_ const std::string& filename,
+	_In_ uint64_t key,
+	_In_ const Eigen::Matrix3f& R0,
+	_In_ const Eigen::Matrix3f& R1,
+	_In_ const RectificationMap& map0,
+	_In_ const RectificationMap& map1);
+
+bool OpenFeatureCache(_In_ const std::string& filename, _Out_ FeatureCache& cache);
+
+void CloseFeatureCache(_Inout_ FeatureCache& cache);
+
+bool SaveFeatureCache(
+	_In_ const std::string& filename,
+	_In_ const std::vector<ImageDescriptor>& images,
+	_In_ const std::vector<FeatureSetView>& sets);
@@ -0,0 +1,927 @@
+#include "Disparity.h"
+#include "Matching.h"
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC lets any function use any intrinsic, but GCC and Clang need to be told which
+// functions may use the wider instruction sets. Those are only called once the CPU is known to have them
+#if defined(__GNUC__)
+#define TARGET_SSE4 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE4
+#define TARGET_AVX2
+#endif
+
+using namespace cv;
+using namespace std;
+
+/*
+	Compute a disparity image for a rectified pair, with whichever method the parameters ask for.
+	The output is CV_16S, with INVALID_DISPARITY(minDisparity) where there is no match
+*/
+// Support function
+bool CheckDisparityInputs(const Mat& img0, const Mat& img1, const DisparityParams& params)
+{
+	// This assumes rectified, single-channel images of the same size
+	if (img0.cols != img1.cols || img0.rows != img1.rows)
+	{
+		cout << "Cannot compute disparity for images of different sizes" << endl;
+		return false;
+	}
+	if (img0.type() != CV_8U || img1.type() != CV_8U)
+	{
+		cout << "Cannot compute disparity for images that are not 8-bit grayscale" << endl;
+		return false;
+	}
+	if (params.minDisparity > params.maxDisparity)
+	{
+		cout << "Invalid disparity range" << endl;
+		return false;
+	}
+	return true;
+}
+// Actual function
+bool ComputeDisparity(
+	_In_ const Mat& img0,
+	_In_ const Mat& img1,
+	_Out_ Mat& disparity,
+	_In_ const DisparityParams& params)
+{
+	if (params.method == DISPARITY_SGM)
+	{
+		return ComputeDisparitySGM(img0, img1, disparity, params);
+	}
+	return ComputeDisparityBlockMatching(img0, img1, disparity, params);
+}
+
+/*
+	Census transform
+	https://en.wikipedia.org/wiki/Census_transform
+
+	Intensity differences break down as soon as the two cameras expose differently, which the
+	Middlebury cam0/cam1 pairs do. The census transform instead describes each pixel by which of
+	its neighbours are darker than it: one bit per neighbour in a window, packed into a 64 bit word.
+	That only depends on the ordering of intensities, so any monotonic change in brightness
+	leaves it alone. Two pixels are then compared by the Hamming distance between their words,
+	which is an xor and a hardware popcount - far cheaper than a window correlation.
+
+	A window of up to 65 pixels fits, as the centre is skipped: for example 5x13 (64 bits), 7x9 (62 bits) or 5x5 (24 bits).
+	Pixels past the border are clamped, as for block matching.
+*/
+// Support functions
+inline int HammingDistance(uint64_t a, uint64_t b)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(a ^ b);
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll(a ^ b);
+#else
+	uint64_t v = a ^ b;
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+inline int CensusBits(int windowWidth, int windowHeight)
+{
+	return windowWidth * windowHeight - 1;
+}
+// Actual function
+bool CensusTransform(
+	_In_ const Mat& img,
+	_In_ int windowWidth,
+	_In_ int windowHeight,
+	_Out_ vector<uint64_t>& census)
+{
+	if (img.type() != CV_8U || windowWidth % 2 == 0 || windowHeight % 2 == 0 || CensusBits(windowWidth, windowHeight) > 64)
+	{
+		cout << "Invalid census transform window" << endl;
+		return false;
+	}
+
+	int width = img.cols;
+	int height = img.rows;
+	int rx = windowWidth / 2;
+	int ry = windowHeight / 2;
+
+	// Pad the image by clamping, so the inner loops have no bounds checks
+	int paddedWidth = width + 2 * rx;
+	vector<uchar> padded((height + 2 * ry) * paddedWidth);
+	for (int y = 0; y < height + 2 * ry; ++y)
+	{
+		const uchar* row = img.ptr<uchar>(min(max(y - ry, 0), height - 1));
+		uchar* out = &padded[y * paddedWidth];
+		for (int x = 0; x < paddedWidth; ++x)
+		{
+			out[x] = row[min(max(x - rx, 0), width - 1)];
+		}
+	}
+
+	census.assign(width * height, 0);
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y)
+	{
+		const uchar* centre = &padded[(y + ry) * paddedWidth + rx];
+		uint64_t* out = &census[y * width];
+		// One neighbour offset at a time, across the whole row, so the loop over x vectorises
+		for (int n = -ry; n <= ry; ++n)
+		{
+			for (int m = -rx; m <= rx; ++m)
+			{
+				if (n == 0 && m == 0)
+					continue;
+				const uchar* neighbour = centre + n * paddedWidth + m;
+				for (int x = 0; x < width; ++x)
+				{
+					out[x] = (out[x] << 1) | (uint64_t)(neighbour[x] < centre[x]);
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+	Block matching
+
+	For each pixel in the first image, compare a window around it against the windows
+	around each candidate in [minDisparity, maxDisparity] along the same row of the second image,
+	and keep the disparity with the lowest cost. The cost is the sum over the window of either
+	absolute differences (SAD), squared differences (SSD), or census Hamming distances.
+
+	Summing every window from scratch costs O(window^2) for every pixel and every disparity.
+	Instead, for each disparity we compute the per-pixel cost once, and slide a box over it:
+	a running sum down each column, and a running sum along the row over those column sums.
+	Moving the box by one pixel adds one entry and removes one, so each window cost is O(1)
+	regardless of the window size, and the whole search is O(W*H*D).
+
+	The image is split into horizontal strips that are matched in parallel. Each strip keeps
+	its own column sums and best-so-far buffers, so no state is shared between threads.
+*/
+// Support functions
+template <MatchingCost cost>
+inline unsigned int MaxPixelCost()
+{
+	return cost == COST_SSD ? 255 * 255 : 255;
+}
+// Cost of matching row0 against row1 shifted by d, for every pixel in the row.
+// Pixels whose match would fall outside the second image get the maximum cost
+template <MatchingCost cost>
+void ComputeRowCost(const uchar* row0, const uchar* row1, int width, int d, unsigned int* rowCost)
+{
+	int xStart = min(max(d, 0), width);
+	int xEnd = max(min(width, width + d), xStart);
+	for (int x = 0; x < xStart; ++x)
+	{
+		rowCost[x] = MaxPixelCost<cost>();
+	}
+	for (int x = xStart; x < xEnd; ++x)
+	{
+		int diff = (int)row0[x] - (int)row1[x - d];
+		rowCost[x] = cost == COST_SSD ? (unsigned int)(diff * diff) : (unsigned int)abs(diff);
+	}
+	for (int x = xEnd; x < width; ++x)
+	{
+		rowCost[x] = MaxPixelCost<cost>();
+	}
+}
+// Hamming distance between the census words of row0 and row1 shifted by d.
+// Matches outside the second image get every bit wrong
+void ComputeCensusRowCost(const uint64_t* row0, const uint64_t* row1, int width, int d, int numBits, unsigned int* rowCost)
+{
+	int xStart = min(max(d, 0), width);
+	int xEnd = max(min(width, width + d), xStart);
+	for (int x = 0; x < xStart; ++x)
+	{
+		rowCost[x] = numBits;
+	}
+	for (int x = xStart; x < xEnd; ++x)
+	{
+		rowCost[x] = HammingDistance(row0[x], row1[x - d]);
+	}
+	for (int x = xEnd; x < width; ++x)
+	{
+		rowCost[x] = numBits;
+	}
+}
+// rowCost(y, d, out) fills in the per-pixel cost of row y at disparity d
+template <typename RowCostFn>
+void BlockMatchStrip(
+	const Mat& img0,
+	Mat& disparity,
+	int yStart,
+	int yEnd,
+	const DisparityParams& params,
+	RowCostFn rowCost)
+{
+	int width = img0.cols;
+	int height = img0.rows;
+	int r = params.windowSize / 2;
+	int stripHeight = yEnd - yStart;
+	short invalid = INVALID_DISPARITY(params.minDisparity);
+
+	vector<unsigned int> bestCost(width * stripHeight, UINT_MAX);
+	vector<short> bestDisparity(width * stripHeight, invalid);
+	vector<unsigned int> colSum(width);
+	vector<unsigned int> addRow(width);
+	vector<unsigned int> removeRow(width);
+
+	for (int d = params.minDisparity; d <= params.maxDisparity; ++d)
+	{
+		// Start the column sums on the window around the first row of the strip.
+		// Rows above and below the image are clamped to the border
+		fill(colSum.begin(), colSum.end(), 0);
+		for (int n = -r; n <= r; ++n)
+		{
+			int y = min(max(yStart + n, 0), height - 1);
+			rowCost(y, d, addRow.data());
+			for (int x = 0; x < width; ++x)
+			{
+				colSum[x] += addRow[x];
+			}
+		}
+
+		for (int y = yStart; y < yEnd; ++y)
+		{
+			if (y > yStart)
+			{
+				// Slide the window down a row: add the new bottom row, remove the old top row
+				int yAdd = min(y + r, height - 1);
+				int yRemove = max(y - r - 1, 0);
+				rowCost(yAdd, d, addRow.data());
+				rowCost(yRemove, d, removeRow.data());
+				for (int x = 0; x < width; ++x)
+				{
+					colSum[x] += addRow[x] - removeRow[x];
+				}
+			}
+
+			// Now slide the window along the row over the column sums
+			unsigned int windowSum = 0;
+			for (int m = -r; m <= r; ++m)
+			{
+				windowSum += colSum[min(max(m, 0), width - 1)];
+			}
+			unsigned int* best = &bestCost[(y - yStart) * width];
+			short* bestD = &bestDisparity[(y - yStart) * width];
+			for (int x = 0; x < width; ++x)
+			{
+				if (windowSum < best[x])
+				{
+					best[x] = windowSum;
+					bestD[x] = (short)d;
+				}
+				windowSum += colSum[min(x + r + 1, width - 1)] - colSum[max(x - r, 0)];
+			}
+		}
+	}
+
+	// Write out the winners. Pixels that are black in the first image are outside the
+	// rectified frame, and pixels whose best match falls outside the second image are
+	// not trustworthy, so neither gets a disparity
+	for (int y = yStart; y < yEnd; ++y)
+	{
+		const uchar* row0 = img0.ptr<uchar>(y);
+		const short* bestD = &bestDisparity[(y - yStart) * width];
+		short* out = disparity.ptr<short>(y);
+		for (int x = 0; x < width; ++x)
+		{
+			int match = x - bestD[x];
+			if (row0[x] == 0 || match < 0 || match >= width)
+			{
+				out[x] = invalid;
+			}
+			else
+			{
+				out[x] = bestD[x];
+			}
+		}
+	}
+}
+// Actual function
+bool ComputeDisparityBlockMatching(
+	_In_ const Mat& img0,
+	_In_ const Mat& img1,
+	_Out_ Mat& disparity,
+	_In_ const DisparityParams& params)
+{
+	if (!CheckDisparityInputs(img0, img1, params))
+	{
+		return false;
+	}
+	if (params.windowSize < 1 || params.windowSize % 2 == 0)
+	{
+		cout << "Invalid block matching parameters" << endl;
+		return false;
+	}
+
+	int width = img0.cols;
+	vector<uint64_t> census0, census1;
+	if (params.cost == COST_CENSUS)
+	{
+		if (!CensusTransform(img0, params.censusWidth, params.censusHeight, census0) ||
+			!CensusTransform(img1, params.censusWidth, params.censusHeight, census1))
+		{
+			return false;
+		}
+	}
+	int numBits = CensusBits(params.censusWidth, params.censusHeight);
+
+	disparity.create(img0.rows, img0.cols, CV_16S);
+
+	int numStrips = (img0.rows + BM_STRIP_HEIGHT - 1) / BM_STRIP_HEIGHT;
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < numStrips; ++s)
+	{
+		int yStart = s * BM_STRIP_HEIGHT;
+		int yEnd = min(yStart + BM_STRIP_HEIGHT, img0.rows);
+		if (params.cost == COST_CENSUS)
+		{
+			BlockMatchStrip(img0, disparity, yStart, yEnd, params, [&](int y, int d, unsigned int* out) {
+				ComputeCensusRowCost(&census0[y * width], &census1[y * width], width, d, numBits, out);
+			});
+		}
+		else if (params.cost == COST_SSD)
+		{
+			BlockMatchStrip(img0, disparity, yStart, yEnd, params, [&](int y, int d, unsigned int* out) {
+				ComputeRowCost<COST_SSD>(img0.ptr<uchar>(y), img1.ptr<uchar>(y), width, d, out);
+			});
+		}
+		else
+		{
+			BlockMatchStrip(img0, disparity, yStart, yEnd, params, [&](int y, int d, unsigned int* out) {
+				ComputeRowCost<COST_SAD>(img0.ptr<uchar>(y), img1.ptr<uchar>(y), width, d, out);
+			});
+		}
+	}
+
+	return true;
+}
+
+/*
+	Semi-Global Matching
+	https://core.ac.uk/download/pdf/11134866.pdf (Hirschmuller, 2008)
+
+	Block matching picks each pixel's disparity on its own, so it is noisy in low texture
+	and smears edges. SGM instead looks for the disparity image that minimises the matching
+	cost plus a penalty for disparity changes between neighbours: P1 for a change of one,
+	P2 for anything bigger. Doing this over the whole image is NP-hard, so SGM approximates it by 
+	solving the 1D version along several straight paths into each pixel and summing them:
+
+	L_r(p, d) = C(p, d) + min(L_r(p-r, d), L_r(p-r, d-1) + P1, L_r(p-r, d+1) + P1, min_k L_r(p-r, k) + P2)
+	            - min_k L_r(p-r, k)
+
+	The winning disparity is the one with the smallest sum S(p, d) = sum_r L_r(p, d).
+	Subtracting the previous minimum keeps L_r bounded by C + P2, so everything fits in 16 bits.
+
+	Layout: the costs for one pixel are stored contiguously, disparity-major, so the recurrence
+	above is a handful of vector min/add operations over d. Each pixel's run has a guard value
+	on either side so that d-1 and d+1 can be read without special cases.
+
+	Memory: the four paths that come from the left or from above (left, top-left, top, top-right)
+	only need the previous row and the previous pixel, so the forward pass streams rows with O(W*D)
+	storage. This is the 4 path mode, and the default. The other four paths run bottom-up, and need
+	the forward sums for every row to add to, so the 8 path mode keeps one W*H*D volume of 16-bit
+	sums, and has to be asked for.
+	The matching cost itself is streamed a row at a time too, rather than stored.
+*/
+// Support functions
+#define SGM_GUARD 0xFFFF
+#define SGM_PAD 16
+
+// Stride of one pixel's costs: the disparities padded to the vector width, plus a guard each side
+inline int SGMPixelStride(int numDisparities)
+{
+	int padded = (numDisparities + SGM_PAD - 1) / SGM_PAD * SGM_PAD;
+	return padded + 2;
+}
+/*
+	The windowed SAD or census cost for each row of a pass, in the disparity-major layout.
+	Rather than store the cost for the whole image, this keeps the horizontally box-summed
+	absolute differences for the rows under the window, and a running sum of those.
+	Each new row adds the row entering the window and removes the one leaving it.
+	Rows outside the image are clamped to the border, as in block matching.
+*/
+class SGMCostRows
+{
+public:
+	SGMCostRows(
+		const Mat& img0,
+		const Mat& img1,
+		const vector<uint64_t>& census0,
+		const vector<uint64_t>& census1,
+		const DisparityParams& params,
+		int stride,
+		bool forward) :
+		img0(img0),
+		img1(img1),
+		census0(census0),
+		census1(census1),
+		params(params),
+		stride(stride),
+		forward(forward),
+		next(0)
+	{
+		int width = img0.cols;
+		int r = params.sgmWindowSize / 2;
+		ring.resize(2 * r + 1);
+		for (auto& row : ring)
+		{
+			row.assign(width * stride, 0);
+		}
+		incoming.assign(width * stride, 0);
+		absDiff.assign(width * stride, 0);
+		cost.assign((width + 2) * stride, SGM_GUARD);
+	}
+
+	// Cost for the next row of the pass, pointing at pixel -1
+	const ushort* Next()
+	{
+		int width = img0.cols;
+		int height = img0.rows;
+		int r = params.sgmWindowSize / 2;
+		int numPadded = stride - 2;
+		int step = forward ? 1 : -1;
+		int y = forward ? next : height - 1 - next;
+
+		if (next == 0)
+		{
+			// Fill the whole window around the first row
+			for (int n = 0; n < (int)ring.size(); ++n)
+			{
+				ComputeBoxRow(ClampRow(y + step * (n - r)), ring[n]);
+			}
+			head = 0;
+			for (int x = 0; x < width; ++x)
+			{
+				ushort* c = &cost[(x + 1) * stride + 1];
+				fill(c, c + numPadded, 0);
+				for (auto& row : ring)
+				{
+					const ushort* h = &row[x * stride];
+					for (int d = 0; d < numPadded; ++d)
+					{
+						c[d] += h[d];
+					}
+				}
+			}
+		}
+		else
+		{
+			// Slide the window: the oldest row leaves, and the new row takes its slot
+			ComputeBoxRow(ClampRow(y + step * r), incoming);
+			for (int x = 0; x < width; ++x)
+			{
+				ushort* c = &cost[(x + 1) * stride + 1];
+				const ushort* in = &incoming[x * stride];
+				const ushort* out = &ring[head][x * stride];
+				for (int d = 0; d < numPadded; ++d)
+				{
+					c[d] = (ushort)(c[d] + in[d] - out[d]);
+				}
+			}
+			ring[head].swap(incoming);
+			head = (head + 1) % ring.size();
+		}
+
+		// Disparities past the real range are only padding, and must never win
+		int numDisparities = params.maxDisparity - params.minDisparity + 1;
+		for (int x = 0; x < width; ++x)
+		{
+			ushort* c = &cost[(x + 1) * stride + 1];
+			fill(c + numDisparities, c + numPadded, (ushort)SGM_GUARD);
+		}
+
+		next++;
+		return cost.data();
+	}
+
+private:
+	int ClampRow(int y) const
+	{
+		return min(max(y, 0), img0.rows - 1);
+	}
+
+	// Absolute differences (or census Hamming distances) for every pixel and disparity of row y,
+	// box-summed along the row. Matches outside the second image get the largest difference
+	void ComputeBoxRow(int y, vector<ushort>& out)
+	{
+		int width = img0.cols;
+		int r = params.sgmWindowSize / 2;
+		int numDisparities = params.maxDisparity - params.minDisparity + 1;
+		const uchar* row0 = img0.ptr<uchar>(y);
+		const uchar* row1 = img1.ptr<uchar>(y);
+
+		if (params.cost == COST_CENSUS)
+		{
+			const uint64_t* c0 = &census0[y * width];
+			const uint64_t* c1 = &census1[y * width];
+			ushort numBits = (ushort)CensusBits(params.censusWidth, params.censusHeight);
+			for (int x = 0; x < width; ++x)
+			{
+				ushort* a = &absDiff[x * stride];
+				for (int i = 0; i < numDisparities; ++i)
+				{
+					int match = x - params.minDisparity - i;
+					a[i] = (match < 0 || match >= width) ? numBits : (ushort)HammingDistance(c0[x], c1[match]);
+				}
+			}
+		}
+		else
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				ushort* a = &absDiff[x * stride];
+				int p = row0[x];
+				for (int i = 0; i < numDisparities; ++i)
+				{
+					int match = x - params.minDisparity - i;
+					a[i] = (match < 0 || match >= width) ? 255 : (ushort)abs(p - (int)row1[match]);
+				}
+			}
+		}
+
+		// Running box sum along the row, over whole disparity runs at a time
+		int numPadded = stride - 2;
+		ushort* sum = out.data();
+		fill(sum, sum + numPadded, 0);
+		for (int m = -r; m <= r; ++m)
+		{
+			const ushort* a = &absDiff[min(max(m, 0), width - 1) * stride];
+			for (int d = 0; d < numPadded; ++d)
+			{
+				sum[d] += a[d];
+			}
+		}
+		for (int x = 1; x < width; ++x)
+		{
+			const ushort* prev = &out[(x - 1) * stride];
+			const ushort* in = &absDiff[min(x + r, width - 1) * stride];
+			const ushort* leaving = &absDiff[max(x - r - 1, 0) * stride];
+			ushort* cur = &out[x * stride];
+			for (int d = 0; d < numPadded; ++d)
+			{
+				cur[d] = (ushort)(prev[d] + in[d] - leaving[d]);
+			}
+		}
+	}
+
+	const Mat& img0;
+	const Mat& img1;
+	const vector<uint64_t>& census0;
+	const vector<uint64_t>& census1;
+	const DisparityParams& params;
+	int stride;
+	bool forward;
+	int next;
+	size_t head = 0;
+	vector<vector<ushort>> ring;
+	vector<ushort> incoming;
+	vector<ushort> absDiff;
+	vector<ushort> cost;
+};
+/*
+	One step of the recurrence for one pixel along one path.
+	prev is L_r(p-r, .), cost is C(p, .), and out gets L_r(p, .), which is also added into sum.
+	All of these point at d = 0, with guards at [-1] and [numPadded].
+	Returns min_k L_r(p, k) for the next step.
+
+	There is a version for each instruction set, picked at run time with the same check
+	as descriptor matching, as MSVC doesn't say at compile time whether SSE4.1 is there.
+*/
+// Support functions
+TARGET_AVX2 ushort AggregatePixelAVX2(
+	const ushort* cost,
+	const ushort* prev,
+	ushort prevMin,
+	ushort P1,
+	ushort P2,
+	int numPadded,
+	ushort* out,
+	ushort* sum)
+{
+	ushort prevMinP2 = (ushort)min((int)prevMin + (int)P2, (int)SGM_GUARD);
+	__m256i vP1 = _mm256_set1_epi16((short)P1);
+	__m256i vPrevMinP2 = _mm256_set1_epi16((short)prevMinP2);
+	__m256i vPrevMin = _mm256_set1_epi16((short)prevMin);
+	__m256i vMin = _mm256_set1_epi16((short)SGM_GUARD);
+	for (int d = 0; d < numPadded; d += 16)
+	{
+		__m256i same = _mm256_loadu_si256((const __m256i*)(prev + d));
+		__m256i lower = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)(prev + d - 1)), vP1);
+		__m256i upper = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)(prev + d + 1)), vP1);
+		__m256i best = _mm256_min_epu16(_mm256_min_epu16(same, lower), _mm256_min_epu16(upper, vPrevMinP2));
+		__m256i L = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)(cost + d)), _mm256_sub_epi16(best, vPrevMin));
+		_mm256_storeu_si256((__m256i*)(out + d), L);
+		_mm256_storeu_si256((__m256i*)(sum + d), _mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)(sum + d)), L));
+		vMin = _mm256_min_epu16(vMin, L);
+	}
+	__m128i vMin128 = _mm_min_epu16(_mm256_castsi256_si128(vMin), _mm256_extracti128_si256(vMin, 1));
+	return (ushort)_mm_cvtsi128_si32(_mm_minpos_epu16(vMin128));
+}
+
+TARGET_SSE4 ushort AggregatePixelSSE4(
+	const ushort* cost,
+	const ushort* prev,
+	ushort prevMin,
+	ushort P1,
+	ushort P2,
+	int numPadded,
+	ushort* out,
+	ushort* sum)
+{
+	ushort prevMinP2 = (ushort)min((int)prevMin + (int)P2, (int)SGM_GUARD);
+	__m128i vP1 = _mm_set1_epi16((short)P1);
+	__m128i vPrevMinP2 = _mm_set1_epi16((short)prevMinP2);
+	__m128i vPrevMin = _mm_set1_epi16((short)prevMin);
+	__m128i vMin = _mm_set1_epi16((short)SGM_GUARD);
+	for (int d = 0; d < numPadded; d += 8)
+	{
+		__m128i same = _mm_loadu_si128((const __m128i*)(prev + d));
+		__m128i lower = _mm_adds_epu16(_mm_loadu_si128((const __m128i*)(prev + d - 1)), vP1);
+		__m128i upper = _mm_adds_epu16(_mm_loadu_si128((const __m128i*)(prev + d + 1)), vP1);
+		__m128i best = _mm_min_epu16(_mm_min_epu16(same, lower), _mm_min_epu16(upper, vPrevMinP2));
+		__m128i L = _mm_adds_epu16(_mm_loadu_si128((const __m128i*)(cost + d)), _mm_sub_epi16(best, vPrevMin));
+		_mm_storeu_si128((__m128i*)(out + d), L);
+		_mm_storeu_si128((__m128i*)(sum + d), _mm_adds_epu16(_mm_loadu_si128((const __m128i*)(sum + d)), L));
+		vMin = _mm_min_epu16(vMin, L);
+	}
+	return (ushort)_mm_cvtsi128_si32(_mm_minpos_epu16(vMin));
+}
+
+inline ushort AggregatePixelScalar(
+	const ushort* cost,
+	const ushort* prev,
+	ushort prevMin,
+	ushort P1,
+	ushort P2,
+	int numPadded,
+	ushort* out,
+	ushort* sum)
+{
+	ushort prevMinP2 = (ushort)min((int)prevMin + (int)P2, (int)SGM_GUARD);
+	ushort minL = SGM_GUARD;
+	for (int d = 0; d < numPadded; ++d)
+	{
+		int best = min(min((int)prev[d], (int)prev[d - 1] + P1), min((int)prev[d + 1] + P1, (int)prevMinP2));
+		ushort L = (ushort)min((int)cost[d] + best - prevMin, (int)SGM_GUARD);
+		out[d] = L;
+		sum[d] = (ushort)min((int)sum[d] + L, (int)SGM_GUARD);
+		minL = min(minL, L);
+	}
+	return minL;
+}
+// Actual function
+inline ushort AggregatePixel(
+	DescriptorKernel kernel,
+	const ushort* cost,
+	const ushort* prev,
+	ushort prevMin,
+	ushort P1,
+	ushort P2,
+	int numPadded,
+	ushort* out,
+	ushort* sum)
+{
+	if (kernel >= DESCRIPTOR_KERNEL_AVX2)
+	{
+		return AggregatePixelAVX2(cost, prev, prevMin, P1, P2, numPadded, out, sum);
+	}
+	if (kernel == DESCRIPTOR_KERNEL_SSE4)
+	{
+		return AggregatePixelSSE4(cost, prev, prevMin, P1, P2, numPadded, out, sum);
+	}
+	return AggregatePixelScalar(cost, prev, prevMin, P1, P2, numPadded, out, sum);
+}
+// Index of the smallest summed cost for one pixel
+// Support function
+TARGET_SSE4 int ArgMinCostSSE4(const ushort* sum, int numPadded)
+{
+	int bestIndex = 0;
+	int bestCost = SGM_GUARD + 1;
+	for (int d = 0; d < numPadded; d += 8)
+	{
+		int minpos = _mm_cvtsi128_si32(_mm_minpos_epu16(_mm_loadu_si128((const __m128i*)(sum + d))));
+		int c = minpos & 0xFFFF;
+		if (c < bestCost)
+		{
+			bestCost = c;
+			bestIndex = d + (minpos >> 16);
+		}
+	}
+	return bestIndex;
+}
+// Actual function
+inline int ArgMinCost(DescriptorKernel kernel, const ushort* sum, int numPadded)
+{
+	if (kernel >= DESCRIPTOR_KERNEL_SSE4)
+	{
+		return ArgMinCostSSE4(sum, numPadded);
+	}
+	return (int)(min_element(sum, sum + numPadded) - sum);
+}
+// Buffers for the path costs of one row along the four paths of one pass.
+// Pixels are offset by one, so that pixel -1 and pixel W are zero-cost borders where paths start
+struct SGMPathRows
+{
+	vector<ushort> L[4];
+	vector<ushort> minL[4];
+
+	void Init(int width, int stride)
+	{
+		for (int r = 0; r < 4; ++r)
+		{
+			L[r].assign((width + 2) * stride, 0);
+			minL[r].assign(width + 2, 0);
+			for (int x = 0; x < width + 2; ++x)
+			{
+				L[r][x * stride] = SGM_GUARD;
+				L[r][x * stride + stride - 1] = SGM_GUARD;
+			}
+		}
+	}
+};
+/*
+	One pass of four paths over the image.
+	Forward goes top to bottom, left to right, along the paths from the left, top-left, top and top-right.
+	Backward is the mirror image: bottom to top, right to left, from the right, bottom-right, bottom and bottom-left.
+	The path costs for each row are added into sumRow(y), and once the row is complete onRow(y) is called.
+*/
+template <typename SumRowFn, typename OnRowFn>
+void AggregateSGMPass(
+	const Mat& img0,
+	const Mat& img1,
+	const vector<uint64_t>& census0,
+	const vector<uint64_t>& census1,
+	const DisparityParams& params,
+	bool forward,
+	SumRowFn sumRow,
+	OnRowFn onRow)
+{
+	int width = img0.cols;
+	int height = img0.rows;
+	int numDisparities = params.maxDisparity - params.minDisparity + 1;
+	int stride = SGMPixelStride(numDisparities);
+	int numPadded = stride - 2;
+	int area = params.sgmWindowSize * params.sgmWindowSize;
+	ushort P1 = (ushort)min(params.sgmP1 * area, (int)SGM_GUARD);
+	ushort P2 = (ushort)min(max(params.sgmP2, params.sgmP1) * area, (int)SGM_GUARD);
+
+	SGMPathRows rows[2];
+	rows[0].Init(width, stride);
+	rows[1].Init(width, stride);
+	SGMCostRows costRows(img0, img1, census0, census1, params, stride, forward);
+	DescriptorKernel kernel = GetDescriptorKernel();
+
+	// The step to the previous pixel along each path
+	// Index 0 is within the row, 1-3 are in the previous row
+	int step = forward ? 1 : -1;
+	int prevOffset[4] = { -step, -step, 0, step };
+
+	for (int i = 0; i < height; ++i)
+	{
+		int y = forward ? i : height - 1 - i;
+		SGMPathRows& cur = rows[i % 2];
+		SGMPathRows& prev = rows[(i + 1) % 2];
+		if (i == 0)
+		{
+			// Paths start on the first row with nothing before them
+			prev.Init(width, stride);
+		}
+
+		const ushort* cost = costRows.Next();
+		ushort* sum = sumRow(y);
+
+		for (int j = 0; j < width; ++j)
+		{
+			int x = forward ? j : width - 1 - j;
+			int idx = x + 1;
+			const ushort* c = cost + idx * stride + 1;
+			ushort* s = sum + x * stride + 1;
+			for (int r = 0; r < 4; ++r)
+			{
+				int prevIdx = idx + prevOffset[r];
+				const SGMPathRows& from = r == 0 ? cur : prev;
+				cur.minL[r][idx] = AggregatePixel(
+					kernel,
+					c,
+					&from.L[r][prevIdx * stride + 1],
+					from.minL[r][prevIdx],
+					P1,
+					P2,
+					numPadded,
+					&cur.L[r][idx * stride + 1],
+					s);
+			}
+		}
+
+		onRow(y);
+	}
+}
+// Pick the winners for row y from the summed costs
+void SelectSGMDisparities(
+	const Mat& img0,
+	const ushort* sum,
+	int y,
+	int stride,
+	const DisparityParams& params,
+	Mat& disparity)
+{
+	int width = img0.cols;
+	short invalid = INVALID_DISPARITY(params.minDisparity);
+	const uchar* row0 = img0.ptr<uchar>(y);
+	short* out = disparity.ptr<short>(y);
+	DescriptorKernel kernel = GetDescriptorKernel();
+	for (int x = 0; x < width; ++x)
+	{
+		int d = params.minDisparity + ArgMinCost(kernel, sum + x * stride + 1, stride - 2);
+		int match = x - d;
+		if (row0[x] == 0 || match < 0 || match >= width)
+		{
+			out[x] = invalid;
+		}
+		else
+		{
+			out[x] = (short)d;
+		}
+	}
+}
+// Actual function
+bool ComputeDisparitySGM(
+	_In_ const Mat& img0,
+	_In_ const Mat& img1,
+	_Out_ Mat& disparity,
+	_In_ const DisparityParams& params)
+{
+	if (!CheckDisparityInputs(img0, img1, params))
+	{
+		return false;
+	}
+	if (params.sgmWindowSize < 1 || params.sgmWindowSize % 2 == 0)
+	{
+		cout << "Invalid SGM window size" << endl;
+		return false;
+	}
+	if (params.cost == COST_SSD)
+	{
+		cout << "SGM only supports the SAD and census matching costs" << endl;
+		return false;
+	}
+	// The window costs are summed in 16 bits, so the largest possible sum has to stay below the guard
+	int maxPixelCost = params.cost == COST_CENSUS ? CensusBits(params.censusWidth, params.censusHeight) : 255;
+	if ((int64_t)params.sgmWindowSize * params.sgmWindowSize * maxPixelCost >= SGM_GUARD)
+	{
+		cout << "SGM window is too large for 16-bit costs" << endl;
+		return false;
+	}
+	if (params.sgmPaths != 4 && params.sgmPaths != 8)
+	{
+		cout << "SGM supports 4 or 8 paths" << endl;
+		return false;
+	}
+
+	vector<uint64_t> census0, census1;
+	if (params.cost == COST_CENSUS)
+	{
+		if (!CensusTransform(img0, params.censusWidth, params.censusHeight, census0) ||
+			!CensusTransform(img1, params.censusWidth, params.censusHeight, census1))
+		{
+			return false;
+		}
+	}
+
+	int width = img0.cols;
+	int height = img0.rows;
+	int stride = SGMPixelStride(params.maxDisparity - params.minDisparity + 1);
+	disparity.create(height, width, CV_16S);
+
+	if (params.sgmPaths == 4)
+	{
+		// Fully streamed: one row of sums, consumed as soon as the row is done
+		vector<ushort> sum(width * stride);
+		AggregateSGMPass(img0, img1, census0, census1, params, true,
+			[&](int) { fill(sum.begin(), sum.end(), 0); return sum.data(); },
+			[&](int y) { SelectSGMDisparities(img0, sum.data(), y, stride, params, disparity); });
+		return true;
+	}
+
+	// 8 paths: the forward pass leaves its sums in the volume, the backward pass adds to them
+	// and picks the winners as it goes
+	vector<ushort> volume((size_t)height * width * stride, 0);
+	AggregateSGMPass(img0, img1, census0, census1, params, true,
+		[&](int y) { return &volume[(size_t)y * width * stride]; },
+		[&](int) {});
+	AggregateSGMPass(img0, img1, census0, census1, params, false,
+		[&](int y) { return &volume[(size_t)y * width * stride]; },
+		[&](int y) { SelectSGMDisparities(img0, &volume[(size_t)y * width * stride], y, stride, params, disparity); });
+
+	return true;
+}
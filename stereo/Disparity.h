@@ -0,0 +1,95 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cstdint>
+
+// Parameters to tune
+#define MIN_DISPARITY 0
+#define MAX_DISPARITY 80
+#define BM_WINDOW 9
+#define BM_STRIP_HEIGHT 32
+
+// SGM parameters. The penalties are per pixel of the matching window,
+// so they scale with the window cost, and are in the units of the matching cost.
+// The window costs are summed in 16 bits, so the window can be at most 15 for SAD, or 31 for census
+#define SGM_WINDOW 5
+#define SGM_P1 8
+#define SGM_P2 32
+// 4 paths stream the image a row at a time. 8 paths are smoother, but keep a 16-bit sum
+// for every pixel and disparity, hundreds of MB for a full size Middlebury pair
+#define SGM_PATHS 4
+
+// Census window. Must be odd both ways, with at most 65 pixels, as the centre is skipped
+// Census costs are counted in bits rather than intensities, so SGM wants different penalties
+#define CENSUS_WIDTH 9
+#define CENSUS_HEIGHT 7
+#define SGM_CENSUS_P1 2
+#define SGM_CENSUS_P2 24
+
+// The value that pixels with no valid disparity are given in the output
+// This follows the OpenCV convention of minDisparity - 1
+#define INVALID_DISPARITY(minDisparity) ((minDisparity) - 1)
+
+enum DisparityMethod
+{
+	DISPARITY_BLOCK_MATCHING,
+	DISPARITY_SGM
+};
+
+enum MatchingCost
+{
+	COST_SAD,
+	COST_SSD,
+	COST_CENSUS
+};
+
+/*
+	Parameters for the disparity search.
+	The search range is inclusive on both ends, and is the offset x0 - x1
+	between a pixel in the first (left) image and its match in the second.
+*/
+struct DisparityParams
+{
+	int minDisparity = MIN_DISPARITY;
+	int maxDisparity = MAX_DISPARITY;
+	int windowSize = BM_WINDOW;
+	MatchingCost cost = COST_SAD;
+	DisparityMethod method = DISPARITY_BLOCK_MATCHING;
+
+	// Only used by the census cost
+	int censusWidth = CENSUS_WIDTH;
+	int censusHeight = CENSUS_HEIGHT;
+
+	// Only used by SGM
+	int sgmWindowSize = SGM_WINDOW;
+	int sgmP1 = SGM_P1;
+	int sgmP2 = SGM_P2;
+	int sgmPaths = SGM_PATHS;
+};
+
+/*
+	Disparity functions
+*/
+bool CensusTransform(
+	_In_ const cv::Mat& img,
+	_In_ int windowWidth,
+	_In_ int windowHeight,
+	_Out_ std::vector<uint64_t>& census);
+
+bool ComputeDisparity(
+	_In_ const cv::Mat& img0,
+	_In_ const cv::Mat& img1,
+	_Out_ cv::Mat& disparity,
+	_In_ const DisparityParams& params);
+
+bool ComputeDisparityBlockMatching(
+	_In_ const cv::Mat& img0,
+	_In_ const cv::Mat& img1,
+	_Out_ cv::Mat& disparity,
+	_In_ const DisparityParams& params);
+
+bool ComputeDisparitySGM(
+	_In_ const cv::Mat& img0,
+	_In_ const cv::Mat& img1,
+	_Out_ cv::Mat& disparity,
+	_In_ const DisparityParams& params);
@@ -3,8 +3,8 @@
 #include <algorithm>
 #include <Eigen/SVD>
 #include "Estimation.h"
+#include "Ransac.h"
 #include <stdlib.h>
-#include <time.h>
 
 using namespace cv;
 using namespace std;
@@ -20,7 +20,8 @@ using namespace Eigen;
 	Take the best of these.
 	Repeat for another random four.
 
-	We'll do this a maximum number of times, and remember the best.
+	We'll do this a maximum number of times, and remember the best. With lots of inliers,
+	we can be confident we've seen a good sample long before that, so we stop early - see Ransac.h.
 	If we never find a homography that produces matches below the epsilon, well,
 	maybe this image pair just ain't good, yeah?
 
@@ -31,25 +32,6 @@ using namespace Eigen;
 	I don't normalise, and I get results that are fine. 
 */
 // Support functions
-void GetRandomFourIndices(int& i1, int& i2, int& i3, int& i4, int max, const vector<pair<Feature, Feature> >& matches)
-{
-	i1 = rand() % max;
-
-	do
-	{
-		i2 = rand() % max;
-	} while (i2 == i1);
-
-	do
-	{
-		i3 = rand() % max;
-	} while (i3 == i1 || i3 == i2);
-
-	do
-	{
-		i4 = rand() % max;
-	} while (i4 == i1 || i4 == i2 || i4 == i3);
-}
 // Normalise points
 pair<Matrix3f, Matrix3f> ConvertPoints(const vector<pair<Feature, Feature> >& matches)
 {
@@ -98,9 +80,6 @@ pair<Matrix3f, Matrix3f> ConvertPoints(const vector<pair<Feature, Feature> >& ma
 // Actual function
 bool FindHomography(Matrix3f& homography, vector<pair<Feature,Feature> > matches)
 {
-	// Initialise RNG
-	srand((unsigned int)time(NULL));
-
 	// Get normalisation matrices, and normalise all points in the matches
 	// This distributes the points across a normal distribution, mean 0 std dev 1. 
 	// This is to counteract any uneven distribution of points, that might weight a homography
@@ -127,46 +106,46 @@ bool FindHomography(Matrix3f& homography, vector<pair<Feature,Feature> > matches
 	// Create a homography, perform the tests, refine etc, see how it is
 	// If it meets the bar for quality, break. 
 	// If not, keep trying
-	size_t maxInliers = 0;
-	Matrix3f bestH;
-	size_t numMatches = matches.size();
-	vector<pair<Feature, Feature> > inlierSet;
-	for (int k = 0; k < MAX_RANSAC_ITERATIONS; ++k)
+	RansacParams params;
+	params.maxIterations = MAX_RANSAC_ITERATIONS;
+	// The four matches a homography was made from always fit it
+	params.minInliers = 5;
+
+	auto solve = [&matches](const int* sample, Matrix3f* H)
 	{
-		// Pick four random matches by generating four random indices
-		// and ensuring they are not equal
-		int i1, i2, i3, i4;
-		GetRandomFourIndices(i1, i2, i3, i4, (int)numMatches, matches);
-		
 		// Get the points for those features and generate the homography
 		// Since we match from left to right, and the homography goes from right
 		// to left, the first in the pair is the feature on the right, and the second on the left
 		vector<pair<Point2f, Point2f>> points;
-		Matrix3f H;
-		points.push_back(make_pair(matches[i1].second.p, matches[i1].first.p));
-		points.push_back(make_pair(matches[i2].second.p, matches[i2].first.p));
-		points.push_back(make_pair(matches[i3].second.p, matches[i3].first.p));
-		points.push_back(make_pair(matches[i4].second.p, matches[i4].first.p));
-		if (!GetHomographyFromMatches(points, H))
-			continue;
-		
-		// Test the homography again all matches
-		// Normalise homography
-		H /= H(2, 2);
-		auto set = EvaluateHomography(matches, H);
-		if (set.size() > maxInliers)
+		for (int i = 0; i < 4; ++i)
 		{
-			maxInliers = inlierSet.size();
-			inlierSet = set;
-			bestH = H;
+			points.push_back(make_pair(matches[sample[i]].second.p, matches[sample[i]].first.p));
 		}
+		return GetHomographyFromMatches(points, H[0]) ? 1 : 0;
+	};
+	auto score = [&matches](const Matrix3f& H, RansacScore& score, unsigned char* inliers)
+	{
+		// Test the homography against all matches
+		score.inliers = CountHomographyInliers(matches, H, score.cost, inliers);
+		return true;
+	};
 
-		// TODO: add L-M here
-
-		// Not enough inliers. Loop again
+	Matrix3f bestH;
+	RansacResult<4> result;
+	size_t maxInliers = 0;
+	vector<pair<Feature, Feature> > inlierSet;
+	// Try the closest descriptor matches first
+	vector<int> order = OrderMatchesByQuality(matches);
+	ProsacSampler sampler(order, 4);
+	if (RunRANSAC<Matrix3f, 4, 1>((int)matches.size(), params, solve, score, sampler, bestH, result))
+	{
+		inlierSet = EvaluateHomography(matches, bestH);
+		maxInliers = inlierSet.size();
 	}
 
-	cout << "max inliers: " << maxInliers << endl;
+	// TODO: add L-M here
+
+	cout << "max inliers: " << maxInliers << " after " << result.iterations << " iterations" << endl;
 
 	if (maxInliers != 0)
 	{
@@ -224,7 +203,7 @@ bool FindHomography(Matrix3f& homography, vector<pair<Feature,Feature> > matches
 	Since V's columns are eigenvectors of AT * A
 	But whatever
 */
-bool GetHomographyFromMatches(const vector<pair<Point2f, Point2f>> points, Matrix3f& H)
+bool GetHomographyFromMatches(const vector<pair<Point2f, Point2f>>& points, Matrix3f& H)
 {
 	// Construct A
 	Matrix<float, 8, 9> A;
@@ -280,43 +259,71 @@ bool GetHomographyFromMatches(const vector<pair<Point2f, Point2f>> points, Matri
 	These can be added to get a good idea of the total error.
 
 	We count the number of inliers, and return the inlier set and TODO: the error
+
+	RANSAC only needs the count, so CountHomographyInliers gets that without copying
+	any features, and returns the total error of the inliers. It can also flag which
+	matches are inliers.
 */
+// Support function
+inline float HomographyTransferError(const pair<Feature, Feature>& match, const Matrix3f& H, const Matrix3f& Hinverse)
+{
+	// Convert both points to Eigen points
+	Vector3f x(match.second.p.x, match.second.p.y, 1);
+	Vector3f xprime(match.first.p.x, match.first.p.y, 1);
+
+	Vector3f Hx = H * x;
+
+	// Normalise
+	Hx /= Hx(2);
+
+	Vector3f Hxprime = Hinverse * xprime;
+	Hxprime /= Hxprime(2);
+
+	// Use total reprojection error
+	// This is L2(x' - Hx) + L2(x - Hinverse x')
+	auto projectiveDiff = xprime - Hx;
+	auto reprojectiveDiff = x - Hxprime;
+	return projectiveDiff.norm() + reprojectiveDiff.norm();
+}
+// Actual functions
 vector<pair<Feature, Feature> > EvaluateHomography(const vector<pair<Feature,Feature> >& matches, const Matrix3f& H)
 {
-	vector<float> diffs;
-	int numInliers = 0;
-	float allError = 0;
 	vector<pair<Feature, Feature>> inlierSet;
+	Matrix3f Hinverse = H.inverse();
 	// Over all matches
 	for (unsigned int i = 0; i < matches.size(); ++i)
 	{
-		// Convert both points to Eigen points
-		Vector3f x(matches[i].second.p.x, matches[i].second.p.y, 1);
-		Vector3f xprime(matches[i].first.p.x, matches[i].first.p.y, 1);
-
-		Vector3f Hx = H * x;
-
-		// Normalise
-		Hx /= Hx(2);
-
-		Vector3f Hxprime = H.inverse() * xprime;
-		Hxprime /= Hxprime(2);
-
-		// Use total reprojection error
-		// This is L2(x' - Hx) + L2(x - Hinverse x')
-		auto projectiveDiff = xprime - Hx;
-		auto reprojectiveDiff = x - Hxprime;
-		float totalError = projectiveDiff.norm() + reprojectiveDiff.norm();
+		float totalError = HomographyTransferError(matches[i], H, Hinverse);
 		if (totalError < POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER)
 		{
-			numInliers++;
 			inlierSet.push_back(matches[i]);
 		}
-		allError += totalError;
 	}
 
 	return inlierSet;
 }
+int CountHomographyInliers(const vector<pair<Feature, Feature> >& matches, const Matrix3f& H, float& inlierError, unsigned char* inliers)
+{
+	int numInliers = 0;
+	inlierError = 0;
+	Matrix3f Hinverse = H.inverse();
+	for (unsigned int i = 0; i < matches.size(); ++i)
+	{
+		float totalError = HomographyTransferError(matches[i], H, Hinverse);
+		bool inlier = totalError < POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER;
+		if (inlier)
+		{
+			numInliers++;
+			inlierError += totalError;
+		}
+		if (inliers != nullptr)
+		{
+			inliers[i] = inlier ? 1 : 0;
+		}
+	}
+
+	return numInliers;
+}
 
 /*
 	Bundle Adjustment
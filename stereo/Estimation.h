@@ -23,10 +23,15 @@ bool FindHomography(Eigen::Matrix3f& homography, std::vector<std::pair<Feature,
 std::pair<Eigen::Matrix3f, Eigen::Matrix3f> ConvertPoints(const std::vector<std::pair<Feature, Feature> >& matches);
 
 // Estimate Homography
-bool GetHomographyFromMatches(const std::vector<std::pair<cv::Point2f, cv::Point2f>> points, Eigen::Matrix3f& H);
+bool GetHomographyFromMatches(const std::vector<std::pair<cv::Point2f, cv::Point2f>>& points, Eigen::Matrix3f& H);
 
 // Evaluate Homography
 std::vector<std::pair<Feature, Feature> > EvaluateHomography(const std::vector<std::pair<Feature, Feature> >& matches, const Eigen::Matrix3f& H);
+int CountHomographyInliers(
+	const std::vector<std::pair<Feature, Feature> >& matches,
+	const Eigen::Matrix3f& H,
+	float& inlierError,
+	unsigned char* inliers = nullptr);
 float ErrorInHomography(const std::vector<std::pair<Feature, Feature> >& matches, const Eigen::Matrix3f& H);
 
 // Bundle Adjustment
@@ -1,5 +1,7 @@
 #include "Features.h"
 #include "Stereography.h"
+#include "Matching.h"
+#include "ScaleSpace.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <errno.h>
@@ -7,6 +9,12 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <climits>
+#include <cfloat>
+#include <immintrin.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace cv;
 using namespace std;
@@ -42,43 +50,274 @@ void CreateGaussianKernel(Mat& img, float sigma)
 	For each feature, within a window around it, if it is the strongest feature then
 	remove all others; otherwise move on, it will be removed as part of the other feature's window
 
-	TODO: This can be made WAY more efficient with a kd-tree
-	since this is the most time consuming part of the feature extraction
+	Rather than comparing every feature with every other, the features are bucketed
+	into a grid with cells just bigger than the window, so each only needs to look at
+	the features in its own and the eight neighbouring cells.
+	The survivors, and their order, are the same as comparing every pair.
 */
-vector<Feature> ClusterFeatures(vector<Feature>& features, const int windowSize)
-{ 
+vector<Feature> ClusterFeatures(_In_ const vector<Feature>& features, _In_ float windowSize)
+{
 	vector<Feature> temp;
-	for (unsigned int n = 0; n < features.size(); ++n)
+	int numFeatures = (int)features.size();
+	if (numFeatures == 0)
+	{
+		return temp;
+	}
+
+	// Two features are in each other's window when the whole pixels between them are
+	// within the window size, so a cell one pixel wider than that holds every neighbour
+	// either in the same cell or the next one over
+	float cellSize = max(1.f, floor(windowSize) + 1);
+	float minX = features[0].p.x;
+	float minY = features[0].p.y;
+	float maxX = minX;
+	float maxY = minY;
+	for (auto& f : features)
+	{
+		minX = min(minX, f.p.x);
+		minY = min(minY, f.p.y);
+		maxX = max(maxX, f.p.x);
+		maxY = max(maxY, f.p.y);
+	}
+	int gridWidth = (int)((maxX - minX) / cellSize) + 1;
+	int gridHeight = (int)((maxY - minY) / cellSize) + 1;
+
+	// Counting sort of the features by cell
+	vector<int> cellX(numFeatures);
+	vector<int> cellY(numFeatures);
+	vector<int> cellStart((size_t)gridWidth * gridHeight + 1, 0);
+	for (int i = 0; i < numFeatures; ++i)
+	{
+		cellX[i] = min((int)((features[i].p.x - minX) / cellSize), gridWidth - 1);
+		cellY[i] = min((int)((features[i].p.y - minY) / cellSize), gridHeight - 1);
+		++cellStart[(size_t)cellY[i] * gridWidth + cellX[i] + 1];
+	}
+	for (size_t c = 1; c < cellStart.size(); ++c)
+	{
+		cellStart[c] += cellStart[c - 1];
+	}
+	vector<int> cellFeatures(numFeatures);
+	vector<int> cellFill(cellStart.begin(), cellStart.end() - 1);
+	for (int i = 0; i < numFeatures; ++i)
+	{
+		cellFeatures[cellFill[(size_t)cellY[i] * gridWidth + cellX[i]]++] = i;
+	}
+
+	vector<unsigned char> isMaximum(numFeatures, 1);
+#pragma omp parallel for schedule(dynamic, 1024)
+	for (int n = 0; n < numFeatures; ++n)
 	{
 		auto& f = features[n];
 		bool thisFeatureIsTheMaximum = true;
-		for (int i = 0; i < features.size(); ++i)
+		for (int cy = max(cellY[n] - 1, 0); cy <= min(cellY[n] + 1, gridHeight - 1) && thisFeatureIsTheMaximum; ++cy)
 		{
-			if (i == n)
-				continue;
-
-			auto& f2 = features[i];
-			int xmargin = (int)abs(f.p.x - f2.p.x);
-			int ymargin = (int)abs(f.p.y - f2.p.y);
-			if (xmargin <= windowSize && ymargin <= windowSize)
+			for (int cx = max(cellX[n] - 1, 0); cx <= min(cellX[n] + 1, gridWidth - 1) && thisFeatureIsTheMaximum; ++cx)
 			{
-				if (f.score < f2.score)
+				size_t cell = (size_t)cy * gridWidth + cx;
+				for (int k = cellStart[cell]; k < cellStart[cell + 1]; ++k)
 				{
-					thisFeatureIsTheMaximum = false;
-					break;
+					int i = cellFeatures[k];
+					if (i == n)
+						continue;
+
+					auto& f2 = features[i];
+					int xmargin = (int)abs(f.p.x - f2.p.x);
+					int ymargin = (int)abs(f.p.y - f2.p.y);
+					if (xmargin <= windowSize && ymargin <= windowSize)
+					{
+						if (f.score < f2.score)
+						{
+							thisFeatureIsTheMaximum = false;
+							break;
+						}
+					}
 				}
 			}
 		}
+		isMaximum[n] = thisFeatureIsTheMaximum;
+	}
 
-		if (thisFeatureIsTheMaximum)
+	for (int n = 0; n < numFeatures; ++n)
+	{
+		if (isMaximum[n])
 		{
-			temp.push_back(f);
+			temp.push_back(features[n]);
 		}
 	}
 
 	return temp;
 }
 
+/*
+	Structure tensor
+
+	Rather than summing the gradient products over a window separately for every pixel
+	or feature we score, build the three sums for the whole image once.
+	The Gaussian weighting is separable, so each sum is a pass along the rows and then
+	one down the columns, costing two window widths per pixel rather than the window area.
+	Each score is then a few arithmetic operations on the three planes.
+
+	Samples outside the image count as zero, so pixels closer to the edge than half a
+	window only sum what's inside.
+
+	The window is centred on the pixel, so its size has to be odd.
+*/
+// Support functions
+// The 1D factor of the kernel from CreateGaussianKernel, centred on the middle tap
+vector<float> GaussianTaps(int windowSize, float sigma)
+{
+	vector<float> taps(windowSize);
+	for (int i = 0; i < windowSize; ++i)
+	{
+		float x = i - (windowSize - 1) / 2.f;
+		taps[i] = exp(-x * x / (2 * sigma * sigma)) / (sqrt(2.f * (float)M_PI) * sigma);
+	}
+	return taps;
+}
+
+// Weighted sum along one row, with nothing outside it
+void RowWindowSum(const float* in, const vector<float>& taps, int width, float* out)
+{
+	int radius = (int)taps.size() / 2;
+	for (int x = 0; x < width; ++x)
+	{
+		out[x] = 0;
+	}
+	// One tap at a time along the whole row, so this vectorises
+	for (int k = -radius; k <= radius; ++k)
+	{
+		float w = taps[k + radius];
+		int begin = max(0, -k);
+		int end = min(width, width - k);
+		for (int x = begin; x < end; ++x)
+		{
+			out[x] += w * in[x + k];
+		}
+	}
+}
+
+// Weighted sum down the columns, a whole row at a time
+void ColumnWindowSum(const Mat& src, const vector<float>& taps, Mat& dst)
+{
+	int width = src.cols;
+	int height = src.rows;
+	int radius = (int)taps.size() / 2;
+	dst.create(height, width, CV_32F);
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y)
+	{
+		float* out = dst.ptr<float>(y);
+		for (int x = 0; x < width; ++x)
+		{
+			out[x] = 0;
+		}
+		int begin = max(-radius, -y);
+		int end = min(radius, height - 1 - y);
+		for (int k = begin; k <= end; ++k)
+		{
+			const float* in = src.ptr<float>(y + k);
+			float w = taps[k + radius];
+			for (int x = 0; x < width; ++x)
+			{
+				out[x] += w * in[x];
+			}
+		}
+	}
+}
+
+// The gradient products for each row are summed along the row straight away,
+// so only the row sums are ever stored for the whole image
+template <typename T>
+void GradientProductRowSums(const Mat& grad_x, const Mat& grad_y, const vector<float>& taps, Mat& xx, Mat& xy, Mat& yy)
+{
+	int width = grad_x.cols;
+	xx.create(grad_x.rows, width, CV_32F);
+	xy.create(grad_x.rows, width, CV_32F);
+	yy.create(grad_x.rows, width, CV_32F);
+#pragma omp parallel
+	{
+		vector<float> products(3 * width);
+		float* productXX = &products[0];
+		float* productXY = &products[width];
+		float* productYY = &products[2 * width];
+#pragma omp for
+		for (int y = 0; y < grad_x.rows; ++y)
+		{
+			const T* gx = grad_x.ptr<T>(y);
+			const T* gy = grad_y.ptr<T>(y);
+			for (int x = 0; x < width; ++x)
+			{
+				float dx = (float)gx[x];
+				float dy = (float)gy[x];
+				productXX[x] = dx * dx;
+				productXY[x] = dx * dy;
+				productYY[x] = dy * dy;
+			}
+			RowWindowSum(productXX, taps, width, xx.ptr<float>(y));
+			RowWindowSum(productXY, taps, width, xy.ptr<float>(y));
+			RowWindowSum(productYY, taps, width, yy.ptr<float>(y));
+		}
+	}
+}
+
+// The scores, from the tensor at one pixel
+inline float HarrisScore(const StructureTensor& tensor, int x, int y)
+{
+	float a = tensor.xx.at<float>(y, x);
+	float b = tensor.xy.at<float>(y, x);
+	float c = tensor.yy.at<float>(y, x);
+	// This is R = det(M) - k * (trace(M))^2
+	float trace = a + c;
+	return a * c - b * b - HARRIS_CONSTANT * trace * trace;
+}
+
+inline float ShiTomasiScore(const StructureTensor& tensor, int x, int y)
+{
+	float a = tensor.xx.at<float>(y, x);
+	float b = tensor.xy.at<float>(y, x);
+	float c = tensor.yy.at<float>(y, x);
+	// The smaller root of e^2 - trace e + det = 0
+	float trace = a + c;
+	float det = a * c - b * b;
+	return (trace - sqrt(max(trace * trace - 4 * det, 0.f))) / 2;
+}
+
+inline float TensorDeterminant(const StructureTensor& tensor, int x, int y)
+{
+	return tensor.xx.at<float>(y, x) * tensor.yy.at<float>(y, x) - tensor.xy.at<float>(y, x) * tensor.xy.at<float>(y, x);
+}
+static_assert(HARRIS_WINDOW % 2 == 1 && ST_WINDOW % 2 == 1 && DOH_WINDOW % 2 == 1,
+	"structure tensor windows must have a centre pixel");
+// Actual function
+bool ComputeStructureTensor(
+	_In_ const Mat& grad_x,
+	_In_ const Mat& grad_y,
+	_In_ int windowSize,
+	_In_ float sigma,
+	_Out_ StructureTensor& tensor)
+{
+	if (windowSize < 1 || windowSize % 2 == 0)
+	{
+		cout << "Structure tensor window size must be odd and positive, not " << windowSize << endl;
+		return false;
+	}
+
+	vector<float> taps = GaussianTaps(windowSize, sigma);
+	Mat xx, xy, yy;
+	if (grad_x.depth() == CV_8U)
+	{
+		GradientProductRowSums<uchar>(grad_x, grad_y, taps, xx, xy, yy);
+	}
+	else
+	{
+		GradientProductRowSums<float>(grad_x, grad_y, taps, xx, xy, yy);
+	}
+	ColumnWindowSum(xx, taps, tensor.xx);
+	ColumnWindowSum(xy, taps, tensor.xy);
+	ColumnWindowSum(yy, taps, tensor.yy);
+	return true;
+}
+
 /*
 	Harris corners
 
@@ -90,88 +329,76 @@ vector<Feature> ClusterFeatures(vector<Feature>& features, const int windowSize)
 	We can technically leverage the scoring function I have below, by setting up certain vaues of
 	pixels as features, but I prefer to just implement this function.
 
-	I'm going to use a sliding window of size 5 and shift by two pixels every time.
-	This doesn't save much time but hey
+	The window sums come from the structure tensor, which is built once per level,
+	so every pixel gets scored rather than every second one.
+
+	The levels come from a Gaussian scale space pyramid, and each feature's scale is the
+	index of the level it was found at. Positions are in pixels of the input image.
+	Pass a pool to reuse the level and gradient buffers from one image to the next.
 */
 // Support functions
 
 // Actual function
-vector<Feature> FindHarrisCorners(const Mat& input, int nmsWindowSize)
+vector<Feature> FindHarrisCorners(const Mat& input, int nmsWindowSize, ImagePool* pool)
 {
 	vector<Feature> features;
-	Mat img = input.clone();
+	ImagePool localPool;
+	if (pool == nullptr)
+	{
+		pool = &localPool;
+	}
 
 	// Get features over a scale pyramid
-	// each level of the pyramid, we halve the size of the image
-	// This is done 4 times
-	for (int s = 1; s < SCALE_PYRAMID_LEVELS; ++s)
+	// each octave of the pyramid, we halve the size of the image
+	// The pyramid is already blurred, so it takes the place of blurring before the gradient
+	ScaleSpacePyramid pyramid;
+	if (!BuildScaleSpacePyramid(input, SCALE_PYRAMID_OCTAVES, SCALE_LEVELS_PER_OCTAVE, *pool, pyramid))
+	{
+		return features;
+	}
+	for (int s = 0; s < (int)pyramid.levels.size(); ++s)
 	{
-		// Halve the image size
-		Mat dst;
-		resize(img, dst, Size(), 0.5, 0.5, CV_INTER_LINEAR);
-		img = dst;
+		const Mat& img = pyramid.levels[s].image;
+		int octaveScale = OctaveScaleFactor(pyramid.levels[s].octave);
 
 		// Now get features
 		// Compute image gradient
-		Mat sobel;
-		GaussianBlur(img, sobel, Size(HARRIS_WINDOW, HARRIS_WINDOW), 1, 1, BORDER_DEFAULT);
-		Mat grad_x, grad_y;
+		Mat grad_x = AcquireImage(*pool, img.rows, img.cols, CV_8U);
+		Mat grad_y = AcquireImage(*pool, img.rows, img.cols, CV_8U);
 		int scale = 1;
 		int delta = 0;
 		int ddepth = CV_8U;
-		Sobel(sobel, grad_x, ddepth, 1, 0, HARRIS_WINDOW, scale, delta, BORDER_DEFAULT);
-		Sobel(sobel, grad_y, ddepth, 0, 1, HARRIS_WINDOW, scale, delta, BORDER_DEFAULT);
+		Sobel(img, grad_x, ddepth, 1, 0, HARRIS_WINDOW, scale, delta, BORDER_DEFAULT);
+		Sobel(img, grad_y, ddepth, 0, 1, HARRIS_WINDOW, scale, delta, BORDER_DEFAULT);
 		// We have our x and y gradients
 		// Now with our window size, go over the image
 
-		// Get gaussian kernel for weighting the gradients within the window
-		Mat gaussKernel = Mat(HARRIS_WINDOW, HARRIS_WINDOW, CV_32F, 1);
-		CreateGaussianKernel(gaussKernel, 1);
-
-		int width = img.cols;
-		int height = img.rows;
-		std::vector<Feature> goodFeatures;
-		float avgEigen = 0.f;
+		// Sum the gradient products over the window around every pixel, weighted by a gaussian kernel
+		// This is the gradient at the point that we will use. 
+		// We use an accumulated gradient rather than a pointwise gradient since we are 
+		// approximating the gradient of a "smooth" function that we only know at certain points.
+		StructureTensor tensor;
+		if (!ComputeStructureTensor(grad_x, grad_y, HARRIS_WINDOW, 1, tensor))
+		{
+			ReleaseImage(*pool, grad_x);
+			ReleaseImage(*pool, grad_y);
+			break;
+		}
 
 		// Loop over all pixels in the image, and check for Harris corners
-		// Except this is hideously expensive, so I'm going to skip every second pixel
-		for (int y = HARRIS_WINDOW / 2 + 1; y < img.rows - HARRIS_WINDOW / 2; y += 2)
+		for (int y = HARRIS_WINDOW / 2 + 1; y < img.rows - HARRIS_WINDOW / 2; ++y)
 		{
-			for (int x = HARRIS_WINDOW / 2 + 1; x < img.cols - HARRIS_WINDOW / 2; x += 2)
+			for (int x = HARRIS_WINDOW / 2 + 1; x < img.cols - HARRIS_WINDOW / 2; ++x)
 			{
-				int winSize = HARRIS_WINDOW / 2;
-				Mat M = Mat::zeros(2, 2, CV_32F);
-				// Go through the window around the point
-				// Accumulate M weighted by the kernel
-				// This is the gradient at the point that we will use. 
-				// We use an accumulated gradient rather than a pointwise gradient since we are 
-				// approximating the gradient of a "smooth" function that we only know at certain points.
-				for (int n = -(HARRIS_WINDOW / 2); n <= HARRIS_WINDOW / 2; ++n)
-				{
-					for (int m = -(HARRIS_WINDOW / 2); m <= (HARRIS_WINDOW / 2); ++m)
-					{
-						int i = n + y;
-						int j = m + x;
-						float w = gaussKernel.at<float>(n + (HARRIS_WINDOW / 2), m + (HARRIS_WINDOW / 2));
-						M.at<float>(0, 0) += w * (float)(grad_x.at<uchar>(i, j) * grad_x.at<uchar>(i, j));
-						M.at<float>(0, 1) += w * (float)(grad_x.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-						M.at<float>(1, 0) += w * (float)(grad_x.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-						M.at<float>(1, 1) += w * (float)(grad_y.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-					}
-				}
-
 				// Compute the harris score
-				// This is R = det(M) - k * (trace(M))^2
-				float detM = M.at<float>(0, 0) * M.at<float>(1, 1) - M.at<float>(0, 1) * M.at<float>(1, 0);
-				float traceM = M.at<float>(0, 0) + M.at<float>(1, 1);
-				float score = detM - HARRIS_CONSTANT * traceM * traceM;
+				float score = HarrisScore(tensor, x, y);
 
 				// Only keep point that have a score above our threshold
 				if (score > HARRIS_THRESH)
 				{
 					Feature f;
-					f.p.x = (float)x*pow(2, s);
-					f.p.y = (float)y*pow(2, s);
+					f.p.x = (float)(x * octaveScale);
+					f.p.y = (float)(y * octaveScale);
 					f.score = score;
 					f.scale = s;
 					//f.saddle = detM < 0; // if  < 0, one eigenvalue is positive, the other negative
@@ -190,40 +417,15 @@ vector<Feature> FindHarrisCorners(const Mat& input, int nmsWindowSize)
 		// Display
 		//imshow("Image - best features", disp);
 		//waitKey(0);
+
+		ReleaseImage(*pool, grad_x);
+		ReleaseImage(*pool, grad_y);
 	}
+	ReleaseScaleSpacePyramid(pyramid, *pool);
 
 	// We apply non-maximal suppression over a greater window area
 	//int nmsWindow = 20;
-	vector<Feature> temp;
-	for (unsigned int n = 0; n < features.size(); ++n)
-	{
-		auto& f = features[n];
-		bool thisFeatureIsTheMaximum = true;
-		for (int i = 0; i < features.size(); ++i)
-		{
-			if (i == n)
-				continue;
-
-			auto& f2 = features[i];
-			int xmargin = (int)abs(f.p.x - f2.p.x);
-			int ymargin = (int)abs(f.p.y - f2.p.y);
-			if (xmargin <= nmsWindowSize && ymargin <= nmsWindowSize)
-			{
-				if (f.score < f2.score)
-				{
-					thisFeatureIsTheMaximum = false;
-					break;
-				}
-			}
-		}
-
-		if (thisFeatureIsTheMaximum)
-		{
-			temp.push_back(f);
-		}
-	}
-
-	return temp;
+	return ClusterFeatures(features, (float)nmsWindowSize);
 }
 
 /*
@@ -237,15 +439,17 @@ vector<Feature> FindHarrisCorners(const Mat& input, int nmsWindowSize)
 
 	Note that descriptors are computed NOT in the scale space
 */
-bool FindDoHFeatures(Mat input, Mat mask, vector<Feature>& features)
+bool FindDoHFeatures(Mat input, Mat mask, vector<Feature>& features, ImagePool* pool)
 {
 	// First, confirm that the mask is the same size as the image
 	if (mask.cols != input.cols || mask.rows != input.rows)
 		return false;
 
-	// Get gaussian kernel for weighting the gradients within the window
-	Mat gaussKernel = Mat(DOH_WINDOW, DOH_WINDOW, CV_32F, 1);
-	CreateGaussianKernel(gaussKernel, 1);
+	ImagePool localPool;
+	if (pool == nullptr)
+	{
+		pool = &localPool;
+	}
 
 	// We run this over an image that uses normalised pixels - that is, values between 0 and 1, representing 0-255
 	Mat img = Mat(input.rows, input.cols, CV_32F, 1);
@@ -268,84 +472,61 @@ bool FindDoHFeatures(Mat input, Mat mask, vector<Feature>& features)
 	
 
 	// Iterate over scale space
+	ScaleSpacePyramid pyramid;
+	if (!BuildScaleSpacePyramid(img, SCALE_PYRAMID_OCTAVES, SCALE_LEVELS_PER_OCTAVE, *pool, pyramid))
+	{
+		return false;
+	}
 	float maxFeatureScore = 0;
 	float avgFeatureScore = 0;
-	for (int k = 1; k < SCALE_SPACE_ITERATIONS; ++k)
+	for (int k = 0; k < (int)pyramid.levels.size(); ++k)
 	{
-		// blur the image
-		GaussianBlur(img, img, Size(DOH_WINDOW, DOH_WINDOW), 1, 1, BORDER_DEFAULT);
-
-		// Only take even iterations
-		if (k % 2 == 0)
-		{
-			continue;
-		}
+		const Mat& level = pyramid.levels[k].image;
+		int octaveScale = OctaveScaleFactor(pyramid.levels[k].octave);
 
 		// Compute image gradient
-		Mat sobel = img.clone();
-		Mat grad_x, grad_y;
+		Mat grad_x = AcquireImage(*pool, level.rows, level.cols, CV_32F);
+		Mat grad_y = AcquireImage(*pool, level.rows, level.cols, CV_32F);
 		int scale = 1;
 		int delta = 0;
 		int ddepth = CV_32F;
-		Sobel(sobel, grad_x, ddepth, 1, 0, DOH_WINDOW, scale, delta, BORDER_DEFAULT);
-		Sobel(sobel, grad_y, ddepth, 0, 1, DOH_WINDOW, scale, delta, BORDER_DEFAULT);
+		Sobel(level, grad_x, ddepth, 1, 0, DOH_WINDOW, scale, delta, BORDER_DEFAULT);
+		Sobel(level, grad_y, ddepth, 0, 1, DOH_WINDOW, scale, delta, BORDER_DEFAULT);
 		// We have our x and y gradients
 		// Now with our window size, go over the image
 
-		int width = img.cols;
-		int height = img.rows;
-		float avgEigen = 0.f;
+		// Sum the gradient products over the window around every pixel, weighted by a gaussian kernel
+		StructureTensor tensor;
+		if (!ComputeStructureTensor(grad_x, grad_y, DOH_WINDOW, 1, tensor))
+		{
+			ReleaseImage(*pool, grad_x);
+			ReleaseImage(*pool, grad_y);
+			ReleaseScaleSpacePyramid(pyramid, *pool);
+			return false;
+		}
 
-		// Loop over all pixels in the image, and check for Harris corners
-		// Except this is hideously expensive, so I'm going to skip every second pixel
-		for (int y = DOH_WINDOW / 2 + 1; y < img.rows - DOH_WINDOW / 2; y += 2)
+		// Loop over all pixels in the image, and check for features
+		for (int y = DOH_WINDOW / 2 + 1; y < level.rows - DOH_WINDOW / 2; ++y)
 		{
-			for (int x = DOH_WINDOW / 2 + 1; x < img.cols - DOH_WINDOW / 2; x += 2)
+			for (int x = DOH_WINDOW / 2 + 1; x < level.cols - DOH_WINDOW / 2; ++x)
 			{
 				// If out of masked region, ignore
-				if (mask.at<uchar>(y, x) < 127)
+				if (mask.at<uchar>(y * octaveScale, x * octaveScale) < 127)
 				{
 					continue;
 				}
 
-				int winSize = DOH_WINDOW / 2;
-				Mat H = Mat::zeros(2, 2, CV_32F);
-				// Go through the window around the point
-				// Accumulate M weighted by the kernel
-				// This is the gradient at the point that we will use. 
-				// We use an accumulated gradient rather than a pointwise gradient since we are 
-				// approximating the gradient of a "smooth" function that we only know at certain points.
-				for (int n = -(DOH_WINDOW / 2); n <= DOH_WINDOW / 2; ++n)
-				{
-					for (int m = -(DOH_WINDOW / 2); m <= (DOH_WINDOW / 2); ++m)
-					{
-						int i = n + y;
-						int j = m + x;
-						float w = gaussKernel.at<float>(n + (DOH_WINDOW / 2), m + (DOH_WINDOW / 2));
-						H.at<float>(0, 0) += w * (grad_x.at<float>(i, j) * grad_x.at<float>(i, j));
-						H.at<float>(0, 1) += w * (grad_x.at<float>(i, j) * grad_y.at<float>(i, j));
-						H.at<float>(1, 0) += w * (grad_x.at<float>(i, j) * grad_y.at<float>(i, j));
-						H.at<float>(1, 1) += w * (grad_y.at<float>(i, j) * grad_y.at<float>(i, j));
-					}
-				}
-
-				// Scale Hessian to use normalised gradient values
-
 				// Compute the DoH score
 				// This is just the determinant of the hessian, times the scale factor to the fourth power
-				float detM = H.at<float>(0, 0) * H.at<float>(1, 1) - H.at<float>(0, 1) * H.at<float>(1, 0);
-				//float traceM = H.at<float>(0, 0) + H.at<float>(1, 1);
-				float score = detM;// *k* k;// *k* k;
-
-				//std::cout << "score: " << score << std::endl;
+				float score = TensorDeterminant(tensor, x, y);
 
 				// Only keep point that have a score above our threshold
 				if (score > DOH_THRESHOLD)
 				{
 					Feature f;
 					f.scale = k;
-					f.p.x = (float)x;
-					f.p.y = (float)y;
+					f.p.x = (float)(x * octaveScale);
+					f.p.y = (float)(y * octaveScale);
 					f.score = score;
 					features.push_back(f);
 
@@ -357,7 +538,11 @@ bool FindDoHFeatures(Mat input, Mat mask, vector<Feature>& features)
 				}
 			}
 		}
+
+		ReleaseImage(*pool, grad_x);
+		ReleaseImage(*pool, grad_y);
 	}
+	ReleaseScaleSpacePyramid(pyramid, *pool);
 
 	avgFeatureScore /= features.size();
 	cout << "Average score = " << avgFeatureScore << " from " << features.size() << " features"  << endl;
@@ -397,79 +582,237 @@ bool FindDoHFeatures(Mat input, Mat mask, vector<Feature>& features)
 		  10  9  8
 
    The threshold I use is defined in Features.h and can be tuned. 
-   The helper functions implement an optimisation to reject bad points faster, 
-   and another function to black box the search for a sequential 12 or more. 
+   The helper function implements an optimisation to reject bad points faster. 
+
+   To make this fast, each row is run through the quick rejection with SIMD, 16 or 32
+   pixels at a time, comparing against 1, 5, 9 and 13. The few pixels that survive
+   have their ring turned into two 16-bit masks, one bit per point for brighter and one
+   for darker, and a table says whether a mask holds a run of 12 going round the circle.
+   The score of each corner is worked out as it is found: the contrast of its best arc,
+   the largest threshold at which it would still be a corner.
 */
 // Support function prototypes
 bool ThreeOfFourValuesBrighterOrDarker(int i1, int i5, int i9, int i13, int pb, int p_b);
-bool CheckForSequential12(std::vector<int> points, int p_b, int pb);
+
+#define FAST_RING_SIZE 16
+#define FAST_ARC_LENGTH 12
+// The ring as (x, y) offsets, in the order of the diagram above
+const int fastRing[FAST_RING_SIZE][2] = {
+	{ 0, -3 }, { 1, -3 }, { 2, -2 }, { 3, -1 }, { 3, 0 }, { 3, 1 }, { 2, 2 }, { 1, 3 },
+	{ 0, 3 }, { -1, 3 }, { -2, 2 }, { -3, 1 }, { -3, 0 }, { -3, -1 }, { -2, -2 }, { -1, -3 } };
+
+// For every 16-bit mask, whether it has FAST_ARC_LENGTH set bits in a row, wrapping around
+vector<uchar> BuildFastArcTable()
+{
+	vector<uchar> table(1 << FAST_RING_SIZE);
+	for (unsigned int mask = 0; mask < table.size(); ++mask)
+	{
+		// Bit i of run is set if bits i to i + 11 of the doubled-up mask all are
+		unsigned int doubled = mask | (mask << FAST_RING_SIZE);
+		unsigned int run = doubled;
+		for (int k = 1; k < FAST_ARC_LENGTH; ++k)
+		{
+			run &= doubled >> k;
+		}
+		table[mask] = (run & 0xFFFF) != 0;
+	}
+	return table;
+}
+
+const vector<uchar>& GetFastArcTable()
+{
+	static const vector<uchar> table = BuildFastArcTable();
+	return table;
+}
+
+// The largest threshold at which this is still a corner, or 0 if it isn't one
+int FastCornerScore(const uchar* centre, const int ringOffsets[FAST_RING_SIZE])
+{
+	int diff[2 * FAST_RING_SIZE];
+	for (int k = 0; k < FAST_RING_SIZE; ++k)
+	{
+		diff[k] = (int)centre[ringOffsets[k]] - (int)centre[0];
+		diff[k + FAST_RING_SIZE] = diff[k];
+	}
+	int best = 0;
+	for (int start = 0; start < FAST_RING_SIZE; ++start)
+	{
+		int minBrighter = INT_MAX;
+		int maxDarker = INT_MIN;
+		for (int k = start; k < start + FAST_ARC_LENGTH; ++k)
+		{
+			minBrighter = min(minBrighter, diff[k]);
+			maxDarker = max(maxDarker, diff[k]);
+		}
+		best = max(best, max(minBrighter, -maxDarker) - 1);
+	}
+	return best;
+}
+
+// Full test of one pixel that passed the quick rejection
+bool TestFastCorner(const uchar* centre, const int ringOffsets[FAST_RING_SIZE], const vector<uchar>& arcTable, int threshold, int x, int y, vector<Feature>& features)
+{
+	int pb = centre[0] + threshold;
+	int p_b = centre[0] - threshold;
+	unsigned int brighter = 0;
+	unsigned int darker = 0;
+	for (int k = 0; k < FAST_RING_SIZE; ++k)
+	{
+		int v = centre[ringOffsets[k]];
+		brighter |= (unsigned int)(v > pb) << k;
+		darker |= (unsigned int)(v < p_b) << k;
+	}
+	if (!arcTable[brighter] && !arcTable[darker])
+	{
+		return false;
+	}
+
+	Feature feature;
+	feature.p.x = (float)x;
+	feature.p.y = (float)y;
+	feature.score = (float)FastCornerScore(centre, ringOffsets);
+	features.push_back(feature);
+	return true;
+}
+
+#if defined(__AVX2__)
+#define FAST_SIMD_WIDTH 32
+// Bit i is set if pixel i of the run has three of 1, 5, 9 and 13 brighter, or three darker
+inline unsigned int FastQuickRejectMask(const uchar* centre, int step, int threshold)
+{
+	__m256i p = _mm256_loadu_si256((const __m256i*)centre);
+	__m256i vThreshold = _mm256_set1_epi8((char)threshold);
+	// Saturating, so nothing can be brighter than 255 or darker than 0
+	__m256i pb = _mm256_adds_epu8(p, vThreshold);
+	__m256i p_b = _mm256_subs_epu8(p, vThreshold);
+	__m256i one = _mm256_set1_epi8(1);
+	__m256i numBrighter = _mm256_setzero_si256();
+	__m256i numDarker = _mm256_setzero_si256();
+	const int offsets[4] = { -3 * step, 3, 3 * step, -3 };
+	for (int k = 0; k < 4; ++k)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(centre + offsets[k]));
+		numBrighter = _mm256_add_epi8(numBrighter, _mm256_min_epu8(_mm256_subs_epu8(v, pb), one));
+		numDarker = _mm256_add_epi8(numDarker, _mm256_min_epu8(_mm256_subs_epu8(p_b, v), one));
+	}
+	__m256i two = _mm256_set1_epi8(2);
+	__m256i pass = _mm256_or_si256(_mm256_cmpgt_epi8(numBrighter, two), _mm256_cmpgt_epi8(numDarker, two));
+	return (unsigned int)_mm256_movemask_epi8(pass);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#define FAST_SIMD_WIDTH 16
+inline unsigned int FastQuickRejectMask(const uchar* centre, int step, int threshold)
+{
+	__m128i p = _mm_loadu_si128((const __m128i*)centre);
+	__m128i vThreshold = _mm_set1_epi8((char)threshold);
+	__m128i pb = _mm_adds_epu8(p, vThreshold);
+	__m128i p_b = _mm_subs_epu8(p, vThreshold);
+	__m128i one = _mm_set1_epi8(1);
+	__m128i numBrighter = _mm_setzero_si128();
+	__m128i numDarker = _mm_setzero_si128();
+	const int offsets[4] = { -3 * step, 3, 3 * step, -3 };
+	for (int k = 0; k < 4; ++k)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(centre + offsets[k]));
+		numBrighter = _mm_add_epi8(numBrighter, _mm_min_epu8(_mm_subs_epu8(v, pb), one));
+		numDarker = _mm_add_epi8(numDarker, _mm_min_epu8(_mm_subs_epu8(p_b, v), one));
+	}
+	__m128i two = _mm_set1_epi8(2);
+	__m128i pass = _mm_or_si128(_mm_cmpgt_epi8(numBrighter, two), _mm_cmpgt_epi8(numDarker, two));
+	return (unsigned int)_mm_movemask_epi8(pass);
+}
+#endif
 // Actual fast features function
 bool FindFASTFeatures(Mat img, vector<Feature>& features)
 {
+	if (img.type() != CV_8U)
+	{
+		cout << "FAST features need an 8-bit grayscale image" << endl;
+		return false;
+	}
 	int width = img.cols;
 	int height = img.rows;
+	int step = (int)img.step;
+	int ringOffsets[FAST_RING_SIZE];
+	for (int k = 0; k < FAST_RING_SIZE; ++k)
+	{
+		ringOffsets[k] = fastRing[k][1] * step + fastRing[k][0];
+	}
+	const vector<uchar>& arcTable = GetFastArcTable();
+
 	// Loop over each point in the image, except for a strip of width 3 around the edge. THis is so we
 	// avoid dealing with the cases where the pixels 3 away from the point of consideration don't exist.
 	// There are enough features in teh main body of the image that removing any in the 3 pixels of edge does nothing.
+	// Rows are independent, so each keeps its own list and they're joined in order at the end
+	vector<vector<Feature>> rowFeatures(max(height, 0));
+#pragma omp parallel for schedule(dynamic, 16)
 	for (int h = FAST_SPACING; h < height - FAST_SPACING; ++h)
 	{
-		for (int w = FAST_SPACING; w < width - FAST_SPACING; ++w)
+		const uchar* row = img.ptr<uchar>(h);
+		vector<Feature>& found = rowFeatures[h];
+		int w = FAST_SPACING;
+#ifdef FAST_SIMD_WIDTH
+		for (; w + FAST_SIMD_WIDTH <= width - FAST_SPACING; w += FAST_SIMD_WIDTH)
+		{
+			unsigned int candidates = FastQuickRejectMask(row + w, step, FAST_THRESHOLD);
+			while (candidates != 0)
+			{
+				int i = 0;
+				while (!(candidates & (1u << i)))
+				{
+					++i;
+				}
+				candidates &= candidates - 1;
+				TestFastCorner(row + w + i, ringOffsets, arcTable, FAST_THRESHOLD, w + i, h, found);
+			}
+		}
+#endif
+		for (; w < width - FAST_SPACING; ++w)
 		{
 			// Get the upper and lower thresholds we'll use.
 			// Everything in the sequence must be above pb - the pixel value plus the threshold,
 			// or below p_b - the pixel value minus the threshold
-			int p = img.at<uchar>(h, w);
-			int pb = p + FAST_THRESHOLD;
-			int p_b = p - FAST_THRESHOLD;
-
-			// For a speed-up, check 1, 9, then 5, 13
-			// Any three of 1,5,9,13 can be all brighter or darker. If not,
-			// then this is not a corner. 
-			// This just quickly skips many points and is not strictly necessary
-			int i1 = img.at<uchar>(h - FAST_SPACING, w);
-			int i5 = img.at<uchar>(h, w + FAST_SPACING);
-			int i9 = img.at<uchar>(h + FAST_SPACING, w);
-			int i13 = img.at<uchar>(h, w - FAST_SPACING);
-			if (!ThreeOfFourValuesBrighterOrDarker(i1, i5, i9, i13, pb, p_b))
+			const uchar* centre = row + w;
+			int pb = centre[0] + FAST_THRESHOLD;
+			int p_b = centre[0] - FAST_THRESHOLD;
+			if (ThreeOfFourValuesBrighterOrDarker(centre[ringOffsets[0]], centre[ringOffsets[4]], centre[ringOffsets[8]], centre[ringOffsets[12]], pb, p_b))
 			{
-				continue;
-			}
-			else {
-				// Now check the rest
-				// need 12 or more sequential values above or below
-				// First, get all the values
-				int i2 = img.at<uchar>(h - FAST_SPACING, w + 1);
-				int i3 = img.at<uchar>(h - 2, w + 2);
-				int i4 = img.at<uchar>(h - 1, w + FAST_SPACING);
-				int i6 = img.at<uchar>(h + 1, w + FAST_SPACING);
-				int i7 = img.at<uchar>(h + 2, w + 2);
-				int i8 = img.at<uchar>(h + FAST_SPACING, w - 1);
-				int i10 = img.at<uchar>(h + FAST_SPACING, w + 1);
-				int i11 = img.at<uchar>(h + 2, w - 2);
-				int i12 = img.at<uchar>(h + 1, w - FAST_SPACING);
-				int i14 = img.at<uchar>(h - 1, w - FAST_SPACING);
-				int i15 = img.at<uchar>(h - 2, w - 2);
-				int i16 = img.at<uchar>(h - FAST_SPACING, w - 1);
-				std::vector<int> points{ i1, i2, i3, i4, i5, i6, i7, i8, i9, i10, i11, i12, i13, i14, i15, i16 };
-
-				// Pass values into evaluation function
-				if (!CheckForSequential12(points, p_b, pb))
-				{
-					continue;
-				}
-
-				// It worked! We have a feature. Record this point in our vector
-				Feature feature;
-				feature.p.x = (float)w;
-				feature.p.y = (float)h;
-				features.push_back(feature);
+				TestFastCorner(centre, ringOffsets, arcTable, FAST_THRESHOLD, w, h, found);
 			}
 		}
 	}
 
+	for (auto& found : rowFeatures)
+	{
+		features.insert(features.end(), found.begin(), found.end());
+	}
 	return true;
 }
 
+/*
+	Keep the FAST features whose own score is at least minScore, and cluster them.
+	This takes the place of ScoreAndClusterFeatures for FAST corners: the score was worked
+	out as each corner was found, so there is no gradient or structure tensor pass at all.
+	The score is in grey levels, and is never below FAST_THRESHOLD.
+*/
+std::vector<Feature> ClusterFASTFeatures(
+	_In_ const vector<Feature>& features,
+	_In_ float minScore,
+	_In_ float distanceForWithinCluster)
+{
+	vector<Feature> goodFeatures;
+	for (auto& f : features)
+	{
+		if (f.score >= minScore)
+		{
+			goodFeatures.push_back(f);
+		}
+	}
+	goodFeatures = ClusterFeatures(goodFeatures, distanceForWithinCluster);
+	sort(goodFeatures.begin(), goodFeatures.end(), FeatureCompare);
+	return goodFeatures;
+}
+
 /*
 If three of the four i values are all brighter than pb or darker than p_b, return true.
 Else, return false
@@ -516,130 +859,6 @@ bool ThreeOfFourValuesBrighterOrDarker(int i1, int i5, int i9, int i13, int pb,
 	return false;
 }
 
-// Helper functions for FAST features
-bool greaterthan(int i, int pb, int p_b)
-{
-	return i > pb;
-}
-
-bool lessthan(int i, int pb, int p_b)
-{
-	return i < p_b;
-}
-
-/*
-If there is a sequence of i values that are all above pb or below p_b, return true.
-Else, return false.
-*/
-bool CheckForSequential12(std::vector<int> points, int p_b, int pb)
-{
-	// Do we try to do this intelligently or just brute force? 
-	// For each in the list
-	// if it's above or below
-	// Search front and back until we find a break
-	// count the sequence length
-	assert(pb > p_b);
-
-	// Yes, there are smarter ways to do this. No, I don't care right now.
-	int p = (pb + p_b) / 2;
-
-	bool(*comp)(int, int, int);
-	for (int i = 0; i < (int)points.size(); ++i)
-	{
-		if (points[i] > pb)
-		{
-			comp = &greaterthan;
-		}
-		else if (points[i] < p_b)
-		{
-			comp = &lessthan;
-		}
-		else {
-			continue;
-		}
-
-		// Now loop over the rest of the sequence, forward and backward,
-		// until both sides return false
-		// Forward loop
-		int fLen = 0;
-		int fJ = 0;
-		for (fJ = i + 1; fJ != i; ++fJ)
-		{
-			// quit when we get back to i
-			if (fJ == 16)
-				fJ = 0;
-			if (fJ == i)
-				break;
-			if (comp(points[fJ], pb, p_b))
-				fLen++;
-			else
-				break;
-		}
-		fJ--;
-		int bLen = 0;
-		int bJ = 0;
-		for (int bJ = i - 1; bJ != i && bJ != fJ; --bJ)
-		{
-			// quit when we get back to i
-			if (bJ == -1)
-				bJ = 15;
-			if (bJ == i || bJ == fJ)
-				break;
-			if (comp(points[bJ], pb, p_b))
-				bLen++;
-			else
-				break;
-		}
-		int seqLen = fLen + bLen + 1;
-		assert(seqLen <= 16);
-		if (seqLen >= 12)
-		{
-			return true;
-		}
-	}
-
-	return false;
-}
-
-// Unit Tests for the above
-void TestSequential12(void)
-{
-	// Create some data for sequential 12 and confirm that it actually does what it should
-	int pb = 1;
-	int p_b = 0;
-	std::vector<int> p1{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	// this one should pass
-	assert(!CheckForSequential12(p1, p_b, pb));
-
-	p_b = 1;
-	pb = 3;
-	vector<int> p2{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	// this should pass
-	assert(CheckForSequential12(p2, p_b, pb));
-
-	p_b = 30;
-	pb = 90;
-	// pass, meaning there is a 12 or more
-	vector<int> p3{ 0, 91, 0, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 0 };
-	assert(CheckForSequential12(p3, p_b, pb));
-	// fail
-	vector<int> p4{ 0, 91, 0, 0, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 0 };
-	assert(!CheckForSequential12(p4, p_b, pb));
-	// pass
-	vector<int> p5{ 91, 91, 0, 91, 0, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91, 91 };
-	assert(CheckForSequential12(p5, p_b, pb));
-	// fail
-	vector<int> p6{ 0, 61, 0, 0, 61, 61, 61, 61, 61, 61, 61, 61, 61, 61, 61, 0 };
-	assert(!CheckForSequential12(p6, p_b, pb));
-	// pass
-	vector<int> p7{ 0, 0, 0, 91, 0, 91, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	assert(CheckForSequential12(p7, p_b, pb));
-	// fail
-	vector<int> p8{ 0, 91, 0, 0, 0, 0, 0, 0, 0, 0, 0, 91, 91, 91, 91, 0 };
-	assert(!CheckForSequential12(p8, p_b, pb));
-
-}
-
 /*
 	Feature Scoring
 	
@@ -673,16 +892,24 @@ std::vector<Feature> ScoreAndClusterFeatures(
 	const Mat& img,
 	vector<Feature>& features,
 	float scoreThreshold,
-	float distanceForWithinCluster)
+	float distanceForWithinCluster,
+	ImagePool* pool)
 {
+	ImagePool localPool;
+	if (pool == nullptr)
+	{
+		pool = &localPool;
+	}
+
 	// let's cheat and use opencv to compute the sobel derivative, window size 3,
 	// over the whole image
 	// lol this doesn't actually save us much time but whatevs, I know how to implement this. 
 	// here's an explanation if you don't know the theory - https://en.wikipedia.org/wiki/Sobel_operator
 	// Basically this gets the gradients at all points over the image, which we use for the derivative of the "image function"
-	Mat sobel;
+	Mat sobel = AcquireImage(*pool, img.rows, img.cols, img.type());
 	GaussianBlur(img, sobel, Size(ST_WINDOW, ST_WINDOW), 1, 1, BORDER_DEFAULT);
-	Mat grad_x, grad_y;
+	Mat grad_x = AcquireImage(*pool, img.rows, img.cols, CV_8U);
+	Mat grad_y = AcquireImage(*pool, img.rows, img.cols, CV_8U);
 	int scale = 1;
 	int delta = 0;
 	int ddepth = CV_8U;
@@ -691,53 +918,40 @@ std::vector<Feature> ScoreAndClusterFeatures(
 	// We have our x and y gradients
 	// Now with our window size, go over the image
 
-	// Get gaussian kernel for weighting the gradients within the window
-	Mat gaussKernel = Mat(ST_WINDOW, ST_WINDOW, CV_32F, 1);
-	CreateGaussianKernel(gaussKernel, 1);
+	// Sum the gradient products over a window around every pixel, weighted by a gaussian kernel
+	// This is the gradient at the feature point that we will use. 
+	// We use an accumulated gradient rather than a pointwise gradient since we are 
+	// approximating the gradient of a "smooth" function that we only know at certain points.
+	StructureTensor tensor;
+	bool haveTensor = ComputeStructureTensor(grad_x, grad_y, ST_WINDOW, 1, tensor);
+	ReleaseImage(*pool, sobel);
+	ReleaseImage(*pool, grad_x);
+	ReleaseImage(*pool, grad_y);
+	if (!haveTensor)
+	{
+		return std::vector<Feature>();
+	}
 
 	int width = img.cols;
 	int height = img.rows;
 	int numFeatures = (int)features.size();
 	std::vector<Feature> goodFeatures;
-	float avgEigen = 0.f;
 	// Loop over all features in the given list to score them
 	for (int i = 0; i < numFeatures; ++i)
 	{
 		auto& f = features[i];
-		int winSize = ST_WINDOW / 2;
-		Mat M = Mat::zeros(2, 2, CV_32F);
-		// Go through the window around the feature
-		// Accumulate M weighted by the kernel
-		// This is the gradient at the feature point that we will use. 
-		// We use an accumulated gradient rather than a pointwise gradient since we are 
-		// approximating the gradient of a "smooth" function that we only know at certain points.
-		for (int n = -(ST_WINDOW / 2); n <= ST_WINDOW / 2; ++n)
+		int x = (int)f.p.x;
+		int y = (int)f.p.y;
+		if (x < 0 || y < 0 || x >= width || y >= height)
 		{
-			for (int m = -(ST_WINDOW / 2); m <= (ST_WINDOW / 2); ++m)
-			{
-				int i = n + (int)f.p.y;
-				int j = m + (int)f.p.x;
-				float w = gaussKernel.at<float>(n + (ST_WINDOW / 2), m + (ST_WINDOW / 2));
-				M.at<float>(0, 0) += w * (float)(grad_x.at<uchar>(i, j) * grad_x.at<uchar>(i, j));
-				M.at<float>(0, 1) += w * (float)(grad_x.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-				M.at<float>(1, 0) += w * (float)(grad_x.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-				M.at<float>(1, 1) += w * (float)(grad_y.at<uchar>(i, j) * grad_y.at<uchar>(i, j));
-			}
+			continue;
 		}
 
-		// Compute the eigenvalues of M
+		// The score is the minimum eigenvalue of M
 		// so the equation is
 		// (I_x squared - E)(I_y squared - E) - I_xy squared, solve for two solutions of e
 		// See the ai shack link above for the equation written nicely
-		float a = 1.f; // yeah, unnecessary, just for show
-		float b = -1 * (M.at<float>(0, 0) + M.at<float>(1, 1));
-		float c = M.at<float>(0, 0)*M.at<float>(1, 1) - M.at<float>(1, 0)*M.at<float>(0, 1);
-		float eigen1 = (-b + sqrt(b*b - 4 * a*c)) / 2 * a;
-		float eigen2 = (-b - sqrt(b*b - 4 * a*c)) / 2 * a;
-
-		float minEigenvalue = min(eigen1, eigen2);
-		f.score = minEigenvalue;
-		avgEigen += f.score;
+		f.score = ShiTomasiScore(tensor, x, y);
 		// Only keep features that have a score above our threshold
 		if (f.score > scoreThreshold)
 		{
@@ -748,36 +962,7 @@ std::vector<Feature> ScoreAndClusterFeatures(
 	// Perform non-maximal suppression over a window around each feature
 	// We'll choose 5x5 around each feature, which is 
 	// if there is a feature of lower score in the 5x5, remove it
-	vector<Feature> temp;
-	for (unsigned int n = 0; n < goodFeatures.size(); ++n)
-	{
-		auto& f = goodFeatures[n];
-		bool thisFeatureIsTheMaximum = true;
-		for (int i = 0; i < goodFeatures.size(); ++i)
-		{
-			if (i == n)
-				continue;
-
-			auto& f2 = goodFeatures[i];
-			int xmargin = (int)abs(f.p.x - f2.p.x);
-			int ymargin = (int)abs(f.p.y - f2.p.y);
-			if (xmargin <= distanceForWithinCluster && ymargin <= distanceForWithinCluster)
-			{
-				if (f.score < f2.score)
-				{
-					thisFeatureIsTheMaximum = false;
-					break;
-				}
-			}
-		}
-
-		if (thisFeatureIsTheMaximum)
-		{
-			temp.push_back(f);
-		}
-	}
-
-	goodFeatures = temp;
+	goodFeatures = ClusterFeatures(goodFeatures, distanceForWithinCluster);
 
 	// Sort features
 	sort(goodFeatures.begin(), goodFeatures.end(), FeatureCompare);
@@ -785,6 +970,123 @@ std::vector<Feature> ScoreAndClusterFeatures(
 	return goodFeatures;
 }
 
+/*
+	Gradient planes
+	The magnitude and direction of the gradient at every pixel, found in one pass so that
+	orienting and describing each feature is only lookups and sums.
+
+	The direction comes from a polynomial approximation to atan on [0, 1], moved into the
+	right octant by the signs and relative size of the two components. It's good to about
+	0.01 degrees, far finer than the steps it's quantised into, and needs no branches,
+	so eight pixels go at once with AVX2.
+*/
+// Support functions
+#define HALF_PI_F 1.57079637f
+#define PI_F 3.14159274f
+#define TWO_PI_F 6.28318548f
+#define ATAN_C1 -0.0464964749f
+#define ATAN_C2 0.15931422f
+#define ATAN_C3 -0.327622764f
+
+// atan2(y, x) in [0, 2pi]
+inline float FastAtan2(float y, float x)
+{
+	float ax = abs(x);
+	float ay = abs(y);
+	float a = min(ax, ay) / max(max(ax, ay), FLT_MIN);
+	float s = a * a;
+	float r = ((ATAN_C1 * s + ATAN_C2) * s + ATAN_C3) * s * a + a;
+	if (ay > ax)
+		r = HALF_PI_F - r;
+	if (x < 0)
+		r = PI_F - r;
+	if (y < 0)
+		r = TWO_PI_F - r;
+	return r;
+}
+
+// The angle step of a direction, where 2pi wraps back round to 0
+inline uchar QuantiseAngle(float angle)
+{
+	int step = (int)(angle * (GRADIENT_ANGLE_STEPS / TWO_PI_F));
+	return (uchar)(step < GRADIENT_ANGLE_STEPS ? step : 0);
+}
+
+#if defined(__AVX2__)
+// The same as FastAtan2, for eight values at once
+inline __m256 FastAtan2(__m256 y, __m256 x)
+{
+	const __m256 signMask = _mm256_set1_ps(-0.f);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 ax = _mm256_andnot_ps(signMask, x);
+	__m256 ay = _mm256_andnot_ps(signMask, y);
+	__m256 a = _mm256_div_ps(_mm256_min_ps(ax, ay), _mm256_max_ps(_mm256_max_ps(ax, ay), _mm256_set1_ps(FLT_MIN)));
+	__m256 s = _mm256_mul_ps(a, a);
+	__m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ATAN_C1), s), _mm256_set1_ps(ATAN_C2));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_C3));
+	r = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(r, s), a), a);
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(HALF_PI_F), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_F), r), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(TWO_PI_F), r), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+	return r;
+}
+#endif
+
+// Magnitude and angle step along one row of 16-bit gradients
+void GradientPlaneRow(const short* gx, const short* gy, int width, float* mag, uchar* angle)
+{
+	int x = 0;
+#if defined(__AVX2__)
+	const __m256 stepsPerRadian = _mm256_set1_ps(GRADIENT_ANGLE_STEPS / TWO_PI_F);
+	const __m256i steps = _mm256_set1_epi32(GRADIENT_ANGLE_STEPS);
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256 fx = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(gx + x))));
+		__m256 fy = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(gy + x))));
+		_mm256_storeu_ps(mag + x, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy))));
+
+		// Quantise, wrap a full turn to 0, and pack down to bytes
+		__m256i step = _mm256_cvttps_epi32(_mm256_mul_ps(FastAtan2(fy, fx), stepsPerRadian));
+		step = _mm256_and_si256(step, _mm256_cmpgt_epi32(steps, step));
+		__m128i step16 = _mm_packus_epi32(_mm256_castsi256_si128(step), _mm256_extracti128_si256(step, 1));
+		_mm_storel_epi64((__m128i*)(angle + x), _mm_packus_epi16(step16, step16));
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		float fx = gx[x];
+		float fy = gy[x];
+		mag[x] = sqrt(fx * fx + fy * fy);
+		angle[x] = QuantiseAngle(FastAtan2(fy, fx));
+	}
+}
+
+// Actual function
+void ComputeGradientPlanes(
+	_In_ const Mat& grad_x,
+	_In_ const Mat& grad_y,
+	_Out_ GradientPlanes& planes)
+{
+	if (grad_x.type() != CV_16S || grad_y.type() != CV_16S)
+	{
+		cout << "Error: gradient planes need 16-bit signed gradients" << endl;
+		return;
+	}
+
+	planes.magnitude.create(grad_x.rows, grad_x.cols, CV_32F);
+	planes.angle.create(grad_x.rows, grad_x.cols, CV_8U);
+#pragma omp parallel for
+	for (int y = 0; y < grad_x.rows; ++y)
+	{
+		GradientPlaneRow(
+			grad_x.ptr<short>(y),
+			grad_y.ptr<short>(y),
+			grad_x.cols,
+			planes.magnitude.ptr<float>(y),
+			planes.angle.ptr<uchar>(y));
+	}
+}
+
 /*
 	Feature Description
 	Create SIFT descriptors for each feature given.
@@ -822,86 +1124,143 @@ void NormaliseVector(std::vector<T>& v)
 		v[i] /= s;
 	}
 }
-void ComputeFeatureOrientation(Feature& feature, Mat xgrad, Mat ygrad);
+
+static_assert(GRADIENT_ANGLE_STEPS % ORIENTATION_HIST_BINS == 0 && GRADIENT_ANGLE_STEPS % DESC_BINS == 0,
+	"orientation and descriptor bins must each be a whole number of angle steps");
+static_assert(GRADIENT_ANGLE_STEPS <= 256, "angle steps are stored as bytes");
+
+// exp(x) at compile time: a Taylor series on x / 64, squared back up six times
+constexpr double ConstexprExp(double x)
+{
+	double reduced = x / 64;
+	double term = 1;
+	double sum = 1;
+	for (int n = 1; n < 12; ++n)
+	{
+		term *= reduced / n;
+		sum += term;
+	}
+	for (int n = 0; n < 6; ++n)
+	{
+		sum *= sum;
+	}
+	return sum;
+}
+
+// A square Gaussian weighting window centred on its middle, built at compile time.
+// It isn't normalised, since both uses only compare or normalise what they sum.
+template <int N>
+struct GaussianWindow
+{
+	float w[N][N];
+};
+template <int N>
+constexpr GaussianWindow<N> MakeGaussianWindow(double sigma)
+{
+	GaussianWindow<N> window = {};
+	for (int i = 0; i < N; ++i)
+	{
+		for (int j = 0; j < N; ++j)
+		{
+			double y = i - (N - 1) / 2.0;
+			double x = j - (N - 1) / 2.0;
+			window.w[i][j] = (float)ConstexprExp(-(x * x + y * y) / (2 * sigma * sigma));
+		}
+	}
+	return window;
+}
+
+// Orientation samples are weighted by distance from the feature,
+// descriptor samples by which block of the descriptor window they fall in
+constexpr GaussianWindow<ANGLE_WINDOW> orientationWeights = MakeGaussianWindow<ANGLE_WINDOW>(1);
+constexpr GaussianWindow<DESC_WINDOW / DESC_SUB_WINDOW> descriptorBlockWeights = MakeGaussianWindow<DESC_WINDOW / DESC_SUB_WINDOW>(1);
+
+// The descriptor bin of an angle step relative to the feature orientation,
+// indexed by the difference plus GRADIENT_ANGLE_STEPS so it never goes negative
+struct DescriptorBinTable
+{
+	uchar bin[2 * GRADIENT_ANGLE_STEPS];
+};
+constexpr DescriptorBinTable MakeDescriptorBinTable()
+{
+	DescriptorBinTable table = {};
+	for (int i = 0; i < 2 * GRADIENT_ANGLE_STEPS; ++i)
+	{
+		table.bin[i] = (uchar)((i % GRADIENT_ANGLE_STEPS) / (GRADIENT_ANGLE_STEPS / DESC_BINS));
+	}
+	return table;
+}
+constexpr DescriptorBinTable descriptorBins = MakeDescriptorBinTable();
+
+int ComputeFeatureOrientation(Feature& feature, const GradientPlanes& planes);
 // Actual function
-bool CreateSIFTDescriptors(cv::Mat img, std::vector<Feature>& features, std::vector<FeatureDescriptor>& descriptors)
+bool CreateSIFTDescriptors(cv::Mat img, std::vector<Feature>& features, std::vector<FeatureDescriptor>& descriptors, ImagePool* pool)
 {
+	ImagePool localPool;
+	if (pool == nullptr)
+	{
+		pool = &localPool;
+	}
+
 	// Smooth the image with a Gaussian first and get gradients
-	Mat smoothed;
+	// They're signed, so the direction covers the whole circle
+	Mat smoothed = AcquireImage(*pool, img.rows, img.cols, img.type());
 	GaussianBlur(img, smoothed, Size(ST_WINDOW, ST_WINDOW), 1, 1, BORDER_DEFAULT);
-	Mat grad_x, grad_y;
+	Mat grad_x = AcquireImage(*pool, img.rows, img.cols, CV_16S);
+	Mat grad_y = AcquireImage(*pool, img.rows, img.cols, CV_16S);
 	int scale = 1;
 	int delta = 0;
-	int ddepth = CV_8U;
+	int ddepth = CV_16S;
 	Sobel(smoothed, grad_x, ddepth, 1, 0, ST_WINDOW, scale, delta, BORDER_DEFAULT);
 	Sobel(smoothed, grad_y, ddepth, 0, 1, ST_WINDOW, scale, delta, BORDER_DEFAULT);
 
-	// Construct a Gaussian kernel for weighting descriptor entries
-	Mat gaussKernel = Mat(DESC_SUB_WINDOW, DESC_SUB_WINDOW, CV_32F, 1);
-	CreateGaussianKernel(gaussKernel, 1);
+	// Find the magnitude and direction of every gradient once, rather than per sample
+	GradientPlanes planes;
+	planes.magnitude = AcquireImage(*pool, img.rows, img.cols, CV_32F);
+	planes.angle = AcquireImage(*pool, img.rows, img.cols, CV_8U);
+	ComputeGradientPlanes(grad_x, grad_y, planes);
+	ReleaseImage(*pool, smoothed);
+	ReleaseImage(*pool, grad_x);
+	ReleaseImage(*pool, grad_y);
 
 	// For each feature
-	for (unsigned int i = 0; i < features.size(); ++i)
+	// Each only reads the planes and writes its own orientation and descriptor
+#pragma omp parallel for
+	for (int i = 0; i < (int)features.size(); ++i)
 	{
 		auto& f = features[i];
 
 		// Get feature orientation
-		ComputeFeatureOrientation(f, grad_x, grad_y);
+		int orientation = ComputeFeatureOrientation(f, planes);
 
-		// Over a 16x16 window, iterate over 4x4 blocks
-		// For each block, compute the histogram
-		// Weight the histogram
-		// Add these to the vector
-		int vecEntryIndex = 0;
+		// Over a 16x16 window, add each sample into the histogram of its 4x4 block,
+		// at the bin of its direction relative to the feature's, weighted by its magnitude
+		// and the block's distance from the centre.
 		// I'm supposed to interpolate here and use sub-pixel values cos otherwise the feature
 		// point isn't aligned with the centre.
 		// Instead of interpolating, we're just going to create the window with
 		// the feature at 8,8. It'll work as an approximation
-		for (int j = 0; j < DESC_WINDOW; j += DESC_SUB_WINDOW)
+		std::fill(std::begin(f.desc.vec), std::end(f.desc.vec), 0.f);
+		for (int n = 0; n < DESC_WINDOW; ++n)
 		{
-			for (int k = 0; k < DESC_WINDOW; k += DESC_SUB_WINDOW)
+			// Ensure that window stays within bounds of image. The planes have the same size
+			int imgY = (int)f.p.y - (DESC_WINDOW / 2) + n;
+			if (imgY < 0 || imgY >= planes.magnitude.rows)
+				continue;
+
+			const float* mag = planes.magnitude.ptr<float>(imgY);
+			const uchar* angle = planes.angle.ptr<uchar>(imgY);
+			int blockY = n / DESC_SUB_WINDOW;
+			for (int m = 0; m < DESC_WINDOW; ++m)
 			{
-				float hist[DESC_BINS] = {0.0f};
-				// For each 4x4 block
-				for (int n = j; n < j+DESC_SUB_WINDOW; ++n)
-				{
-					for (int m = k; m < k + DESC_SUB_WINDOW; ++m)
-					{
-						int imgX = (int)f.p.x - (DESC_WINDOW / 2) + m;
-						int imgY = (int)f.p.y - (DESC_WINDOW / 2) + n;
-
-						// Ensure that window stays within bounds of image. xgrad and ygrad have the same size
-						if (imgY < 0 || imgY >= grad_x.rows)
-							continue;
-						if (imgX < 0 || imgX >= grad_x.cols)
-							continue;
-
-						// Get angle and magnitude of gradient at this point, and add
-						// into the histogram at the right bin
-						float gX = (float)grad_x.at<uchar>(imgY, imgX);
-						float gY = (float)grad_y.at<uchar>(imgY, imgX);
-						float mag = sqrt(gX*gX + gY * gY);
-						float angle = 0.f;
-						if (gX != 0)
-							angle = RAD2DEG(atan(gY / gX));
-						else
-							angle = 90;
-						// Make angle relative to feature angle
-						angle -= f.angle;
-						if (angle > 360)
-							angle = (int)angle % 360;
-						if (angle < 0)
-							angle = 0;
-						hist[(int)angle / DESC_BIN_SIZE] += mag * gaussKernel.at<float>(j/DESC_SUB_WINDOW,k/DESC_SUB_WINDOW);
-					}
-				}
+				int imgX = (int)f.p.x - (DESC_WINDOW / 2) + m;
+				if (imgX < 0 || imgX >= planes.magnitude.cols)
+					continue;
 
-				// add this histogram to the feature vector
-				for (int index = 0; index < DESC_BINS; ++index)
-				{
-					f.desc.vec[vecEntryIndex] = hist[index];
-					vecEntryIndex++;
-				}
+				int blockX = m / DESC_SUB_WINDOW;
+				int bin = descriptorBins.bin[angle[imgX] - orientation + GRADIENT_ANGLE_STEPS];
+				f.desc.vec[(blockY * (DESC_WINDOW / DESC_SUB_WINDOW) + blockX) * DESC_BINS + bin] +=
+					mag[imgX] * descriptorBlockWeights.w[blockY][blockX];
 			}
 		}
 
@@ -909,13 +1268,6 @@ bool CreateSIFTDescriptors(cv::Mat img, std::vector<Feature>& features, std::vec
 		vector<float> descVec(std::begin(f.desc.vec), std::end(f.desc.vec));
 		NormaliseVector(descVec);
 
-		// Confirm that the descriptor size is 128
-		if (descVec.size() != DESC_LENGTH)
-		{
-			std::cout << "Error: feature vector length = " << descVec.size() << std::endl;
-			continue;
-		}
-
 		// Cap every entry to 0.2 max, to remove illumination dependence
 		for (unsigned int j = 0; j < descVec.size(); ++j)
 		{
@@ -930,7 +1282,13 @@ bool CreateSIFTDescriptors(cv::Mat img, std::vector<Feature>& features, std::vec
 
 		// Put back in the array
 		std::copy(descVec.begin(), descVec.end(), f.desc.vec);
-		descriptors.push_back(f.desc);
+	}
+	ReleaseImage(*pool, planes.magnitude);
+	ReleaseImage(*pool, planes.angle);
+
+	for (unsigned int i = 0; i < features.size(); ++i)
+	{
+		descriptors.push_back(features[i].desc);
 	}
 
 	return true;
@@ -941,55 +1299,86 @@ Compute feature orientation.
 This is a window around the feature of size dependent on the feature scale (to come later).
 For now, we'll say a 9x9 window.
 There are 36 bins in the angle histogram, entries weighted by magnitude and by gaussian.
+Returns the orientation in angle steps, for the descriptor to be relative to.
 */
-void ComputeFeatureOrientation(Feature& feature, Mat xgrad, Mat ygrad)
+int ComputeFeatureOrientation(Feature& feature, const GradientPlanes& planes)
 {
-	// get Gaussian weighting function. Use a sigma 1.5 times the scale
-	// For now, sigma is just 1.5
-	Mat gaussKernel = Mat(ANGLE_WINDOW, ANGLE_WINDOW, CV_32F, 1);
-	CreateGaussianKernel(gaussKernel, 1);
-
 	// Create histogram
 	float hist[ORIENTATION_HIST_BINS] = { 0.0f };
 
 	for (int n = -(ANGLE_WINDOW / 2); n <= ANGLE_WINDOW / 2; ++n)
 	{
+		// Ensure that window stays within bounds of image. The planes have the same size
+		int i = n + (int)feature.p.y;
+		if (i < 0 || i >= planes.magnitude.rows)
+			continue;
+
+		const float* mag = planes.magnitude.ptr<float>(i);
+		const uchar* angle = planes.angle.ptr<uchar>(i);
 		for (int m = -(ANGLE_WINDOW / 2); m <= (ANGLE_WINDOW / 2); ++m)
 		{
-			// Compute magnitude and angle and add to histogram
-			int i = n + (int)feature.p.y;
 			int j = m + (int)feature.p.x;
-			
-			// Ensure that window stays within bounds of image. xgrad and ygrad have the same size
-			if (i < 0 || i >= xgrad.rows)
-				continue;
-			if (j < 0 || j >= xgrad.cols)
+			if (j < 0 || j >= planes.magnitude.cols)
 				continue;
 
-			// Get the angle and the magnitude of the gradient at this point, and
-			// add it into the histogram at the right bin
-			float gX = (float)xgrad.at<uchar>(i,j);
-			float gY = (float)ygrad.at<uchar>(i,j);
-			float mag = sqrt(gX*gX + gY* gY);
-			float angle = 0.f;
-			if (gX != 0)
-				angle = RAD2DEG(atan(gY / gX));
-			else
-				angle = 90;
-			hist[(int)(angle / 10)] += mag * gaussKernel.at<float>(n+(ANGLE_WINDOW/2), m+(ANGLE_WINDOW/2));
+			// Add the gradient's magnitude into the histogram at the bin of its direction
+			hist[angle[j] / (GRADIENT_ANGLE_STEPS / ORIENTATION_HIST_BINS)] +=
+				mag[j] * orientationWeights.w[n + (ANGLE_WINDOW / 2)][m + (ANGLE_WINDOW / 2)];
 		}
 	}
 
 	// Find the dominant bin in the histogram
 	// Set the angle of the feature to this bin range in radians
-	float dominantAngle = 0;
-	for (int i = 0; i < ORIENTATION_HIST_BINS; ++i)
+	int dominantBin = 0;
+	for (int i = 1; i < ORIENTATION_HIST_BINS; ++i)
+	{
+		if (hist[i] > hist[dominantBin])
+		{
+			dominantBin = i;
+		}
+	}
+	feature.angle = DEG2RAD(dominantBin * (360.f / ORIENTATION_HIST_BINS));
+	return dominantBin * (GRADIENT_ANGLE_STEPS / ORIENTATION_HIST_BINS);
+}
+
+/*
+	Split a list of features into a FeatureSet.
+	If quantised is set, the descriptors are quantised here, once, and only the bytes are kept.
+*/
+void BuildFeatureSet(_In_ const std::vector<Feature>& features, _Out_ FeatureSet& set, _In_ bool quantised)
+{
+	size_t numFeatures = features.size();
+	set.x.resize(numFeatures);
+	set.y.resize(numFeatures);
+	set.score.resize(numFeatures);
+	set.angle.resize(numFeatures);
+	set.scale.resize(numFeatures);
+	set.quantised = quantised;
+	set.descriptors.clear();
+	set.quantisedDescriptors.clear();
+	if (quantised)
 	{
-		if (hist[i] > dominantAngle)
+		set.quantisedDescriptors.resize(numFeatures * DESC_LENGTH);
+	}
+	else
+	{
+		set.descriptors.resize(numFeatures * DESC_LENGTH);
+	}
+	for (size_t i = 0; i < numFeatures; ++i)
+	{
+		const Feature& f = features[i];
+		set.x[i] = f.p.x;
+		set.y[i] = f.p.y;
+		set.score[i] = f.score;
+		set.angle[i] = f.angle;
+		set.scale[i] = f.scale;
+		if (quantised)
+		{
+			QuantiseDescriptor(f.desc.vec, &set.quantisedDescriptors[i * DESC_LENGTH]);
+		}
+		else
 		{
-			// Cap the angle to be between -180 and 180
-			dominantAngle = hist[i];
-			feature.angle = DEG2RAD(i*10.f);
+			std::copy(std::begin(f.desc.vec), std::end(f.desc.vec), &set.descriptors[i * DESC_LENGTH]);
 		}
 	}
 }
@@ -1000,86 +1389,164 @@ void ComputeFeatureOrientation(Feature& feature, Mat xgrad, Mat ygrad)
 	and they pass the Lowe ratio test - the next closest feature's distance to the closest
 	distance is above a certain ratio.
 
-	The structure of the pair is that the first in the pair is from list1, and the
-	second from list2
+	Each match is the index of the feature in set1, then the index in set2, and
+	distances holds the descriptor distance of each match.
+
+	Set 2 goes into a k-d forest, so each feature of set 1 costs a bounded number of
+	descriptor comparisons rather than one per feature of set 2. Small sets are
+	compared exhaustively with SIMD instead, which is exact.
+
+	If both sets are quantised and set 2 is small enough, they are instead compared
+	exhaustively straight from their bytes, with integer distances. That moves a quarter of
+	the data, and beats the float kernels at any size, but is still all against all, so the
+	forest wins on big sets. Those are expanded back to floats for the forest while they're matched.
 */
-// Support functions
-float DistanceBetweenDescriptors(FeatureDescriptor a, FeatureDescriptor b)
+// Support function
+// Every descriptor of a set as floats, one after the other
+void CopyDescriptors(const FeatureSetView& set, std::vector<float>& data)
 {
-	float dist = 0;
-	vector<float> aVec(std::begin(a.vec), std::end(a.vec));
-	vector<float> bVec(std::begin(b.vec), std::end(b.vec));
-	assert(aVec.size() == bVec.size());
-	for (unsigned int i = 0; i < aVec.size(); ++i)
+	data.resize(set.size() * DESC_LENGTH);
+	for (size_t i = 0; i < set.size(); ++i)
 	{
-		aVec[i] -= bVec[i];
+		set.CopyDescriptor(i, &data[i * DESC_LENGTH]);
 	}
-	return L2_norm(aVec);
 }
-// Actual function
-std::vector<std::pair<Feature, Feature> > MatchDescriptors(
-	std::vector<Feature> list1,
-	std::vector<Feature> list2,
-	float distLimitBetweenMatches)
+// Actual functions
+void MatchFeatureSets(
+	_In_ const FeatureSetView& set1,
+	_In_ const FeatureSetView& set2,
+	_In_ float distLimitBetweenMatches,
+	_Out_ std::vector<FeatureMatch>& matches,
+	_Out_ std::vector<float>& distances)
 {
-	std::vector<std::pair<Feature, Feature> > matches;
+	matches.clear();
+	distances.clear();
+	if (set2.size() < 2)
+	{
+		// Something went badly
+		std::cout << "Error: need at least two features to match against, got " << set2.size() << std::endl;
+		return;
+	}
 
-	// Loop through list 1 and compare each to list 2
-	for (unsigned int i = 0; i < list1.size(); ++i)
+	int numQueries = (int)set1.size();
+	std::vector<NeighbourPair> neighbours(numQueries);
+	if (set1.quantised && set2.quantised && set2.size() <= QUANTISED_BRUTE_FORCE_MAX_POINTS)
 	{
-		auto& f = list1[i];
+		FindTwoNearestNeighboursBruteForce(set1.quantisedDescriptors, numQueries, set2.quantisedDescriptors, (int)set2.size(), neighbours.data());
 
-		// Find the closest two matches to this feature's descriptor in list2
-		int closest = -1;
-		int secondClosest = -1;
-		float minDist = -1;
-		for (unsigned int j = 0; j < list2.size(); ++j)
+		// Back to the units of the float descriptors
+		const float unscale = 1.f / (QUANTISED_DESCRIPTOR_SCALE * QUANTISED_DESCRIPTOR_SCALE);
+		for (auto& n : neighbours)
 		{
-			auto& compareFeature = list2[j];
-			float dist = DistanceBetweenDescriptors(f.desc, compareFeature.desc);
-
-			if (minDist == -1 || dist < minDist)
-			{
-				secondClosest = closest;
-				closest = j;
-				minDist = dist;
-			}
+			n.distClosest *= unscale;
+			n.distSecondClosest *= unscale;
 		}
-
-		if (closest == -1 || secondClosest == -1 || closest == secondClosest)
+	}
+	else
+	{
+		// Index set 2 once, then query it with each feature of set 1
+		DescriptorIndex index;
+		BuildDescriptorIndex(set2, index);
+		std::vector<float> queries;
+		if (set1.quantised)
 		{
-			// Something went badly
-			std::cout << "Error: failed to match feature " << i << std::endl;
-			continue;
+			CopyDescriptors(set1, queries);
 		}
+		FindTwoNearestNeighbours(index, set1.quantised ? queries.data() : set1.descriptors, numQueries, neighbours.data());
+	}
+
+	for (int i = 0; i < numQueries; ++i)
+	{
+		const NeighbourPair& n = neighbours[i];
 
 		// To match, scores must also be sufficiently similar
-		if (abs(f.score - list2[closest].score) > distLimitBetweenMatches)
+		if (abs(set1.score[i] - set2.score[n.closest]) > distLimitBetweenMatches)
 		{
 			continue;
 		}
 
 		// Lowe ratio test
-		float distClosest = minDist;
-		float distSecondClosest = DistanceBetweenDescriptors(f.desc, list2[secondClosest].desc);
+		float distClosest = sqrt(n.distClosest);
+		float distSecondClosest = sqrt(n.distSecondClosest);
 		float ratio = distClosest / distSecondClosest;
 		// Ratio should be 0.8 or less
 		if (ratio < NN_RATIO)
 		{
 			// Create matches with (right, left) structure
-			f.distFromBestMatch = minDist;
-			list2[closest].distFromBestMatch = minDist;
-			std::pair<Feature, Feature> match;
-			match = std::make_pair(f, list2[closest]);
-			matches.push_back(match);
+			matches.push_back(FeatureMatch((uint32_t)i, (uint32_t)n.closest));
+			distances.push_back(distClosest);
 		}
 	}
+}
+
+/*
+	The same for lists of features, with each match as a pair of copies of the features.
+	The first in the pair is from list1, and the second from list2, and both have their
+	distFromBestMatch set to the descriptor distance.
+*/
+std::vector<std::pair<Feature, Feature> > MatchDescriptors(
+	_In_ const std::vector<Feature>& list1,
+	_In_ const std::vector<Feature>& list2,
+	_In_ float distLimitBetweenMatches,
+	_In_ bool quantised)
+{
+	FeatureSet set1, set2;
+	BuildFeatureSet(list1, set1, quantised);
+	BuildFeatureSet(list2, set2, quantised);
+	std::vector<FeatureMatch> indices;
+	std::vector<float> distances;
+	MatchFeatureSets(set1, set2, distLimitBetweenMatches, indices, distances);
+
+	std::vector<std::pair<Feature, Feature> > matches;
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		std::pair<Feature, Feature> match = std::make_pair(list1[indices[i].first], list2[indices[i].second]);
+		match.first.distFromBestMatch = distances[i];
+		match.second.distFromBestMatch = distances[i];
+		matches.push_back(match);
+	}
 
 	return matches;
 }
 
+/*
+	Rank matches from most to least likely to be right, for guided sampling.
+	The closer the descriptors, the better the match.
+*/
+std::vector<int> OrderMatchesByQuality(_In_ const std::vector<float>& distances)
+{
+	std::vector<int> order(distances.size());
+	for (unsigned int i = 0; i < distances.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&distances](int a, int b)
+	{
+		return distances[a] < distances[b];
+	});
+	return order;
+}
+std::vector<int> OrderMatchesByQuality(_In_ const std::vector<std::pair<Feature, Feature> >& matches)
+{
+	std::vector<float> distances(matches.size());
+	for (unsigned int i = 0; i < matches.size(); ++i)
+	{
+		distances[i] = matches[i].first.distFromBestMatch;
+	}
+	return OrderMatchesByQuality(distances);
+}
+
 /*
 	Given a series of image file names, create image descriptors for each file
+
+	With at least as many images as threads, images are shared out between threads one at a
+	time as threads come free, since they can differ in size and in how many features they have.
+	The per-feature loops inside then run serially within a thread, as nested parallel regions do.
+	With fewer images, such as a single stereo pair, that would leave threads idle, so the
+	images are done one after the other instead, and each one gets all the threads.
+	Either way each image writes into its own slot of the output, so the order is the order of
+	the files, and nothing is copied. Each thread keeps its own image pool, so its buffers are
+	reused from one image to the next.
 */
 // Helper - given an image file name, create an image descriptor for that file
 void CreateDescriptorForImage(
@@ -1087,7 +1554,8 @@ void CreateDescriptorForImage(
 	const std::string& folder,
 	ImageDescriptor& imgDesc,
 	const Eigen::MatrixXf& calibMatrix,
-	const Mat& mask)
+	const Mat& mask,
+	ImagePool* pool)
 {
 	string imagePath = folder + "\\" + filename;
 	Mat img = imread(imagePath, IMREAD_GRAYSCALE);
@@ -1102,7 +1570,7 @@ void CreateDescriptorForImage(
 
 	// Find DOH features
 	vector<Feature> features;
-	if (!FindDoHFeatures(img, mask, features))
+	if (!FindDoHFeatures(img, mask, features, pool))
 	{
 #ifdef DEBUG_FEATURES
 		cout << "Failed to find DoH features in image " << filename << endl;
@@ -1128,7 +1596,7 @@ void CreateDescriptorForImage(
 
 	// Create descriptors for each feature in the image
 	std::vector<FeatureDescriptor> descriptors;
-	if (!CreateSIFTDescriptors(img, features, descriptors))
+	if (!CreateSIFTDescriptors(img, features, descriptors, pool))
 	{
 #ifdef DEBUG_FEATURES
 		cout << "Failed to create feature descriptors for image " << filename << endl;
@@ -1142,11 +1610,37 @@ void CreateDescriptorForImage(
 #endif
 
 	imgDesc.filename = filename;
-	imgDesc.features = features;
+	imgDesc.features.swap(features);
 	// Need to decompose K into K and E = [R|t]. 
 	// This E is different to the E later on, which is between two cameras, not per-camera
 	DecomposeProjectiveMatrixIntoKAndE(calibMatrix, imgDesc.K, imgDesc.E);
 }
+// One image pool per thread
+std::vector<ImagePool> MakeThreadImagePools()
+{
+#ifdef _OPENMP
+	return std::vector<ImagePool>(omp_get_max_threads());
+#else
+	return std::vector<ImagePool>(1);
+#endif
+}
+inline ImagePool& GetThreadImagePool(std::vector<ImagePool>& pools)
+{
+#ifdef _OPENMP
+	return pools[omp_get_thread_num()];
+#else
+	return pools[0];
+#endif
+}
+// Whether there are enough images to keep every thread busy with one each
+inline bool ParallelAcrossImages(size_t numImages)
+{
+#ifdef _OPENMP
+	return numImages >= (size_t)omp_get_max_threads();
+#else
+	return false;
+#endif
+}
 // Actual function
 void GetImageDescriptorsForFile(
 	const std::vector<std::string>& filenames,
@@ -1155,61 +1649,78 @@ void GetImageDescriptorsForFile(
 	const std::vector<Eigen::MatrixXf>& calibrationMatrices,
 	const Mat& mask)
 {
-#pragma omp parallel
+	size_t first = images.size();
+	images.resize(first + filenames.size());
+	std::vector<ImagePool> pools = MakeThreadImagePools();
+	bool acrossImages = ParallelAcrossImages(filenames.size());
+#pragma omp parallel for schedule(dynamic, 1) if (acrossImages)
+	for (int idx = 0; idx < (int)filenames.size(); idx++)
 	{
-#pragma omp for 
-		for (int idx = 0; idx < filenames.size(); idx++)
-		{
-			ImageDescriptor i;
-			CreateDescriptorForImage(filenames[idx], folder, i, calibrationMatrices[idx], mask);
-#pragma omp critical
-			images.push_back(i);
-		}
+		CreateDescriptorForImage(filenames[idx], folder, images[first + idx], calibrationMatrices[idx], mask, &GetThreadImagePool(pools));
 	}
 }
-// Similar function but single threaded
-void GetImageDescriptorsForImages(
-	_Inout_ std::vector<ImageDescriptor>& images)
+// Similar function for a list of images, with FAST features
+// Support function
+bool CreateFASTDescriptorsForImage(ImageDescriptor& image, ImagePool* pool)
 {
-	for (auto& image : images)
-	{
-		Mat img = imread(image.filename, IMREAD_GRAYSCALE);
+	Mat img = imread(image.filename, IMREAD_GRAYSCALE);
 
-		vector<Feature> features;
-		FindFASTFeatures(img, features);
-		if (features.empty())
-		{
-			cout << "No features were found in " << image.filename << endl;
-		}
-		features = ScoreAndClusterFeatures(img, features, ST_THRESH, NMS_WINDOW);
-
-		cout << "Found " << features.size() << " features in " << image.filename << endl;
+	vector<Feature> features;
+	FindFASTFeatures(img, features);
+	features = ClusterFASTFeatures(features, FAST_SCORE_THRESH, NMS_WINDOW);
 
 #ifdef DEBUG_FEATURES
-		Mat img_i = imread(image.filename, IMREAD_GRAYSCALE);
-		for (auto& f : features)
-		{
-			circle(img_i, f.p, 3, (255, 255, 0), -1);
-		}
+	Mat img_i = imread(image.filename, IMREAD_GRAYSCALE);
+	for (auto& f : features)
+	{
+		circle(img_i, f.p, 3, (255, 255, 0), -1);
+	}
 
-		// Display
-		imshow("Image - best features", img_i);
-		waitKey(0);
+	// Display
+	imshow("Image - best features", img_i);
+	waitKey(0);
 #endif
 
-		// Create descriptors with scale information for better matching
+	// Create descriptors with scale information for better matching
 
-		// Create descriptors for each feature in the image
-		std::vector<FeatureDescriptor> descriptors;
-		if (!CreateSIFTDescriptors(img, features, descriptors))
+	// Create descriptors for each feature in the image
+	std::vector<FeatureDescriptor> descriptors;
+	if (!CreateSIFTDescriptors(img, features, descriptors, pool))
+	{
+		return false;
+	}
+
+	image.width = img.cols;
+	image.height = img.rows;
+	image.features.swap(features);
+	return true;
+}
+// Actual function
+void GetImageDescriptorsForImages(
+	_Inout_ std::vector<ImageDescriptor>& images)
+{
+	std::vector<ImagePool> pools = MakeThreadImagePools();
+	std::vector<unsigned char> described(images.size());
+	bool acrossImages = ParallelAcrossImages(images.size());
+#pragma omp parallel for schedule(dynamic, 1) if (acrossImages)
+	for (int i = 0; i < (int)images.size(); ++i)
+	{
+		described[i] = CreateFASTDescriptorsForImage(images[i], &GetThreadImagePool(pools));
+	}
+
+	// Report once they're all done, so the output is in order
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		if (!described[i])
 		{
-			cout << "Failed to create feature descriptors for image " << image.filename << endl;
+			cout << "Failed to create feature descriptors for image " << images[i].filename << endl;
 			continue;
 		}
-
-		image.width = img.cols;
-		image.height = img.rows;
-		image.features = features;
+		if (images[i].features.empty())
+		{
+			cout << "No features were found in " << images[i].filename << endl;
+		}
+		cout << "Found " << images[i].features.size() << " features in " << images[i].filename << endl;
 	}
 }
 
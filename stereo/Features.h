@@ -6,11 +6,18 @@
 #include <Eigen/Core>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <xmmintrin.h>
+#include <new>
+#include <cstdint>
+#include "ScaleSpace.h"
 
 // Parameters to tune
 #define FAST_THRESHOLD 30 //30
+// For clustering on the FAST score alone: the contrast of a corner's arc, in grey levels
+#define FAST_SCORE_THRESH 50.f
 #define ST_THRESH 700.f
 #define HARRIS_THRESH 100000000.f
 #define NMS_WINDOW 2
@@ -19,12 +26,13 @@
 
 // Other parameters
 #define HARRIS_WINDOW 5
-#define SCALE_PYRAMID_LEVELS 1 //4
 #define HARRIS_CONSTANT 0.05f //https://courses.cs.washington.edu/courses/cse576/06sp/notes/HarrisDetector.pdf
 #define ST_WINDOW 3
 #define FAST_SPACING 3
 #define ANGLE_WINDOW 9
 #define ORIENTATION_HIST_BINS 36
+// Gradient directions are quantised to 5 degrees, so orientation and descriptor bins are whole steps
+#define GRADIENT_ANGLE_STEPS 72
 #define DESC_BINS 8
 #define DESC_BIN_SIZE 45
 #define DESC_WINDOW 16
@@ -35,7 +43,6 @@
 
 // DOH constants
 #define DOH_WINDOW 11
-#define SCALE_SPACE_ITERATIONS 2 //11
 #define DOH_THRESHOLD 10000000000.0
 
 
@@ -44,6 +51,10 @@
 #define DEG2RAD(A) (A*PI/180.f)
 
 #define DESC_LENGTH 128
+// Quantised descriptors hold each entry as a byte, scaled by this as in Lowe's SIFT.
+// They take a quarter of the memory, and their distances are integers.
+#define QUANTISED_DESCRIPTOR_SCALE 512.f
+
 struct FeatureDescriptor
 {
 	float vec[DESC_LENGTH];
@@ -51,6 +62,7 @@ struct FeatureDescriptor
 
 struct Feature
 {
+	// The index of the scale space level the feature was found at
 	int scale;
 	cv::Point2f p;
 	float score;
@@ -142,6 +154,128 @@ struct ImageDescriptor
 	}
 };
 
+/*
+	An allocator for std::vector that aligns its storage, for data the SIMD kernels stream through.
+*/
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+	typedef T value_type;
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator() {}
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t n)
+	{
+		void* p = _mm_malloc(n * sizeof(T), Alignment);
+		if (p == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return (T*)p;
+	}
+	void deallocate(T* p, size_t)
+	{
+		_mm_free(p);
+	}
+
+	bool operator == (const AlignedAllocator&) const { return true; }
+	bool operator != (const AlignedAllocator&) const { return false; }
+};
+
+/*
+	A set of features stored as a structure of arrays.
+	The geometry is kept apart from the descriptors, so code that only needs positions -
+	RANSAC, triangulation - reads 8 bytes a feature rather than a whole Feature.
+	The descriptors are the rows of one matrix, each starting on a cache line,
+	which the matching kernels read directly.
+
+	A quantised set holds its descriptors as bytes instead, a quarter of the size, and has
+	no float matrix at all. Anything that needs floats from it, such as the k-d forest or the
+	vocabulary tree, asks for them a descriptor at a time with CopyDescriptor.
+*/
+#define FEATURE_SET_ALIGNMENT 64
+struct FeatureSet
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> score;
+	std::vector<float> angle;
+	std::vector<int> scale;
+	bool quantised = false;
+	// DESC_LENGTH floats per feature, if not quantised
+	std::vector<float, AlignedAllocator<float, FEATURE_SET_ALIGNMENT> > descriptors;
+	// DESC_LENGTH bytes per feature, if quantised
+	std::vector<uint8_t, AlignedAllocator<uint8_t, FEATURE_SET_ALIGNMENT> > quantisedDescriptors;
+
+	size_t size() const { return x.size(); }
+	cv::Point2f Point(size_t i) const { return cv::Point2f(x[i], y[i]); }
+	const float* Descriptor(size_t i) const { return &descriptors[i * DESC_LENGTH]; }
+	const uint8_t* QuantisedDescriptor(size_t i) const { return &quantisedDescriptors[i * DESC_LENGTH]; }
+};
+
+/*
+	A read-only view of a set of features laid out as in FeatureSet, wherever the arrays
+	live - a FeatureSet, or a feature cache mapped straight in from disk.
+	It doesn't own anything, so whatever it views has to outlive it.
+*/
+struct FeatureSetView
+{
+	size_t numFeatures = 0;
+	const float* x = nullptr;
+	const float* y = nullptr;
+	const float* score = nullptr;
+	const float* angle = nullptr;
+	const int* scale = nullptr;
+	bool quantised = false;
+	const float* descriptors = nullptr;
+	const uint8_t* quantisedDescriptors = nullptr;
+
+	FeatureSetView() {}
+	FeatureSetView(const FeatureSet& set) :
+		numFeatures(set.size()),
+		x(set.x.data()),
+		y(set.y.data()),
+		score(set.score.data()),
+		angle(set.angle.data()),
+		scale(set.scale.data()),
+		quantised(set.quantised),
+		descriptors(set.descriptors.data()),
+		quantisedDescriptors(set.quantisedDescriptors.data())
+	{}
+
+	size_t size() const { return numFeatures; }
+	cv::Point2f Point(size_t i) const { return cv::Point2f(x[i], y[i]); }
+	const float* Descriptor(size_t i) const { return descriptors + i * DESC_LENGTH; }
+	const uint8_t* QuantisedDescriptor(size_t i) const { return quantisedDescriptors + i * DESC_LENGTH; }
+
+	// Descriptor i as floats, whichever way the set holds it
+	void CopyDescriptor(size_t i, float* out) const
+	{
+		if (quantised)
+		{
+			const uint8_t* q = QuantisedDescriptor(i);
+			for (int k = 0; k < DESC_LENGTH; ++k)
+			{
+				out[k] = q[k] * (1.f / QUANTISED_DESCRIPTOR_SCALE);
+			}
+		}
+		else
+		{
+			std::copy(Descriptor(i), Descriptor(i) + DESC_LENGTH, out);
+		}
+	}
+};
+
+// A match between two feature sets: the index of the feature in the first, and in the second
+typedef std::pair<uint32_t, uint32_t> FeatureMatch;
+
 /*
 	Equality of features
 	Two features are equal if their descriptors are equal
@@ -161,9 +295,45 @@ inline bool operator==(const Feature& a, const Feature& b)
 // Feature comparator
 bool FeatureCompare(Feature a, Feature b);
 
+/*
+	The structure tensor of an image: the products of its gradients, each summed over a
+	Gaussian-weighted window around every pixel.
+	  xx  xy
+	  xy  yy
+	Harris, Shi-Tomasi and the DoH score are all simple functions of these three planes.
+*/
+struct StructureTensor
+{
+	cv::Mat xx;
+	cv::Mat xy;
+	cv::Mat yy;
+};
+
+/*
+	The gradient of an image as a magnitude and a direction at every pixel.
+	The direction is in GRADIENT_ANGLE_STEPS steps, turning from the x axis towards the y axis.
+*/
+struct GradientPlanes
+{
+	cv::Mat magnitude;	// CV_32F
+	cv::Mat angle;		// CV_8U
+};
+
 /*
 	Feature Detection functions
 */
+bool ComputeStructureTensor(
+	_In_ const cv::Mat& grad_x,
+	_In_ const cv::Mat& grad_y,
+	_In_ int windowSize,
+	_In_ float sigma,
+	_Out_ StructureTensor& tensor);
+
+void ComputeGradientPlanes(
+	_In_ const cv::Mat& grad_x,
+	_In_ const cv::Mat& grad_y,
+	_Out_ GradientPlanes& planes);
+
 bool FindFASTFeatures(
 	cv::Mat img,
 	std::vector<Feature>& features);
@@ -171,29 +341,56 @@ bool FindFASTFeatures(
 bool FindDoHFeatures(
 	cv::Mat input, 
 	cv::Mat mask,
-	std::vector<Feature>& features);
+	std::vector<Feature>& features,
+	_Inout_opt_ ImagePool* pool = nullptr);
 
 std::vector<Feature> ClusterFeatures(
-	std::vector<Feature>& features,
-	const int windowSize);
+	_In_ const std::vector<Feature>& features,
+	_In_ float windowSize);
+
+std::vector<Feature> ClusterFASTFeatures(
+	_In_ const std::vector<Feature>& features,
+	_In_ float minScore,
+	_In_ float distanceForWithinCluster);
 
 std::vector<Feature> FindHarrisCorners(
 	const cv::Mat& input,
-	int nmsWindowSize);
+	int nmsWindowSize,
+	_Inout_opt_ ImagePool* pool = nullptr);
 
 std::vector<Feature> ScoreAndClusterFeatures(
 	const cv::Mat& img,
 	std::vector<Feature>& features,
 	float scoreThreshold,
-	float distanceForWithinCluster);
+	float distanceForWithinCluster,
+	_Inout_opt_ ImagePool* pool = nullptr);
 
 bool CreateSIFTDescriptors(
 	cv::Mat img,
 	std::vector<Feature>& features,
-	std::vector<FeatureDescriptor>& descriptors);
+	std::vector<FeatureDescriptor>& descriptors,
+	_Inout_opt_ ImagePool* pool = nullptr);
+
+void BuildFeatureSet(
+	_In_ const std::vector<Feature>& features,
+	_Out_ FeatureSet& set,
+	_In_ bool quantised = false);
+
+void MatchFeatureSets(
+	_In_ const FeatureSetView& set1,
+	_In_ const FeatureSetView& set2,
+	_In_ float distLimitBetweenMatches,
+	_Out_ std::vector<FeatureMatch>& matches,
+	_Out_ std::vector<float>& distances);
 
 std::vector<std::pair<Feature, Feature> > MatchDescriptors(
-	std::vector<Feature> list1, std::vector<Feature> list2, float distLimitBetweenMatches);
+	_In_ const std::vector<Feature>& list1,
+	_In_ const std::vector<Feature>& list2,
+	_In_ float distLimitBetweenMatches,
+	_In_ bool quantised = false);
+
+std::vector<int> OrderMatchesByQuality(_In_ const std::vector<std::pair<Feature, Feature> >& matches);
+std::vector<int> OrderMatchesByQuality(_In_ const std::vector<float>& distances);
 
 void GetImageDescriptorsForFile(
 	const std::vector<std::string>& filenames,
@@ -210,9 +407,4 @@ bool ReadDescriptorsFromFile(
 	const std::string& filename,
 	std::vector<ImageDescriptor>& images);
 
-void GetImageDescriptorsForImages(_Inout_ std::vector<ImageDescriptor>& images);
-
-/*
-	Feature Detection Unit Test functions
-*/
-void TestSequential12(void);
\ No newline at end of file
+void GetImageDescriptorsForImages(_Inout_ std::vector<ImageDescriptor>& images);
\ No newline at end of file
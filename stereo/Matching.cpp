@@ -0,0 +1,800 @@
+#include "Matching.h"
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cfloat>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC lets any function use any intrinsic, but GCC and Clang need to be told which
+// functions may use the wider instruction sets. Those are only called once the CPU is known to have them
+#if defined(__GNUC__)
+#define TARGET_SSE4 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+#define TARGET_SSE4
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+using namespace std;
+
+/*
+	Squared L2 distance between two descriptors.
+	The comparisons only need the ordering, so the sqrt is left to whoever needs the real distance.
+*/
+float SquaredDistanceBetweenDescriptors(_In_ const float* a, _In_ const float* b)
+{
+	float dist = 0;
+	for (int i = 0; i < DESC_LENGTH; ++i)
+	{
+		float diff = a[i] - b[i];
+		dist += diff * diff;
+	}
+	return dist;
+}
+
+/*
+	Quantised descriptors.
+	Each entry is scaled by QUANTISED_DESCRIPTOR_SCALE and stored in a byte, as Lowe does for SIFT.
+	After the illuminance cap and renormalisation only descriptors with nearly all their
+	weight in a few bins have entries above 0.5, and those are clamped to 255.
+	Squared distances between them are exact integers, below 2^24, so they also fit a float exactly.
+*/
+void QuantiseDescriptor(_In_ const float* desc, _Out_ uint8_t* quantised)
+{
+	for (int i = 0; i < DESC_LENGTH; ++i)
+	{
+		int value = (int)(desc[i] * QUANTISED_DESCRIPTOR_SCALE + 0.5f);
+		quantised[i] = (uint8_t)max(0, min(255, value));
+	}
+}
+
+void QuantiseDescriptors(_In_ const float* descriptors, _In_ int numDescriptors, _Out_ std::vector<uint8_t>& data)
+{
+	data.resize((size_t)numDescriptors * DESC_LENGTH);
+	for (int i = 0; i < numDescriptors; ++i)
+	{
+		QuantiseDescriptor(descriptors + (size_t)i * DESC_LENGTH, &data[(size_t)i * DESC_LENGTH]);
+	}
+}
+
+int SquaredDistanceBetweenQuantisedDescriptors(_In_ const uint8_t* a, _In_ const uint8_t* b)
+{
+	int dist = 0;
+	for (int i = 0; i < DESC_LENGTH; ++i)
+	{
+		int diff = (int)a[i] - (int)b[i];
+		dist += diff * diff;
+	}
+	return dist;
+}
+
+/*
+	Pick the widest distance kernel this CPU and OS can run.
+	This is checked once, the first time it's asked for.
+*/
+// Support function
+DescriptorKernel DetectDescriptorKernel()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse4 = (info[2] & (1 << 19)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool avx2 = false;
+	bool avx512 = false;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+		avx512 = (info[1] & (1 << 16)) != 0;
+	}
+	// The OS also has to save the wider registers on a context switch
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool osAvx = (xcr0 & 0x6) == 0x6;
+	bool osAvx512 = (xcr0 & 0xE6) == 0xE6;
+	if (avx512 && avx2 && fma && osAvx512)
+	{
+		return DESCRIPTOR_KERNEL_AVX512;
+	}
+	if (avx2 && fma && avx && osAvx)
+	{
+		return DESCRIPTOR_KERNEL_AVX2;
+	}
+	if (sse4)
+	{
+		return DESCRIPTOR_KERNEL_SSE4;
+	}
+	return DESCRIPTOR_KERNEL_SCALAR;
+#elif defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return DESCRIPTOR_KERNEL_AVX512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return DESCRIPTOR_KERNEL_AVX2;
+	}
+	if (__builtin_cpu_supports("sse4.1"))
+	{
+		return DESCRIPTOR_KERNEL_SSE4;
+	}
+	return DESCRIPTOR_KERNEL_SCALAR;
+#else
+	return DESCRIPTOR_KERNEL_SCALAR;
+#endif
+}
+// Actual function
+DescriptorKernel GetDescriptorKernel()
+{
+	static const DescriptorKernel kernel = DetectDescriptorKernel();
+	return kernel;
+}
+
+/*
+	Brute-force two nearest neighbours, for a batch of queries against a batch of training descriptors.
+
+	The kernels take four queries at a time and stream the training descriptors past them,
+	so each training value loaded is used four times. The four squared distances come out
+	together in one register, and the closest two for each query stay in registers too,
+	updated with compares and blends rather than branches. Nothing takes a sqrt.
+
+	The work is blocked so a tile of training descriptors stays in cache while a tile of
+	queries runs over it, and the query tiles are shared between threads.
+	Ties go to the lower index, as in a plain loop.
+
+	Quantised descriptors have their own kernels. The absolute difference of two bytes is
+	taken with saturating subtracts, then widened to 16 bits and squared and summed in pairs
+	with one multiply-add, so a register holds twice as many entries as with floats.
+	These have no AVX-512 version, which would need AVX-512BW, and use AVX2 there instead.
+*/
+// Support functions
+struct NeighbourTile
+{
+	float dist[2][4];
+	int index[2][4];
+};
+
+typedef void(*NeighbourTileKernel)(const float* const queries[4], const float* train, int begin, int end, NeighbourTile& tile);
+
+void NeighbourTileScalar(const float* const queries[4], const float* train, int begin, int end, NeighbourTile& tile)
+{
+	for (int j = begin; j < end; ++j)
+	{
+		const float* t = train + (size_t)j * DESC_LENGTH;
+		for (int q = 0; q < 4; ++q)
+		{
+			float dist = SquaredDistanceBetweenDescriptors(queries[q], t);
+			if (dist < tile.dist[0][q])
+			{
+				tile.dist[1][q] = tile.dist[0][q];
+				tile.index[1][q] = tile.index[0][q];
+				tile.dist[0][q] = dist;
+				tile.index[0][q] = j;
+			}
+			else if (dist < tile.dist[1][q])
+			{
+				tile.dist[1][q] = dist;
+				tile.index[1][q] = j;
+			}
+		}
+	}
+}
+
+// Fold four distances for training descriptor j into the running closest two of each query
+TARGET_SSE4 inline void UpdateNeighbourTile(__m128 dist, int j, __m128& best0, __m128& best1, __m128i& index0, __m128i& index1)
+{
+	__m128 closer0 = _mm_cmplt_ps(dist, best0);
+	__m128 closer1 = _mm_cmplt_ps(dist, best1);
+	__m128i vj = _mm_set1_epi32(j);
+	// If it beats the closest, the closest moves down to second, otherwise it may replace the second
+	best1 = _mm_blendv_ps(best1, _mm_blendv_ps(dist, best0, closer0), closer1);
+	index1 = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(index1),
+		_mm_blendv_ps(_mm_castsi128_ps(vj), _mm_castsi128_ps(index0), closer0), closer1));
+	best0 = _mm_blendv_ps(best0, dist, closer0);
+	index0 = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(index0), _mm_castsi128_ps(vj), closer0));
+}
+
+TARGET_SSE4 void NeighbourTileSSE4(const float* const queries[4], const float* train, int begin, int end, NeighbourTile& tile)
+{
+	__m128 best0 = _mm_loadu_ps(tile.dist[0]);
+	__m128 best1 = _mm_loadu_ps(tile.dist[1]);
+	__m128i index0 = _mm_loadu_si128((const __m128i*)tile.index[0]);
+	__m128i index1 = _mm_loadu_si128((const __m128i*)tile.index[1]);
+	for (int j = begin; j < end; ++j)
+	{
+		const float* t = train + (size_t)j * DESC_LENGTH;
+		__m128 sum[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+		for (int d = 0; d < DESC_LENGTH; d += 4)
+		{
+			__m128 vt = _mm_loadu_ps(t + d);
+			for (int q = 0; q < 4; ++q)
+			{
+				__m128 diff = _mm_sub_ps(_mm_loadu_ps(queries[q] + d), vt);
+				sum[q] = _mm_add_ps(sum[q], _mm_mul_ps(diff, diff));
+			}
+		}
+		__m128 dist = _mm_hadd_ps(_mm_hadd_ps(sum[0], sum[1]), _mm_hadd_ps(sum[2], sum[3]));
+		UpdateNeighbourTile(dist, j, best0, best1, index0, index1);
+	}
+	_mm_storeu_ps(tile.dist[0], best0);
+	_mm_storeu_ps(tile.dist[1], best1);
+	_mm_storeu_si128((__m128i*)tile.index[0], index0);
+	_mm_storeu_si128((__m128i*)tile.index[1], index1);
+}
+
+// Sum each of four registers across its lanes, into the four lanes of one register
+TARGET_AVX2 inline __m128 HorizontalSum4(__m256 a, __m256 b, __m256 c, __m256 d)
+{
+	__m256 sum = _mm256_hadd_ps(_mm256_hadd_ps(a, b), _mm256_hadd_ps(c, d));
+	return _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+}
+
+TARGET_AVX2 void NeighbourTileAVX2(const float* const queries[4], const float* train, int begin, int end, NeighbourTile& tile)
+{
+	__m128 best0 = _mm_loadu_ps(tile.dist[0]);
+	__m128 best1 = _mm_loadu_ps(tile.dist[1]);
+	__m128i index0 = _mm_loadu_si128((const __m128i*)tile.index[0]);
+	__m128i index1 = _mm_loadu_si128((const __m128i*)tile.index[1]);
+	for (int j = begin; j < end; ++j)
+	{
+		const float* t = train + (size_t)j * DESC_LENGTH;
+		__m256 sum[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+		for (int d = 0; d < DESC_LENGTH; d += 8)
+		{
+			__m256 vt = _mm256_loadu_ps(t + d);
+			for (int q = 0; q < 4; ++q)
+			{
+				__m256 diff = _mm256_sub_ps(_mm256_loadu_ps(queries[q] + d), vt);
+				sum[q] = _mm256_fmadd_ps(diff, diff, sum[q]);
+			}
+		}
+		UpdateNeighbourTile(HorizontalSum4(sum[0], sum[1], sum[2], sum[3]), j, best0, best1, index0, index1);
+	}
+	_mm_storeu_ps(tile.dist[0], best0);
+	_mm_storeu_ps(tile.dist[1], best1);
+	_mm_storeu_si128((__m128i*)tile.index[0], index0);
+	_mm_storeu_si128((__m128i*)tile.index[1], index1);
+}
+
+TARGET_AVX512 void NeighbourTileAVX512(const float* const queries[4], const float* train, int begin, int end, NeighbourTile& tile)
+{
+	__m128 best0 = _mm_loadu_ps(tile.dist[0]);
+	__m128 best1 = _mm_loadu_ps(tile.dist[1]);
+	__m128i index0 = _mm_loadu_si128((const __m128i*)tile.index[0]);
+	__m128i index1 = _mm_loadu_si128((const __m128i*)tile.index[1]);
+	for (int j = begin; j < end; ++j)
+	{
+		const float* t = train + (size_t)j * DESC_LENGTH;
+		__m512 sum[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+		for (int d = 0; d < DESC_LENGTH; d += 16)
+		{
+			__m512 vt = _mm512_loadu_ps(t + d);
+			for (int q = 0; q < 4; ++q)
+			{
+				__m512 diff = _mm512_sub_ps(_mm512_loadu_ps(queries[q] + d), vt);
+				sum[q] = _mm512_fmadd_ps(diff, diff, sum[q]);
+			}
+		}
+		// Fold each down to 256 bits, then finish as in the AVX2 kernel
+		__m256 half[4];
+		for (int q = 0; q < 4; ++q)
+		{
+			__m512 upper = _mm512_shuffle_f32x4(sum[q], sum[q], _MM_SHUFFLE(3, 2, 3, 2));
+			half[q] = _mm256_add_ps(_mm512_castps512_ps256(sum[q]), _mm512_castps512_ps256(upper));
+		}
+		UpdateNeighbourTile(HorizontalSum4(half[0], half[1], half[2], half[3]), j, best0, best1, index0, index1);
+	}
+	_mm_storeu_ps(tile.dist[0], best0);
+	_mm_storeu_ps(tile.dist[1], best1);
+	_mm_storeu_si128((__m128i*)tile.index[0], index0);
+	_mm_storeu_si128((__m128i*)tile.index[1], index1);
+}
+
+NeighbourTileKernel GetNeighbourTileKernel(DescriptorKernel kernel)
+{
+	switch (kernel)
+	{
+	case DESCRIPTOR_KERNEL_AVX512:
+		return &NeighbourTileAVX512;
+	case DESCRIPTOR_KERNEL_AVX2:
+		return &NeighbourTileAVX2;
+	case DESCRIPTOR_KERNEL_SSE4:
+		return &NeighbourTileSSE4;
+	default:
+		return &NeighbourTileScalar;
+	}
+}
+
+typedef void(*QuantisedTileKernel)(const uint8_t* const queries[4], const uint8_t* train, int begin, int end, NeighbourTile& tile);
+
+void QuantisedTileScalar(const uint8_t* const queries[4], const uint8_t* train, int begin, int end, NeighbourTile& tile)
+{
+	for (int j = begin; j < end; ++j)
+	{
+		const uint8_t* t = train + (size_t)j * DESC_LENGTH;
+		for (int q = 0; q < 4; ++q)
+		{
+			float dist = (float)SquaredDistanceBetweenQuantisedDescriptors(queries[q], t);
+			if (dist < tile.dist[0][q])
+			{
+				tile.dist[1][q] = tile.dist[0][q];
+				tile.index[1][q] = tile.index[0][q];
+				tile.dist[0][q] = dist;
+				tile.index[0][q] = j;
+			}
+			else if (dist < tile.dist[1][q])
+			{
+				tile.dist[1][q] = dist;
+				tile.index[1][q] = j;
+			}
+		}
+	}
+}
+
+// Sum of squares of the byte differences, added into 32-bit lanes
+TARGET_SSE4 inline __m128i SquaredDifferenceSum(__m128i a, __m128i b, __m128i sum)
+{
+	__m128i absDiff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+	__m128i lo = _mm_unpacklo_epi8(absDiff, _mm_setzero_si128());
+	__m128i hi = _mm_unpackhi_epi8(absDiff, _mm_setzero_si128());
+	return _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+}
+
+TARGET_SSE4 void QuantisedTileSSE4(const uint8_t* const queries[4], const uint8_t* train, int begin, int end, NeighbourTile& tile)
+{
+	__m128 best0 = _mm_loadu_ps(tile.dist[0]);
+	__m128 best1 = _mm_loadu_ps(tile.dist[1]);
+	__m128i index0 = _mm_loadu_si128((const __m128i*)tile.index[0]);
+	__m128i index1 = _mm_loadu_si128((const __m128i*)tile.index[1]);
+	for (int j = begin; j < end; ++j)
+	{
+		const uint8_t* t = train + (size_t)j * DESC_LENGTH;
+		__m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+		for (int d = 0; d < DESC_LENGTH; d += 16)
+		{
+			__m128i vt = _mm_loadu_si128((const __m128i*)(t + d));
+			for (int q = 0; q < 4; ++q)
+			{
+				sum[q] = SquaredDifferenceSum(_mm_loadu_si128((const __m128i*)(queries[q] + d)), vt, sum[q]);
+			}
+		}
+		__m128i dist = _mm_hadd_epi32(_mm_hadd_epi32(sum[0], sum[1]), _mm_hadd_epi32(sum[2], sum[3]));
+		UpdateNeighbourTile(_mm_cvtepi32_ps(dist), j, best0, best1, index0, index1);
+	}
+	_mm_storeu_ps(tile.dist[0], best0);
+	_mm_storeu_ps(tile.dist[1], best1);
+	_mm_storeu_si128((__m128i*)tile.index[0], index0);
+	_mm_storeu_si128((__m128i*)tile.index[1], index1);
+}
+
+TARGET_AVX2 inline __m256i SquaredDifferenceSum(__m256i a, __m256i b, __m256i sum)
+{
+	__m256i absDiff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+	__m256i lo = _mm256_unpacklo_epi8(absDiff, _mm256_setzero_si256());
+	__m256i hi = _mm256_unpackhi_epi8(absDiff, _mm256_setzero_si256());
+	return _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+}
+
+TARGET_AVX2 void QuantisedTileAVX2(const uint8_t* const queries[4], const uint8_t* train, int begin, int end, NeighbourTile& tile)
+{
+	__m128 best0 = _mm_loadu_ps(tile.dist[0]);
+	__m128 best1 = _mm_loadu_ps(tile.dist[1]);
+	__m128i index0 = _mm_loadu_si128((const __m128i*)tile.index[0]);
+	__m128i index1 = _mm_loadu_si128((const __m128i*)tile.index[1]);
+	for (int j = begin; j < end; ++j)
+	{
+		const uint8_t* t = train + (size_t)j * DESC_LENGTH;
+		__m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+		for (int d = 0; d < DESC_LENGTH; d += 32)
+		{
+			__m256i vt = _mm256_loadu_si256((const __m256i*)(t + d));
+			for (int q = 0; q < 4; ++q)
+			{
+				sum[q] = SquaredDifferenceSum(_mm256_loadu_si256((const __m256i*)(queries[q] + d)), vt, sum[q]);
+			}
+		}
+		__m256i dist = _mm256_hadd_epi32(_mm256_hadd_epi32(sum[0], sum[1]), _mm256_hadd_epi32(sum[2], sum[3]));
+		__m128i dist4 = _mm_add_epi32(_mm256_castsi256_si128(dist), _mm256_extracti128_si256(dist, 1));
+		UpdateNeighbourTile(_mm_cvtepi32_ps(dist4), j, best0, best1, index0, index1);
+	}
+	_mm_storeu_ps(tile.dist[0], best0);
+	_mm_storeu_ps(tile.dist[1], best1);
+	_mm_storeu_si128((__m128i*)tile.index[0], index0);
+	_mm_storeu_si128((__m128i*)tile.index[1], index1);
+}
+
+QuantisedTileKernel GetQuantisedTileKernel(DescriptorKernel kernel)
+{
+	switch (kernel)
+	{
+	case DESCRIPTOR_KERNEL_AVX512:
+	case DESCRIPTOR_KERNEL_AVX2:
+		return &QuantisedTileAVX2;
+	case DESCRIPTOR_KERNEL_SSE4:
+		return &QuantisedTileSSE4;
+	default:
+		return &QuantisedTileScalar;
+	}
+}
+
+// The tiling and threading, shared by the float and quantised kernels
+template <typename T>
+void BruteForceTiles(
+	const T* queries,
+	int numQueries,
+	const T* train,
+	int numTrain,
+	NeighbourPair* results,
+	void(*tileKernel)(const T* const queries[4], const T* train, int begin, int end, NeighbourTile& tile))
+{
+	int numQueryTiles = (numQueries + DESCRIPTOR_QUERY_TILE - 1) / DESCRIPTOR_QUERY_TILE;
+
+#pragma omp parallel for schedule(dynamic)
+	for (int queryTile = 0; queryTile < numQueryTiles; ++queryTile)
+	{
+		int queryBegin = queryTile * DESCRIPTOR_QUERY_TILE;
+		int queryEnd = min(queryBegin + DESCRIPTOR_QUERY_TILE, numQueries);
+		const int numGroups = DESCRIPTOR_QUERY_TILE / 4;
+		NeighbourTile tiles[numGroups];
+		for (int g = 0; g < numGroups; ++g)
+		{
+			for (int q = 0; q < 4; ++q)
+			{
+				tiles[g].dist[0][q] = FLT_MAX;
+				tiles[g].dist[1][q] = FLT_MAX;
+				tiles[g].index[0][q] = -1;
+				tiles[g].index[1][q] = -1;
+			}
+		}
+
+		for (int trainBegin = 0; trainBegin < numTrain; trainBegin += DESCRIPTOR_TRAIN_TILE)
+		{
+			int trainEnd = min(trainBegin + DESCRIPTOR_TRAIN_TILE, numTrain);
+			for (int g = 0; g * 4 + queryBegin < queryEnd; ++g)
+			{
+				// A short last group repeats its last query, and the repeats are thrown away
+				const T* groupQueries[4];
+				for (int q = 0; q < 4; ++q)
+				{
+					int i = min(queryBegin + g * 4 + q, queryEnd - 1);
+					groupQueries[q] = queries + (size_t)i * DESC_LENGTH;
+				}
+				tileKernel(groupQueries, train, trainBegin, trainEnd, tiles[g]);
+			}
+		}
+
+		for (int i = queryBegin; i < queryEnd; ++i)
+		{
+			const NeighbourTile& tile = tiles[(i - queryBegin) / 4];
+			int q = (i - queryBegin) % 4;
+			NeighbourPair& result = results[i];
+			result.closest = tile.index[0][q];
+			result.secondClosest = tile.index[1][q];
+			result.distClosest = tile.index[0][q] == -1 ? 0 : tile.dist[0][q];
+			result.distSecondClosest = tile.index[1][q] == -1 ? 0 : tile.dist[1][q];
+		}
+	}
+}
+// Actual functions
+void FindTwoNearestNeighboursBruteForce(
+	_In_ const float* queries,
+	_In_ int numQueries,
+	_In_ const float* train,
+	_In_ int numTrain,
+	_Out_ NeighbourPair* results,
+	_In_ DescriptorKernel kernel)
+{
+	BruteForceTiles(queries, numQueries, train, numTrain, results, GetNeighbourTileKernel(kernel));
+}
+
+void FindTwoNearestNeighboursBruteForce(
+	_In_ const uint8_t* queries,
+	_In_ int numQueries,
+	_In_ const uint8_t* train,
+	_In_ int numTrain,
+	_Out_ NeighbourPair* results,
+	_In_ DescriptorKernel kernel)
+{
+	BruteForceTiles(queries, numQueries, train, numTrain, results, GetQuantisedTileKernel(kernel));
+}
+
+/*
+	Build the index for a feature list.
+	This is done once per image, and then queried by every feature of the other image.
+*/
+// Support functions
+int ChooseSplitDimension(const DescriptorIndex& index, const int* order, int numPoints, float& splitValue, mt19937& rng)
+{
+	// Estimate the mean and variance of each dimension from a spread of the points
+	int step = max(1, numPoints / KDTREE_VARIANCE_SAMPLES);
+	int count = 0;
+	double mean[DESC_LENGTH] = { 0 };
+	double meanSquare[DESC_LENGTH] = { 0 };
+	for (int i = 0; i < numPoints; i += step)
+	{
+		const float* p = &index.data[(size_t)order[i] * DESC_LENGTH];
+		for (int d = 0; d < DESC_LENGTH; ++d)
+		{
+			mean[d] += p[d];
+			meanSquare[d] += (double)p[d] * p[d];
+		}
+		++count;
+	}
+	double variance[DESC_LENGTH];
+	for (int d = 0; d < DESC_LENGTH; ++d)
+	{
+		mean[d] /= count;
+		variance[d] = meanSquare[d] / count - mean[d] * mean[d];
+	}
+
+	// Pick at random among the dimensions with the highest variance
+	int dims[DESC_LENGTH];
+	for (int d = 0; d < DESC_LENGTH; ++d)
+	{
+		dims[d] = d;
+	}
+	partial_sort(dims, dims + KDTREE_RANDOM_DIMS, dims + DESC_LENGTH, [&variance](int a, int b)
+	{
+		return variance[a] > variance[b];
+	});
+	int dim = dims[rng() % KDTREE_RANDOM_DIMS];
+	splitValue = (float)mean[dim];
+	return dim;
+}
+
+int BuildKDTreeNode(const DescriptorIndex& index, KDTree& tree, int begin, int end, mt19937& rng)
+{
+	int nodeIndex = (int)tree.nodes.size();
+	tree.nodes.push_back(KDTreeNode());
+	KDTreeNode node;
+	node.dim = -1;
+	node.value = 0;
+	node.begin = begin;
+	node.end = end;
+	node.child[0] = -1;
+	node.child[1] = -1;
+
+	if (end - begin > KDTREE_LEAF_SIZE)
+	{
+		int* order = &tree.order[begin];
+		int numPoints = end - begin;
+		node.dim = ChooseSplitDimension(index, order, numPoints, node.value, rng);
+
+		auto value = [&index, &node](int p) { return index.data[(size_t)p * DESC_LENGTH + node.dim]; };
+		int mid = (int)(partition(order, order + numPoints, [&](int p) { return value(p) < node.value; }) - order);
+		if (mid == 0 || mid == numPoints)
+		{
+			// Every sampled point agrees on this dimension, so split at the median instead
+			mid = numPoints / 2;
+			nth_element(order, order + mid, order + numPoints, [&](int a, int b) { return value(a) < value(b); });
+			node.value = value(order[mid]);
+		}
+
+		node.child[0] = BuildKDTreeNode(index, tree, begin, begin + mid, rng);
+		node.child[1] = BuildKDTreeNode(index, tree, begin + mid, end, rng);
+	}
+
+	tree.nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+// Build the trees over the descriptors already in the index
+void BuildKDForest(DescriptorIndex& index)
+{
+	// Below this size brute force is exact and just as fast, so don't bother with the trees
+	index.trees.clear();
+	if (index.numPoints <= KDTREE_MIN_POINTS)
+	{
+		return;
+	}
+
+	index.trees.resize(KDTREE_NUM_TREES);
+#pragma omp parallel for
+	for (int t = 0; t < KDTREE_NUM_TREES; ++t)
+	{
+		// Seed each tree separately, so the forest is the same however many threads built it
+		mt19937 rng(KDTREE_SEED + t);
+		KDTree& tree = index.trees[t];
+		tree.order.resize(index.numPoints);
+		for (int i = 0; i < index.numPoints; ++i)
+		{
+			tree.order[i] = i;
+		}
+		BuildKDTreeNode(index, tree, 0, index.numPoints, rng);
+	}
+}
+// Actual functions
+void BuildDescriptorIndex(
+	_In_ const vector<Feature>& features,
+	_Out_ DescriptorIndex& index)
+{
+	index.numPoints = (int)features.size();
+	index.data.resize((size_t)index.numPoints * DESC_LENGTH);
+	for (int i = 0; i < index.numPoints; ++i)
+	{
+		copy(begin(features[i].desc.vec), end(features[i].desc.vec), &index.data[(size_t)i * DESC_LENGTH]);
+	}
+	BuildKDForest(index);
+}
+
+void BuildDescriptorIndex(
+	_In_ const float* descriptors,
+	_In_ int numDescriptors,
+	_Out_ DescriptorIndex& index)
+{
+	index.numPoints = numDescriptors;
+	index.data.assign(descriptors, descriptors + (size_t)numDescriptors * DESC_LENGTH);
+	BuildKDForest(index);
+}
+
+// The forest is searched in floats, so a quantised set is expanded back out into the index
+void BuildDescriptorIndex(
+	_In_ const FeatureSetView& set,
+	_Out_ DescriptorIndex& index)
+{
+	index.numPoints = (int)set.size();
+	index.data.resize((size_t)index.numPoints * DESC_LENGTH);
+	for (int i = 0; i < index.numPoints; ++i)
+	{
+		set.CopyDescriptor(i, &index.data[(size_t)i * DESC_LENGTH]);
+	}
+	BuildKDForest(index);
+}
+
+/*
+	Find the two nearest neighbours of each query descriptor in the index.
+
+	Small indices have no trees, and go through the brute-force kernels, which are exact.
+	Otherwise this is the best-bin-first search: descend every tree to the leaf the query
+	falls in, queueing the branches not taken by how far the query is from their split,
+	then keep opening the closest queued branch until maxChecks descriptors have been compared.
+	The branch distance only adds up the split offsets along the path, so it is an estimate
+	rather than a bound, and the result is approximate.
+
+	Each thread keeps its branch heap and its record of which points it has compared from one
+	query to the next. A point counts as compared if its stamp is the current query's, so
+	nothing has to be cleared between queries, and a query costs only the points it visits.
+*/
+// Support functions
+struct KDBranch
+{
+	float dist;
+	int tree;
+	int node;
+
+	bool operator > (const KDBranch& other) const
+	{
+		return dist > other.dist;
+	}
+};
+
+struct KDSearchScratch
+{
+	vector<KDBranch> branches;
+	vector<unsigned int> checked;
+	unsigned int stamp = 0;
+};
+
+// Start a new query: empty the heap, and move on to a stamp no point has been given yet
+void BeginKDSearch(const DescriptorIndex& index, KDSearchScratch& scratch)
+{
+	scratch.branches.clear();
+	if (scratch.checked.size() != (size_t)index.numPoints || ++scratch.stamp == 0)
+	{
+		scratch.checked.assign(index.numPoints, 0);
+		scratch.stamp = 1;
+	}
+}
+
+void AddNeighbourCandidate(NeighbourPair& result, int point, float dist)
+{
+	if (result.closest == -1 || dist < result.distClosest)
+	{
+		result.secondClosest = result.closest;
+		result.distSecondClosest = result.distClosest;
+		result.closest = point;
+		result.distClosest = dist;
+	}
+	else if (result.secondClosest == -1 || dist < result.distSecondClosest)
+	{
+		result.secondClosest = point;
+		result.distSecondClosest = dist;
+	}
+}
+
+void SearchKDTree(
+	const DescriptorIndex& index,
+	const float* query,
+	int treeIndex,
+	int nodeIndex,
+	float dist,
+	KDSearchScratch& scratch,
+	int& numChecks,
+	NeighbourPair& result)
+{
+	const KDTree& tree = index.trees[treeIndex];
+	const KDTreeNode* node = &tree.nodes[nodeIndex];
+	while (node->dim != -1)
+	{
+		float diff = query[node->dim] - node->value;
+		int nearChild = diff < 0 ? 0 : 1;
+		KDBranch farBranch;
+		farBranch.dist = dist + diff * diff;
+		farBranch.tree = treeIndex;
+		farBranch.node = node->child[1 - nearChild];
+		scratch.branches.push_back(farBranch);
+		push_heap(scratch.branches.begin(), scratch.branches.end(), greater<KDBranch>());
+		node = &tree.nodes[node->child[nearChild]];
+	}
+
+	for (int i = node->begin; i < node->end; ++i)
+	{
+		int point = tree.order[i];
+		// The trees share their points, so don't compare the same one twice
+		if (scratch.checked[point] == scratch.stamp)
+		{
+			continue;
+		}
+		scratch.checked[point] = scratch.stamp;
+		++numChecks;
+		AddNeighbourCandidate(result, point, SquaredDistanceBetweenDescriptors(query, &index.data[(size_t)point * DESC_LENGTH]));
+	}
+}
+
+NeighbourPair SearchKDForest(const DescriptorIndex& index, const float* query, int maxChecks, KDSearchScratch& scratch)
+{
+	NeighbourPair result;
+	BeginKDSearch(index, scratch);
+	int numChecks = 0;
+	for (int t = 0; t < (int)index.trees.size(); ++t)
+	{
+		SearchKDTree(index, query, t, 0, 0, scratch, numChecks, result);
+	}
+
+	while (!scratch.branches.empty() && numChecks < maxChecks)
+	{
+		pop_heap(scratch.branches.begin(), scratch.branches.end(), greater<KDBranch>());
+		KDBranch branch = scratch.branches.back();
+		scratch.branches.pop_back();
+		// Everything still queued is estimated to be further than both neighbours
+		if (result.secondClosest != -1 && branch.dist >= result.distSecondClosest)
+		{
+			break;
+		}
+		SearchKDTree(index, query, branch.tree, branch.node, branch.dist, scratch, numChecks, result);
+	}
+	return result;
+}
+// Actual function
+void FindTwoNearestNeighbours(
+	_In_ const DescriptorIndex& index,
+	_In_ const float* queries,
+	_In_ int numQueries,
+	_Out_ NeighbourPair* results,
+	_In_ int maxChecks)
+{
+	if (index.trees.empty())
+	{
+		FindTwoNearestNeighboursBruteForce(queries, numQueries, index.data.data(), index.numPoints, results);
+		return;
+	}
+
+#pragma omp parallel
+	{
+		KDSearchScratch scratch;
+#pragma omp for schedule(dynamic, 64)
+		for (int i = 0; i < numQueries; ++i)
+		{
+			results[i] = SearchKDForest(index, queries + (size_t)i * DESC_LENGTH, maxChecks, scratch);
+		}
+	}
+}
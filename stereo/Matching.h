@@ -0,0 +1,136 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Features.h"
+
+// Randomised k-d forest parameters
+// More trees and more checks find the true nearest neighbours more often, at the cost of speed
+#define KDTREE_NUM_TREES 4
+#define KDTREE_MAX_CHECKS 128
+#define KDTREE_LEAF_SIZE 8
+// Each split is on one of the dimensions with the highest variance, picked at random
+#define KDTREE_RANDOM_DIMS 5
+// The variance is estimated from this many points rather than all of them
+#define KDTREE_VARIANCE_SAMPLES 128
+#define KDTREE_SEED 0x5EED
+
+// Indices up to this size are searched exhaustively with the brute-force kernels,
+// which is exact and, with SIMD, faster than the forest for small images
+#define KDTREE_MIN_POINTS 1024
+
+// Brute-force matching works on tiles of this many training descriptors,
+// small enough to stay in the L2 cache while every query is compared to them
+#define DESCRIPTOR_TRAIN_TILE 128
+#define DESCRIPTOR_QUERY_TILE 64
+
+// Quantised sets up to this size are matched exhaustively as bytes. Beyond it, the
+// k-d forest's bounded number of checks beats comparing every pair, even as bytes
+#define QUANTISED_BRUTE_FORCE_MAX_POINTS 2048
+
+/*
+	The instruction sets the brute-force distance kernels are written for.
+	The best one the CPU supports is picked at run time, so one build runs everywhere.
+*/
+enum DescriptorKernel
+{
+	DESCRIPTOR_KERNEL_SCALAR,
+	DESCRIPTOR_KERNEL_SSE4,
+	DESCRIPTOR_KERNEL_AVX2,
+	DESCRIPTOR_KERNEL_AVX512
+};
+
+/*
+	The two nearest neighbours of a query descriptor.
+	Distances are squared L2, and the indices are -1 when there are fewer than two points.
+*/
+struct NeighbourPair
+{
+	int closest = -1;
+	int secondClosest = -1;
+	float distClosest = 0;
+	float distSecondClosest = 0;
+};
+
+/*
+	A randomised k-d forest over a set of descriptors, as in Muja and Lowe's FLANN.
+	Each tree splits on a different random choice among the highest variance dimensions,
+	so searching them together with one priority queue covers the misses of any single tree.
+
+	Nodes are stored flat. A leaf has dim == -1, and holds the range [begin, end)
+	of the tree's point order; an inner node holds its split and its two children.
+*/
+struct KDTreeNode
+{
+	int dim;
+	float value;
+	int begin;
+	int end;
+	int child[2];
+};
+
+struct KDTree
+{
+	std::vector<KDTreeNode> nodes;
+	std::vector<int> order;
+};
+
+struct DescriptorIndex
+{
+	int numPoints = 0;
+	// The descriptors, copied contiguously so the search streams through them
+	std::vector<float> data;
+	std::vector<KDTree> trees;
+};
+
+/*
+	Matching functions
+*/
+float SquaredDistanceBetweenDescriptors(_In_ const float* a, _In_ const float* b);
+
+void QuantiseDescriptor(_In_ const float* desc, _Out_ uint8_t* quantised);
+
+void QuantiseDescriptors(
+	_In_ const float* descriptors,
+	_In_ int numDescriptors,
+	_Out_ std::vector<uint8_t>& data);
+
+int SquaredDistanceBetweenQuantisedDescriptors(_In_ const uint8_t* a, _In_ const uint8_t* b);
+
+DescriptorKernel GetDescriptorKernel();
+
+void FindTwoNearestNeighboursBruteForce(
+	_In_ const float* queries,
+	_In_ int numQueries,
+	_In_ const float* train,
+	_In_ int numTrain,
+	_Out_ NeighbourPair* results,
+	_In_ DescriptorKernel kernel = GetDescriptorKernel());
+
+// Distances are squared in quantised units, so divide by QUANTISED_DESCRIPTOR_SCALE^2 to compare to floats
+void FindTwoNearestNeighboursBruteForce(
+	_In_ const uint8_t* queries,
+	_In_ int numQueries,
+	_In_ const uint8_t* train,
+	_In_ int numTrain,
+	_Out_ NeighbourPair* results,
+	_In_ DescriptorKernel kernel = GetDescriptorKernel());
+
+void BuildDescriptorIndex(
+	_In_ const std::vector<Feature>& features,
+	_Out_ DescriptorIndex& index);
+
+void BuildDescriptorIndex(
+	_In_ const float* descriptors,
+	_In_ int numDescriptors,
+	_Out_ DescriptorIndex& index);
+
+void BuildDescriptorIndex(
+	_In_ const FeatureSetView& set,
+	_Out_ DescriptorIndex& index);
+
+void FindTwoNearestNeighbours(
+	_In_ const DescriptorIndex& index,
+	_In_ const float* queries,
+	_In_ int numQueries,
+	_Out_ NeighbourPair* results,
+	_In_ int maxChecks = KDTREE_MAX_CHECKS);
@@ -1,5 +1,6 @@
 #include "Math.h"
 #include <cmath>
+#include <algorithm>
 
 using namespace Eigen;
 
@@ -63,4 +64,75 @@ Eigen::Matrix3f SO3_exp(_In_ const Eigen::Vector3f& r)
 	exp += sin_term * r_skew;
 	exp += cos_term * r_skew * r_skew;
 	return exp;
-}
\ No newline at end of file
+}
+
+/*
+	Real roots of a x^3 + b x^2 + c x + d = 0
+	Falls back to the quadratic (or linear) case when the leading coefficients vanish.
+	Returns the number of roots written, at most three, in no particular order.
+*/
+int SolveCubic(_In_ double a, _In_ double b, _In_ double c, _In_ double d, _Out_ double roots[3])
+{
+	const double epsilon = 1e-12;
+	double scale = std::max(std::max(fabs(a), fabs(b)), std::max(fabs(c), fabs(d)));
+	if (scale == 0)
+	{
+		return 0;
+	}
+
+	if (fabs(a) < epsilon * scale)
+	{
+		if (fabs(b) < epsilon * scale)
+		{
+			if (fabs(c) < epsilon * scale)
+			{
+				return 0;
+			}
+			roots[0] = -d / c;
+			return 1;
+		}
+		double discriminant = c * c - 4 * b * d;
+		if (discriminant < 0)
+		{
+			return 0;
+		}
+		double s = sqrt(discriminant);
+		roots[0] = (-c + s) / (2 * b);
+		roots[1] = (-c - s) / (2 * b);
+		return 2;
+	}
+
+	// Depress to t^3 + p t + q = 0 with x = t - b / 3a
+	double B = b / a;
+	double C = c / a;
+	double D = d / a;
+	double shift = B / 3;
+	double p = C - B * B / 3;
+	double q = 2 * B * B * B / 27 - B * C / 3 + D;
+	double discriminant = q * q / 4 + p * p * p / 27;
+
+	if (discriminant > 0)
+	{
+		// One real root
+		double s = sqrt(discriminant);
+		roots[0] = cbrt(-q / 2 + s) + cbrt(-q / 2 - s) - shift;
+		return 1;
+	}
+	if (p == 0)
+	{
+		roots[0] = -shift;
+		return 1;
+	}
+
+	// Three real roots (some may be repeated), trigonometric form
+	double m = 2 * sqrt(-p / 3);
+	double argument = 3 * q / (p * m);
+	argument = std::min(1.0, std::max(-1.0, argument));
+	double theta = acos(argument) / 3;
+	const double twoPiOverThree = 2 * acos(-1.0) / 3;
+	for (int k = 0; k < 3; ++k)
+	{
+		roots[k] = m * cos(theta - twoPiOverThree * k) - shift;
+	}
+	return 3;
+}
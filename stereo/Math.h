@@ -8,4 +8,5 @@
 
 Eigen::Matrix3f SkewSymmetric(_In_ const Eigen::Vector3f& v);
 Eigen::Vector3f SO3_log(_In_ const Eigen::Matrix3f& R);
-Eigen::Matrix3f SO3_exp(_In_ const Eigen::Vector3f& r);
\ No newline at end of file
+Eigen::Matrix3f SO3_exp(_In_ const Eigen::Vector3f& r);
+int SolveCubic(_In_ double a, _In_ double b, _In_ double c, _In_ double d, _Out_ double roots[3]);
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include "MultiView.h"
+#include "Matching.h"
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+using namespace Eigen;
+
+/*
+	Score every pair of images by how likely they are to overlap.
+
+	Fully matching every pair costs images^2 full matches. Instead, an evenly spread sample
+	of each image's features is looked up in every other image's index, with a cheap,
+	shallow search, and the fraction that pass the ratio test is the score. Images that
+	share nothing score close to zero; ones that overlap score a good part of their overlap.
+	The score of a pair is the mean of the two directions, so scores is a symmetric
+	numImages x numImages matrix, row-major, with zeros on the diagonal.
+
+	Every image's index is built up front and kept for all its pairs.
+*/
+// Support function
+// The fraction of a sample of set's features that match into index
+float SampledMatchFraction(
+	const FeatureSetView& set,
+	const DescriptorIndex& index,
+	vector<float>& queries,
+	vector<NeighbourPair>& neighbours)
+{
+	int numSamples = min((int)set.size(), PAIR_GRAPH_SAMPLE_FEATURES);
+	if (numSamples == 0 || index.numPoints < 2)
+	{
+		return 0;
+	}
+
+	// Spread the sample over the whole set, rather than just its first features
+	queries.resize((size_t)numSamples * DESC_LENGTH);
+	for (int i = 0; i < numSamples; ++i)
+	{
+		size_t feature = (size_t)i * set.size() / numSamples;
+		set.CopyDescriptor(feature, &queries[(size_t)i * DESC_LENGTH]);
+	}
+	neighbours.resize(numSamples);
+	FindTwoNearestNeighbours(index, queries.data(), numSamples, neighbours.data(), PAIR_GRAPH_SAMPLE_CHECKS);
+
+	// Lowe ratio test, on squared distances
+	int numMatched = 0;
+	for (auto& n : neighbours)
+	{
+		if (n.distClosest < NN_RATIO * NN_RATIO * n.distSecondClosest)
+		{
+			++numMatched;
+		}
+	}
+	return (float)numMatched / numSamples;
+}
+// Actual function
+void ScoreImagePairs(
+	_In_ const vector<FeatureSetView>& sets,
+	_Out_ vector<float>& scores)
+{
+	int numImages = (int)sets.size();
+	scores.assign((size_t)numImages * numImages, 0.f);
+
+	vector<DescriptorIndex> indices(numImages);
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < numImages; ++i)
+	{
+		BuildDescriptorIndex(sets[i], indices[i]);
+	}
+
+	vector<pair<int, int>> pairs;
+	for (int i = 0; i < numImages; ++i)
+	{
+		for (int j = i + 1; j < numImages; ++j)
+		{
+			pairs.push_back(make_pair(i, j));
+		}
+	}
+
+#pragma omp parallel
+	{
+		vector<float> queries;
+		vector<NeighbourPair> neighbours;
+#pragma omp for schedule(dynamic)
+		for (int p = 0; p < (int)pairs.size(); ++p)
+		{
+			int i = pairs[p].first;
+			int j = pairs[p].second;
+			float score = 0.5f * (SampledMatchFraction(sets[i], indices[j], queries, neighbours) +
+				SampledMatchFraction(sets[j], indices[i], queries, neighbours));
+			scores[(size_t)i * numImages + j] = score;
+			scores[(size_t)j * numImages + i] = score;
+		}
+	}
+}
+
+/*
+	Score pairs by how similar their bags of words are, in a vocabulary learnt from all the images.
+	The sampled scores above look every image up in every other's index, which grows with the
+	square of the number of images. Here each image is turned into a bag of words once, and
+	then only meets the images it shares words with, through the inverted file.
+	Each image keeps the scores of its best few neighbours; the rest of scores is zero.
+	Falls back to the sampled scores if there aren't enough descriptors for a vocabulary.
+*/
+void ScoreImagePairsWithVocabulary(
+	_In_ const vector<FeatureSetView>& sets,
+	_In_ int neighbours,
+	_Out_ vector<float>& scores)
+{
+	VocabularyTree tree;
+	if (!BuildVocabularyTree(sets, VOCABULARY_BRANCHING, VOCABULARY_DEPTH, tree))
+	{
+		ScoreImagePairs(sets, scores);
+		return;
+	}
+	InvertedFile file;
+	BuildInvertedFile(tree, sets, file);
+
+	int numImages = (int)sets.size();
+	scores.assign((size_t)numImages * numImages, 0.f);
+	vector<pair<int, float>> results;
+	for (int i = 0; i < numImages; ++i)
+	{
+		QueryInvertedFile(file, file.images[i], neighbours, i, results);
+		// Cosine similarity is symmetric, so whichever of the pair found the other can fill in both
+		for (auto& result : results)
+		{
+			scores[(size_t)i * numImages + result.first] = result.second;
+			scores[(size_t)result.first * numImages + i] = result.second;
+		}
+	}
+}
+
+/*
+	Choose the pairs to match: each image's best scoring neighbours, as long as they
+	score at least minScore. A pair is picked if either of its images picks it,
+	so every image keeps a chance of being connected even if its neighbours have better options.
+*/
+void SelectImagePairs(
+	_In_ const vector<float>& scores,
+	_In_ int numImages,
+	_In_ int neighbours,
+	_In_ float minScore,
+	_Out_ PairGraph& graph)
+{
+	graph.numImages = numImages;
+	graph.pairs.clear();
+	graph.edges.assign(numImages, vector<int>());
+
+	vector<unsigned char> picked((size_t)numImages * numImages, 0);
+	vector<int> order;
+	for (int i = 0; i < numImages; ++i)
+	{
+		const float* row = &scores[(size_t)i * numImages];
+		order.clear();
+		for (int j = 0; j < numImages; ++j)
+		{
+			if (j != i && row[j] >= minScore)
+			{
+				order.push_back(j);
+			}
+		}
+		int numPicked = min(neighbours, (int)order.size());
+		// Equal scores go to the lower index, so the graph doesn't depend on the sort
+		partial_sort(order.begin(), order.begin() + numPicked, order.end(), [row](int a, int b)
+		{
+			return row[a] > row[b] || (row[a] == row[b] && a < b);
+		});
+		for (int k = 0; k < numPicked; ++k)
+		{
+			int j = order[k];
+			picked[(size_t)min(i, j) * numImages + max(i, j)] = 1;
+		}
+	}
+
+	for (int i = 0; i < numImages; ++i)
+	{
+		for (int j = i + 1; j < numImages; ++j)
+		{
+			if (picked[(size_t)i * numImages + j])
+			{
+				ImagePair pair;
+				pair.image1 = i;
+				pair.image2 = j;
+				pair.score = scores[(size_t)i * numImages + j];
+				graph.pairs.push_back(pair);
+			}
+		}
+	}
+}
+
+/*
+	Match each chosen pair in full, and find its fundamental and essential matrices.
+	Pairs are independent, so they're shared out between threads, a pair at a time as
+	threads come free, since pairs with more features take longer.
+	Pairs that don't match well enough, or have no F, are marked invalid and left out of the edges.
+*/
+// Support function
+// A copy of an image's descriptor, without the features, which the pair doesn't need
+ImageDescriptor DescribeImageWithoutFeatures(const ImageDescriptor& image)
+{
+	ImageDescriptor copy;
+	copy.width = image.width;
+	copy.height = image.height;
+	copy.filename = image.filename;
+	copy.K = image.K;
+	copy.E = image.E;
+	return copy;
+}
+// Actual function
+void EstimateImagePairs(
+	_In_ const vector<ImageDescriptor>& images,
+	_In_ const vector<FeatureSetView>& sets,
+	_Inout_ PairGraph& graph)
+{
+#pragma omp parallel for schedule(dynamic)
+	for (int p = 0; p < (int)graph.pairs.size(); ++p)
+	{
+		ImagePair& pair = graph.pairs[p];
+		const FeatureSetView& set1 = sets[pair.image1];
+		const FeatureSetView& set2 = sets[pair.image2];
+		pair.valid = false;
+
+		MatchFeatureSets(set1, set2, MAX_DIST_BETWEEN_MATCHES, pair.matches, pair.distances);
+		if (pair.matches.size() < PAIR_GRAPH_MIN_MATCHES)
+		{
+			continue;
+		}
+
+		pair.stereo.img1 = DescribeImageWithoutFeatures(images[pair.image1]);
+		pair.stereo.img2 = DescribeImageWithoutFeatures(images[pair.image2]);
+		if (!FindFundamentalMatrixWithRANSAC(set1, set2, pair.matches, pair.distances, pair.stereo.F, pair.stereo))
+		{
+			continue;
+		}
+		// E = KT * F * K
+		pair.stereo.E = pair.stereo.img2.K.transpose() * pair.stereo.F * pair.stereo.img1.K;
+		pair.valid = true;
+	}
+
+	graph.edges.assign(graph.numImages, vector<int>());
+	for (int p = 0; p < (int)graph.pairs.size(); ++p)
+	{
+		const ImagePair& pair = graph.pairs[p];
+		if (pair.valid)
+		{
+			graph.edges[pair.image1].push_back(p);
+			graph.edges[pair.image2].push_back(p);
+		}
+	}
+}
+
+/*
+	Build the pair graph over a set of images: score every pair cheaply, pick each image's
+	best few neighbours, and match and estimate only those.
+	Larger sets of images are scored with a vocabulary tree.
+*/
+void BuildPairGraph(
+	_In_ const vector<ImageDescriptor>& images,
+	_In_ const vector<FeatureSetView>& sets,
+	_In_ int neighbours,
+	_Out_ PairGraph& graph)
+{
+	int numImages = (int)sets.size();
+	vector<float> scores;
+	if (numImages >= PAIR_GRAPH_VOCABULARY_IMAGES)
+	{
+		ScoreImagePairsWithVocabulary(sets, neighbours, scores);
+		SelectImagePairs(scores, numImages, neighbours, PAIR_GRAPH_MIN_VOCABULARY_SCORE, graph);
+	}
+	else
+	{
+		ScoreImagePairs(sets, scores);
+		SelectImagePairs(scores, numImages, neighbours, PAIR_GRAPH_MIN_SCORE, graph);
+	}
+
+	cout << "Matching " << graph.pairs.size() << " of " << numImages * (numImages - 1) / 2 << " image pairs" << endl;
+	EstimateImagePairs(images, sets, graph);
+}
+
+/*
+	The valid pair with the most matches, or -1 if there isn't one
+*/
+int FindStrongestImagePair(_In_ const PairGraph& graph)
+{
+	int best = -1;
+	for (int p = 0; p < (int)graph.pairs.size(); ++p)
+	{
+		const ImagePair& pair = graph.pairs[p];
+		if (pair.valid && (best < 0 || pair.matches.size() > graph.pairs[best].matches.size()))
+		{
+			best = p;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <vector>
+#include <Eigen/Dense>
+#include "Features.h"
+#include "Stereography.h"
+#include "Vocabulary.h"
+
+// Each image is matched against at most this many of the other images, the ones that look
+// most likely to overlap it
+#define PAIR_GRAPH_NEIGHBOURS 5
+// A pair is scored by matching this many features from each image against the other,
+// and checking this few leaves of the k-d forest for each, which is far cheaper than matching it
+#define PAIR_GRAPH_SAMPLE_FEATURES 128
+#define PAIR_GRAPH_SAMPLE_CHECKS 32
+// Pairs where fewer than this fraction of the sampled features match aren't worth trying
+#define PAIR_GRAPH_MIN_SCORE 0.02f
+// With this many images or more, pairs are scored by their similarity in a vocabulary tree instead.
+// Each image then only visits the images it shares words with, rather than every other image
+#define PAIR_GRAPH_VOCABULARY_IMAGES 32
+// The cosine similarity of their bags of words that two images need to be worth trying
+#define PAIR_GRAPH_MIN_VOCABULARY_SCORE 0.02f
+// And pairs with fewer matches than this once fully matched are left out of the graph
+#define PAIR_GRAPH_MIN_MATCHES 20
+
+/*
+	An edge of the pair graph: two images, image1 < image2, and what relates them.
+	score is how much they looked like they overlap before they were matched: the fraction
+	of sampled features that found a match, or for larger sets, the similarity of their words.
+	The matches index into the two images' features.
+	stereo holds F and E, and copies of the images' descriptors without their feature lists.
+*/
+struct ImagePair
+{
+	int image1 = 0;
+	int image2 = 0;
+	float score = 0;
+	std::vector<FeatureMatch> matches;
+	std::vector<float> distances;
+	StereoPair stereo;
+	bool valid = false;
+};
+
+/*
+	The pairs of images that were matched, in order of their images.
+	edges lists, for each image, the indices into pairs of the valid pairs it's in.
+*/
+struct PairGraph
+{
+	int numImages = 0;
+	std::vector<ImagePair> pairs;
+	std::vector<std::vector<int>> edges;
+};
+
+/*
+	Multi-view functions
+*/
+void ScoreImagePairs(
+	_In_ const std::vector<FeatureSetView>& sets,
+	_Out_ std::vector<float>& scores);
+
+void ScoreImagePairsWithVocabulary(
+	_In_ const std::vector<FeatureSetView>& sets,
+	_In_ int neighbours,
+	_Out_ std::vector<float>& scores);
+
+void SelectImagePairs(
+	_In_ const std::vector<float>& scores,
+	_In_ int numImages,
+	_In_ int neighbours,
+	_In_ float minScore,
+	_Out_ PairGraph& graph);
+
+void EstimateImagePairs(
+	_In_ const std::vector<ImageDescriptor>& images,
+	_In_ const std::vector<FeatureSetView>& sets,
+	_Inout_ PairGraph& graph);
+
+void BuildPairGraph(
+	_In_ const std::vector<ImageDescriptor>& images,
+	_In_ const std::vector<FeatureSetView>& sets,
+	_In_ int neighbours,
+	_Out_ PairGraph& graph);
+
+int FindStrongestImagePair(_In_ const PairGraph& graph);
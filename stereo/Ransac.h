@@ -0,0 +1,448 @@
+#pragma once
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Stop once we are this sure that at least one sample drawn was all inliers
+#define RANSAC_CONFIDENCE 0.995
+// PROSAC draws from a growing prefix of the best data, reaching all of it after about
+// this many samples. This is the value from the paper
+#define PROSAC_GROWTH_SAMPLES 200000
+// The chance that an outlier happens to agree with a wrong model, and the chi-squared
+// bound (at 5%), for PROSAC's check that a model's support isn't just chance
+#define PROSAC_BETA 0.05
+#define PROSAC_CHI_SQUARED 2.706
+// In parallel, hypotheses are generated and scored this many at a time, and the
+// termination test is only checked between batches
+#define RANSAC_BATCH_SIZE 32
+#define RANSAC_DEFAULT_SEED 0x5EED
+
+/*
+	RANSAC, with adaptive termination
+
+	Pick a random minimal sample of the data, fit a model (or a few) to it, and score each
+	model against all the data. Keep the best. Repeat.
+
+	How many times? If a fraction w of the data are inliers, a sample of s points is
+	all inliers with probability w^s, so after k samples the chance that we have never
+	drawn a clean one is (1 - w^s)^k. We don't know w, but the best model so far gives a
+	lower bound on it, so each time the best improves we work out the k that makes that
+	chance 1 - RANSAC_CONFIDENCE and stop there. A pair with mostly good matches is done
+	in tens of iterations; a bad pair still runs to maxIterations.
+
+	The estimator supplies:
+	- a solver:  int solve(const int* sample, Model* models)
+	             fits models to the data at the sample indices, and returns how many it made
+	- a scorer:  bool score(const Model& model, RansacScore& score, unsigned char* inliers)
+	             counts inliers over all the data, and flags each one. Returns false if the
+	             model is unusable
+	Models with more inliers win, and ties go to the lower cost.
+
+	Samples come from a sampler, which also decides when to stop. UniformSampler is plain
+	RANSAC. If the data can be ranked by how likely each is to be an inlier - matches by
+	descriptor distance, say - ProsacSampler draws from the best few first, and widens
+	out to all the data as it goes (Chum and Matas, "Matching with PROSAC", CVPR 2005).
+	It can then stop as soon as some top n of the data is explained well enough, which
+	with good matches ranked first is long before plain RANSAC would.
+
+	Randomness comes from a counter-based generator rather than rand(): the sample for
+	iteration k depends only on the seed and k. So in parallel, hypotheses are made in
+	batches of RANSAC_BATCH_SIZE, split across threads however OpenMP likes, and each
+	thread just keeps its own best. Between batches those are reduced in a fixed order -
+	score, then iteration, then model - so for a given seed the answer is the same
+	however many threads there are. The solver and scorer must be safe to call from
+	several threads at once.
+*/
+struct RansacScore
+{
+	int inliers = 0;
+	float cost = 0;
+};
+
+struct RansacParams
+{
+	int maxIterations = 1000;
+	// A model needs at least this many inliers to be accepted at all
+	int minInliers = 0;
+	double confidence = RANSAC_CONFIDENCE;
+	uint64_t seed = RANSAC_DEFAULT_SEED;
+	bool parallel = true;
+};
+
+template<int SampleSize>
+struct RansacResult
+{
+	int iterations = 0;
+	RansacScore score;
+	// The sample that gave the best model
+	int sample[SampleSize];
+};
+
+// Support functions
+inline bool IsBetterRansacScore(const RansacScore& a, const RansacScore& b)
+{
+	return a.inliers > b.inliers || (a.inliers == b.inliers && a.cost < b.cost);
+}
+inline int RansacIterationsNeeded(int inliers, int numData, int sampleSize, double confidence, int maxIterations)
+{
+	double cleanSample = pow((double)inliers / numData, sampleSize);
+	if (cleanSample <= 0)
+	{
+		return maxIterations;
+	}
+	if (cleanSample >= 1)
+	{
+		return 1;
+	}
+	double needed = log(1 - confidence) / log(1 - cleanSample);
+	return needed >= maxIterations ? maxIterations : (int)ceil(needed);
+}
+// SplitMix64's mixing function
+inline uint64_t MixBits(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+// A stream of random numbers for one iteration, keyed on the seed and the iteration
+class RansacRng
+{
+public:
+	RansacRng(uint64_t seed, uint64_t iteration) : key(MixBits(seed ^ MixBits(iteration))), counter(0) {}
+
+	// Uniform in [0, max)
+	int Next(int max)
+	{
+		uint64_t bits = MixBits(key + ++counter);
+		return (int)(((bits >> 32) * (uint64_t)max) >> 32);
+	}
+
+private:
+	uint64_t key;
+	uint64_t counter;
+};
+inline void DrawRandomSample(RansacRng& rng, int numData, int sampleSize, int* sample)
+{
+	// Rejection sampling is fine here; samples are small compared to the data
+	for (int i = 0; i < sampleSize; ++i)
+	{
+		bool repeated;
+		do
+		{
+			sample[i] = rng.Next(numData);
+			repeated = false;
+			for (int j = 0; j < i; ++j)
+			{
+				repeated |= sample[j] == sample[i];
+			}
+		} while (repeated);
+	}
+}
+
+/*
+	Samplers work in two steps, so that samples can be drawn in parallel.
+	Plan is called once per iteration, in order, and returns whatever the sampler needs
+	to remember about that iteration. Draw then turns that and the iteration's random
+	numbers into a sample, and is safe to call from any thread.
+*/
+class UniformSampler
+{
+public:
+	struct Plan
+	{
+	};
+
+	UniformSampler(int numData, int sampleSize) : numData(numData), sampleSize(sampleSize) {}
+
+	Plan Next()
+	{
+		return Plan();
+	}
+
+	void Draw(const Plan&, RansacRng& rng, int* sample) const
+	{
+		DrawRandomSample(rng, numData, sampleSize, sample);
+	}
+
+	int IterationsNeeded(const unsigned char*, int numInliers, double confidence, int maxIterations) const
+	{
+		return RansacIterationsNeeded(numInliers, numData, sampleSize, confidence, maxIterations);
+	}
+
+private:
+	int numData;
+	int sampleSize;
+};
+
+class ProsacSampler
+{
+public:
+	struct Plan
+	{
+		// Draw from the top poolSize, always including the last of them if includeNewest
+		int poolSize;
+		bool includeNewest;
+	};
+
+	// order is the indices of the data, best first
+	ProsacSampler(const std::vector<int>& order, int sampleSize) :
+		order(order),
+		sampleSize(sampleSize),
+		n(sampleSize),
+		t(0),
+		TnPrime(1)
+	{
+		// T_n is how many of the PROSAC_GROWTH_SAMPLES samples from all the data
+		// would be expected to come from only the top n
+		int N = (int)order.size();
+		Tn = PROSAC_GROWTH_SAMPLES;
+		for (int i = 0; i < sampleSize; ++i)
+		{
+			Tn *= (double)(n - i) / (N - i);
+		}
+	}
+
+	Plan Next()
+	{
+		int N = (int)order.size();
+		t++;
+
+		// Grow the pool once we've drawn our share of samples from it
+		if (t > TnPrime && n < N)
+		{
+			double TnNext = Tn * (n + 1) / (n + 1 - sampleSize);
+			TnPrime += (int)ceil(TnNext - Tn);
+			Tn = TnNext;
+			n++;
+		}
+
+		Plan plan;
+		plan.poolSize = n;
+		plan.includeNewest = TnPrime >= t;
+		return plan;
+	}
+
+	void Draw(const Plan& plan, RansacRng& rng, int* sample) const
+	{
+		if (plan.includeNewest)
+		{
+			// The newest member of the pool, and the rest from those before it
+			DrawRandomSample(rng, plan.poolSize - 1, sampleSize - 1, sample);
+			sample[sampleSize - 1] = plan.poolSize - 1;
+		}
+		else
+		{
+			// Plain RANSAC over the pool
+			DrawRandomSample(rng, plan.poolSize, sampleSize, sample);
+		}
+
+		for (int i = 0; i < sampleSize; ++i)
+		{
+			sample[i] = order[sample[i]];
+		}
+	}
+
+	int IterationsNeeded(const unsigned char* inliers, int numInliers, double confidence, int maxIterations) const
+	{
+		// Every sample so far came from the top n, for any n at least the pool size, so we can
+		// stop once any such prefix has enough inliers that we'd have drawn a clean sample from it.
+		// The prefix has to pass the non-randomness test first - more inliers than a wrong model
+		// would get by chance - and the full set always counts, as in plain RANSAC
+		int N = (int)order.size();
+		int best = RansacIterationsNeeded(numInliers, N, sampleSize, confidence, maxIterations);
+		int prefixInliers = 0;
+		for (int i = 0; i < N - 1; ++i)
+		{
+			prefixInliers += inliers[order[i]] ? 1 : 0;
+			int prefix = i + 1;
+			if (prefix < n)
+			{
+				continue;
+			}
+			double chance = PROSAC_BETA * (prefix - sampleSize);
+			double minInliers = sampleSize + chance + sqrt(PROSAC_CHI_SQUARED * chance * (1 - PROSAC_BETA));
+			if (prefixInliers < minInliers)
+			{
+				continue;
+			}
+			best = std::min(best, RansacIterationsNeeded(prefixInliers, prefix, sampleSize, confidence, maxIterations));
+		}
+		return best;
+	}
+
+private:
+	const std::vector<int>& order;
+	int sampleSize;
+	int n;
+	int t;
+	int TnPrime;
+	double Tn;
+};
+
+// The best model one thread has seen
+template<typename Model, int SampleSize>
+struct RansacCandidate
+{
+	bool found = false;
+	int iteration = 0;
+	int modelIndex = 0;
+	RansacScore score;
+	Model model;
+	int sample[SampleSize];
+	std::vector<unsigned char> inliers;
+	std::vector<unsigned char> scratch;
+};
+template<typename Model, int SampleSize>
+inline bool IsBetterRansacCandidate(const RansacCandidate<Model, SampleSize>& a, const RansacCandidate<Model, SampleSize>& b)
+{
+	if (!a.found || !b.found)
+	{
+		return a.found;
+	}
+	if (IsBetterRansacScore(a.score, b.score))
+	{
+		return true;
+	}
+	if (IsBetterRansacScore(b.score, a.score))
+	{
+		return false;
+	}
+	// Equal scores go to whichever came first, so the thread count doesn't matter
+	return a.iteration < b.iteration || (a.iteration == b.iteration && a.modelIndex < b.modelIndex);
+}
+// Actual functions
+template<typename Model, int SampleSize, int MaxModelsPerSample, typename Solver, typename Scorer, typename Sampler>
+bool RunRANSAC(
+	_In_ int numData,
+	_In_ const RansacParams& params,
+	_In_ Solver solve,
+	_In_ Scorer score,
+	_Inout_ Sampler& sampler,
+	_Out_ Model& bestModel,
+	_Out_ RansacResult<SampleSize>& result)
+{
+	typedef RansacCandidate<Model, SampleSize> Candidate;
+	typedef typename Sampler::Plan Plan;
+
+	result = RansacResult<SampleSize>();
+	if (numData < SampleSize)
+	{
+		return false;
+	}
+
+#ifdef _OPENMP
+	int numThreads = params.parallel ? omp_get_max_threads() : 1;
+#else
+	int numThreads = 1;
+#endif
+	int batchSize = params.parallel ? RANSAC_BATCH_SIZE : 1;
+	std::vector<Candidate> candidates(numThreads);
+	for (auto& c : candidates)
+	{
+		c.inliers.resize(numData);
+		c.scratch.resize(numData);
+	}
+	Candidate best;
+	std::vector<Plan> plans(batchSize);
+
+	int iterationsNeeded = params.maxIterations;
+	int k = 0;
+	while (k < iterationsNeeded)
+	{
+		int batchEnd = std::min(k + batchSize, iterationsNeeded);
+		for (int i = k; i < batchEnd; ++i)
+		{
+			plans[i - k] = sampler.Next();
+		}
+
+#pragma omp parallel for schedule(dynamic) num_threads(numThreads) if(numThreads > 1)
+		for (int i = k; i < batchEnd; ++i)
+		{
+#ifdef _OPENMP
+			Candidate& local = candidates[omp_get_thread_num()];
+#else
+			Candidate& local = candidates[0];
+#endif
+			int sample[SampleSize];
+			Model models[MaxModelsPerSample];
+			RansacRng rng(params.seed, (uint64_t)i);
+			sampler.Draw(plans[i - k], rng, sample);
+			int numModels = solve(sample, models);
+
+			for (int m = 0; m < numModels; ++m)
+			{
+				Candidate attempt;
+				attempt.found = true;
+				attempt.iteration = i;
+				attempt.modelIndex = m;
+				if (!score(models[m], attempt.score, local.scratch.data()) || attempt.score.inliers < params.minInliers)
+				{
+					continue;
+				}
+				if (!IsBetterRansacCandidate(attempt, local))
+				{
+					continue;
+				}
+
+				local.found = true;
+				local.iteration = i;
+				local.modelIndex = m;
+				local.score = attempt.score;
+				local.model = models[m];
+				std::copy(sample, sample + SampleSize, local.sample);
+				local.inliers.swap(local.scratch);
+			}
+		}
+		k = batchEnd;
+
+		// Reduce what each thread found
+		bool improved = false;
+		for (auto& c : candidates)
+		{
+			if (IsBetterRansacCandidate(c, best))
+			{
+				best.found = true;
+				best.iteration = c.iteration;
+				best.modelIndex = c.modelIndex;
+				best.score = c.score;
+				best.model = c.model;
+				std::copy(c.sample, c.sample + SampleSize, best.sample);
+				best.inliers = c.inliers;
+				improved = true;
+			}
+		}
+		if (improved)
+		{
+			iterationsNeeded = std::min(iterationsNeeded,
+				sampler.IterationsNeeded(best.inliers.data(), best.score.inliers, params.confidence, params.maxIterations));
+		}
+	}
+	result.iterations = k;
+
+	if (!best.found)
+	{
+		return false;
+	}
+	bestModel = best.model;
+	result.score = best.score;
+	std::copy(best.sample, best.sample + SampleSize, result.sample);
+	return true;
+}
+template<typename Model, int SampleSize, int MaxModelsPerSample, typename Solver, typename Scorer>
+bool RunRANSAC(
+	_In_ int numData,
+	_In_ const RansacParams& params,
+	_In_ Solver solve,
+	_In_ Scorer score,
+	_Out_ Model& bestModel,
+	_Out_ RansacResult<SampleSize>& result)
+{
+	UniformSampler sampler(numData, SampleSize);
+	return RunRANSAC<Model, SampleSize, MaxModelsPerSample>(numData, params, solve, score, sampler, bestModel, result);
+}
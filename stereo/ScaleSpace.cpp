@@ -0,0 +1,137 @@
+#include "ScaleSpace.h"
+#include <iostream>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+/*
+	Image pool
+	Hand out a free buffer of the right size and type if there is one, or a new one if not.
+	Only release images nothing else still refers to, or the next user will overwrite them.
+*/
+Mat AcquireImage(_Inout_ ImagePool& pool, _In_ int rows, _In_ int cols, _In_ int type)
+{
+	for (size_t i = 0; i < pool.buffers.size(); ++i)
+	{
+		Mat& buffer = pool.buffers[i];
+		if (buffer.rows == rows && buffer.cols == cols && buffer.type() == type)
+		{
+			Mat image = buffer;
+			pool.buffers.erase(pool.buffers.begin() + i);
+			return image;
+		}
+	}
+	return Mat(rows, cols, type);
+}
+
+void ReleaseImage(_Inout_ ImagePool& pool, _Inout_ Mat& image)
+{
+	if (!image.empty())
+	{
+		pool.buffers.push_back(image);
+	}
+	image = Mat();
+}
+
+/*
+	Build a Gaussian scale space pyramid.
+
+	The first level is the input blurred up to SCALE_BASE_SIGMA. Every other level in the
+	octave is blurred from the one before it, only by as much as it needs on top of that
+	blur, so the kernels stay small. One extra level per octave reaches twice the base
+	blur; taking every second pixel of it starts the next octave at the base blur again,
+	at a quarter of the pixels. The whole pyramid costs about 4/3 of its first octave.
+
+	The images keep the input's type. Buffers come from the pool, and go back to it with
+	ReleaseScaleSpacePyramid.
+*/
+// Support function
+void BlurFrom(const Mat& src, float sigmaFrom, float sigmaTo, Mat& dst)
+{
+	float sigma = sqrt(max(sigmaTo * sigmaTo - sigmaFrom * sigmaFrom, 0.f));
+	if (sigma < 0.01f)
+	{
+		src.copyTo(dst);
+		return;
+	}
+	GaussianBlur(src, dst, Size(0, 0), sigma, sigma, BORDER_REFLECT_101);
+}
+// Actual function
+bool BuildScaleSpacePyramid(
+	_In_ const Mat& img,
+	_In_ int numOctaves,
+	_In_ int levelsPerOctave,
+	_Inout_ ImagePool& pool,
+	_Out_ ScaleSpacePyramid& pyramid)
+{
+	pyramid.levelsPerOctave = levelsPerOctave;
+	pyramid.levels.clear();
+	if (img.empty() || img.channels() != 1 || numOctaves < 1 || levelsPerOctave < 1)
+	{
+		cout << "Cannot build a scale space for this image" << endl;
+		return false;
+	}
+
+	const float levelRatio = pow(2.f, 1.f / levelsPerOctave);
+	Mat base = AcquireImage(pool, img.rows, img.cols, img.type());
+	BlurFrom(img, SCALE_INPUT_SIGMA, SCALE_BASE_SIGMA, base);
+
+	for (int octave = 0; octave < numOctaves; ++octave)
+	{
+		bool lastOctave = octave + 1 == numOctaves || min(base.rows, base.cols) / 2 < SCALE_MIN_SIZE;
+
+		ScaleSpaceLevel first;
+		first.image = base;
+		first.octave = octave;
+		first.level = 0;
+		first.sigma = SCALE_BASE_SIGMA * OctaveScaleFactor(octave);
+		pyramid.levels.push_back(first);
+
+		// Blur each level from the one before, plus one more to seed the next octave
+		float sigmaPrevious = SCALE_BASE_SIGMA;
+		Mat previous = base;
+		Mat seed;
+		int numLevels = lastOctave ? levelsPerOctave : levelsPerOctave + 1;
+		for (int level = 1; level < numLevels; ++level)
+		{
+			float sigma = sigmaPrevious * levelRatio;
+			Mat blurred = AcquireImage(pool, base.rows, base.cols, base.type());
+			BlurFrom(previous, sigmaPrevious, sigma, blurred);
+			if (level == levelsPerOctave)
+			{
+				seed = blurred;
+				break;
+			}
+
+			ScaleSpaceLevel next;
+			next.image = blurred;
+			next.octave = octave;
+			next.level = level;
+			next.sigma = sigma * OctaveScaleFactor(octave);
+			pyramid.levels.push_back(next);
+			previous = blurred;
+			sigmaPrevious = sigma;
+		}
+
+		if (lastOctave)
+		{
+			break;
+		}
+
+		// Every second pixel of the seed, which has twice the base blur at this resolution
+		base = AcquireImage(pool, seed.rows / 2, seed.cols / 2, seed.type());
+		resize(seed, base, base.size(), 0, 0, INTER_NEAREST);
+		ReleaseImage(pool, seed);
+	}
+	return true;
+}
+
+void ReleaseScaleSpacePyramid(_Inout_ ScaleSpacePyramid& pyramid, _Inout_ ImagePool& pool)
+{
+	for (auto& level : pyramid.levels)
+	{
+		ReleaseImage(pool, level.image);
+	}
+	pyramid.levels.clear();
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// Scale space parameters
+#define SCALE_PYRAMID_OCTAVES 4
+#define SCALE_LEVELS_PER_OCTAVE 2
+// The blur of the first level of every octave, in that octave's pixels
+#define SCALE_BASE_SIGMA 1.f
+// The blur we assume the camera already gave the input image
+#define SCALE_INPUT_SIGMA 0.5f
+// Stop adding octaves once the image would get smaller than this
+#define SCALE_MIN_SIZE 32
+
+/*
+	A pool of image buffers, so the same memory can be used again for the next image
+	of the same size rather than being freed and allocated every time.
+	A pool is not thread safe; give each thread its own.
+*/
+struct ImagePool
+{
+	std::vector<cv::Mat> buffers;
+};
+
+/*
+	A Gaussian scale space, as in SIFT.
+	Each octave is half the size of the one before, and within an octave, each level is
+	blurred a further 2^(1 / levelsPerOctave) times. Levels are stored octave by octave,
+	so a feature's scale is its level's index here.
+*/
+struct ScaleSpaceLevel
+{
+	cv::Mat image;
+	int octave;
+	int level;
+	// Total blur, in pixels of the original image
+	float sigma;
+};
+
+struct ScaleSpacePyramid
+{
+	int levelsPerOctave = 0;
+	std::vector<ScaleSpaceLevel> levels;
+};
+
+/*
+	Scale space functions
+*/
+cv::Mat AcquireImage(_Inout_ ImagePool& pool, _In_ int rows, _In_ int cols, _In_ int type);
+
+void ReleaseImage(_Inout_ ImagePool& pool, _Inout_ cv::Mat& image);
+
+bool BuildScaleSpacePyramid(
+	_In_ const cv::Mat& img,
+	_In_ int numOctaves,
+	_In_ int levelsPerOctave,
+	_Inout_ ImagePool& pool,
+	_Out_ ScaleSpacePyramid& pyramid);
+
+void ReleaseScaleSpacePyramid(_Inout_ ScaleSpacePyramid& pyramid, _Inout_ ImagePool& pool);
+
+// How much bigger the original image is than the images of this octave
+inline int OctaveScaleFactor(int octave)
+{
+	return 1 << octave;
+}
@@ -1,8 +1,10 @@
 #include "Stereography.h"
 #include "Math.h"
+#include "Ransac.h"
 #include <stdlib.h>
 #include <iostream>
 #include <algorithm>
+#include <immintrin.h>
 
 using namespace cv;
 using namespace std;
@@ -22,262 +24,467 @@ using namespace Eigen;
 
 	The normalisation reduces numerical error when some values are large and others are small
 	and yet they are all compared together and use the same error. This basically translates
-	to over-error or under-error for points. 
+	to over-error or under-error for points.
+
+	Rather than an SVD of the n x 9 system Y, we solve the 9 x 9 normal equations Y^T Y
+	with a self-adjoint eigensolver. Y^T Y is accumulated one match at a time, so any
+	number of matches costs the same fixed-size solve, and nothing is allocated. The
+	normal equations square the condition number, so they're built and solved in double.
+
+	With exactly 8 matches, as in RANSAC, Y is 8 x 9 and its null space is exact, so
+	Gaussian elimination on Y itself finds it for a fraction of the cost of the eigensolver.
+
+	The solution is then forced to rank 2 - a true fundamental matrix has a null space,
+	the epipole - before it is denormalised.
+
+	For RANSAC, there is also the 7-point algorithm: 7 matches leave a two dimensional
+	null space aF1 + (1-a)F2, and requiring det(F) = 0 gives a cubic in a with up to
+	three real roots, so up to three hypotheses, each already rank 2.
 */
 // Support functions
-void GetNormalisationTransformAndNormalisePoints(vector<pair<Feature, Feature>> matches, Matrix3f& T1, Matrix3f& T2)
-{
-	// Get centroid of points for each image
-	Point2f centroid1(0,0);
-	Point2f centroid2(0, 0);
-	for (auto& m : matches)
-	{
-		centroid1 += m.first.p;
-		centroid2 += m.second.p;
-	}
-	centroid1 /= (float)matches.size();
-	centroid2 /= (float)matches.size();
+typedef Matrix<double, 9, 9> EpipolarSystem;
 
-	// offset all points by the negative centroid
-	for (auto& m : matches)
+void GetNormalisationTransform(const Vector3f* points, int numPoints, Matrix3f& T)
+{
+	// Get centroid of points
+	Vector2f centroid(0, 0);
+	for (int i = 0; i < numPoints; ++i)
 	{
-		m.first.p -= centroid1;
-		m.second.p -= centroid2;
+		centroid += points[i].head<2>();
 	}
+	centroid /= (float)numPoints;
 
 	// Find the average distance to the centre
-	float avgDist1 = 0;
-	float avgDist2 = 0;
-	for (auto& m : matches)
+	float avgDist = 0;
+	for (int i = 0; i < numPoints; ++i)
 	{
-		avgDist1 += sqrt(m.first.p.dot(m.first.p));
-		avgDist2 += sqrt(m.second.p.dot(m.second.p));
+		avgDist += (points[i].head<2>() - centroid).norm();
 	}
-	avgDist1 /= (float)matches.size();
-	avgDist2 /= (float)matches.size();
+	avgDist /= (float)numPoints;
 
 	// Now scale every point by root 2 over this distance
-	float scale1 = sqrt(2) / avgDist1;
-	float scale2 = sqrt(2) / avgDist2;
-	for (auto& m : matches)
+	float scale = avgDist > 0 ? sqrt(2.f) / avgDist : 1.f;
+
+	T << scale,   0,    -1*centroid.x()*scale,
+		  0,    scale, -1*centroid.y()*scale,
+		  0,      0,        1;
+}
+inline Matrix<double, 9, 1> EpipolarRow(const Vector3f& y, const Vector3f& yprime)
+{
+	// Each match gives a row of Y from the constraint y'^T F y = 0,
+	// where y' is from the second image and y is from the first
+	Matrix<double, 9, 1> row;
+	row << yprime.x() * y.x(), yprime.x() * y.y(), yprime.x(),
+		yprime.y() * y.x(), yprime.y() * y.y(), yprime.y(),
+		y.x(), y.y(), 1;
+	return row;
+}
+void BuildEpipolarSystem(
+	const Vector3f* points1,
+	const Vector3f* points2,
+	int numPoints,
+	const Matrix3f& T1,
+	const Matrix3f& T2,
+	EpipolarSystem& YtY)
+{
+	YtY.setZero();
+	for (int i = 0; i < numPoints; ++i)
+	{
+		YtY.selfadjointView<Lower>().rankUpdate(EpipolarRow(T1 * points1[i], T2 * points2[i]));
+	}
+}
+// The null space of a minimal system, by Gaussian elimination with partial pivoting.
+// Fails if the leading block is (nearly) singular, in which case use the eigensolver
+template<int N>
+bool MinimalEpipolarNullSpace(
+	const Vector3f* points1,
+	const Vector3f* points2,
+	const Matrix3f& T1,
+	const Matrix3f& T2,
+	Matrix<double, 9, 9 - N>& nullSpace)
+{
+	Matrix<double, N, 9> Y;
+	for (int i = 0; i < N; ++i)
 	{
-		m.first.p *= scale1;
-		m.second.p *= scale2;
+		Y.row(i) = EpipolarRow(T1 * points1[i], T2 * points2[i]).transpose();
 	}
 
-	T1 << scale1,   0,    -1*centroid1.x*scale1,
-		    0,    scale1, -1*centroid1.y*scale1,
-		    0,      0,        1;
+	// Reduce to [I | B]
+	for (int c = 0; c < N; ++c)
+	{
+		int pivot = c;
+		for (int r = c + 1; r < N; ++r)
+		{
+			if (fabs(Y(r, c)) > fabs(Y(pivot, c)))
+			{
+				pivot = r;
+			}
+		}
+		if (fabs(Y(pivot, c)) < 1e-10)
+		{
+			return false;
+		}
+		Y.row(c).swap(Y.row(pivot));
+		Y.row(c) /= Y(c, c);
+		for (int r = 0; r < N; ++r)
+		{
+			if (r != c)
+			{
+				Y.row(r) -= Y(r, c) * Y.row(c);
+			}
+		}
+	}
 
-	T2 << scale2,   0,    -1*centroid2.x*scale2,
-		    0,    scale2, -1*centroid2.y*scale2,
-		    0,      0,        1;
+	// Each free column j gives a null vector [-B_j; e_j]
+	nullSpace.template topRows<N>() = -Y.template rightCols<9 - N>();
+	nullSpace.template bottomRows<9 - N>().setIdentity();
+	for (int j = 0; j < 9 - N; ++j)
+	{
+		nullSpace.col(j).normalize();
+	}
+	return true;
 }
-// Actual function
-bool FindFundamentalMatrix(const vector<pair<Feature, Feature>>& matches, Matrix3f& F)
+Matrix3d FundamentalFromVector(const Matrix<double, 9, 1>& f)
 {
-	if (matches.size() < 8)
+	Matrix3d F;
+	F << f(0), f(1), f(2),
+		f(3), f(4), f(5),
+		f(6), f(7), f(8);
+	return F;
+}
+void EnforceRank2(Matrix3f& F)
+{
+	JacobiSVD<Matrix3f> svd(F, ComputeFullU | ComputeFullV);
+	Vector3f d = svd.singularValues();
+	d(2) = 0;
+	F = svd.matrixU() * d.asDiagonal() * svd.matrixV().transpose();
+}
+bool DenormaliseFundamentalMatrix(const Matrix3f& normalisedF, const Matrix3f& T1, const Matrix3f& T2, Matrix3f& F)
+{
+	// Transform the matrix back to the original coordinate system
+	F = T2.transpose() * normalisedF * T1;
+	if (fabs(F(2, 2)) < 1e-12f)
 	{
 		return false;
 	}
-
-	// create a local copy
-	vector<pair<Feature, Feature>> pairs;
-	for (auto m : matches)
+	F /= F(2, 2);
+	return true;
+}
+// Actual functions
+bool FindFundamentalMatrix(const Vector3f* points1, const Vector3f* points2, int numPoints, Matrix3f& F)
+{
+	if (numPoints < 8)
 	{
-		pairs.push_back(m);
+		return false;
 	}
 
-	// Normalise points and get the transforms for denormalisation
+	// Get the transforms that normalise the points, for denormalisation later
 	Matrix3f normalise1, normalise2;
-	normalise1.setZero();
-	normalise2.setZero();
-	GetNormalisationTransformAndNormalisePoints(pairs, normalise1, normalise2);
+	GetNormalisationTransform(points1, numPoints, normalise1);
+	GetNormalisationTransform(points2, numPoints, normalise2);
 
-	// apply the normalisation to the features
-	vector< pair<Vector3f, Vector3f>> vectorPairs;
-	for (auto& m : pairs)
+	Matrix3f normalisedF;
+	Matrix<double, 9, 1> minimalSolution;
+	if (numPoints == 8 && MinimalEpipolarNullSpace<8>(points1, points2, normalise1, normalise2, minimalSolution))
+	{
+		normalisedF = FundamentalFromVector(minimalSolution).cast<float>();
+	}
+	else
 	{
-		Vector3f first = Vector3f(m.first.p.x, m.first.p.y, 1);
-		Vector3f second = Vector3f(m.second.p.x, m.second.p.y, 1);
+		EpipolarSystem YtY;
+		BuildEpipolarSystem(points1, points2, numPoints, normalise1, normalise2, YtY);
+
+		// The solution is the eigenvector with the smallest eigenvalue, the first one
+		// That also takes care of making the f vector have norm 1
+		SelfAdjointEigenSolver<EpipolarSystem> solver(YtY);
+		if (solver.info() != Success)
+		{
+			return false;
+		}
+		normalisedF = FundamentalFromVector(solver.eigenvectors().col(0)).cast<float>();
+	}
+	EnforceRank2(normalisedF);
+
+	return DenormaliseFundamentalMatrix(normalisedF, normalise1, normalise2, F);
+}
+int FindFundamentalMatrix7Point(const Vector3f* points1, const Vector3f* points2, Matrix3f F[3])
+{
+	Matrix3f normalise1, normalise2;
+	GetNormalisationTransform(points1, 7, normalise1);
+	GetNormalisationTransform(points2, 7, normalise2);
 
-		first = normalise1 * first;
-		second = normalise2 * second;
+	// The null space is two dimensional
+	Matrix3d F1, F2;
+	Matrix<double, 9, 2> nullSpace;
+	if (MinimalEpipolarNullSpace<7>(points1, points2, normalise1, normalise2, nullSpace))
+	{
+		F1 = FundamentalFromVector(nullSpace.col(0));
+		F2 = FundamentalFromVector(nullSpace.col(1));
+	}
+	else
+	{
+		// It's spanned by the two eigenvectors with the smallest eigenvalues
+		EpipolarSystem YtY;
+		BuildEpipolarSystem(points1, points2, 7, normalise1, normalise2, YtY);
+		SelfAdjointEigenSolver<EpipolarSystem> solver(YtY);
+		if (solver.info() != Success)
+		{
+			return 0;
+		}
+		F1 = FundamentalFromVector(solver.eigenvectors().col(0));
+		F2 = FundamentalFromVector(solver.eigenvectors().col(1));
+	}
 
-		vectorPairs.push_back(make_pair(first, second));
+	// det(F2 + a (F1 - F2)) is a cubic in a. Sample it at four points to get the coefficients
+	Matrix3d difference = F1 - F2;
+	double d0 = F2.determinant();
+	double dPlus = (F2 + difference).determinant();
+	double dMinus = (F2 - difference).determinant();
+	double dTwo = (F2 + 2 * difference).determinant();
+	double c2 = 0.5 * (dPlus + dMinus) - d0;
+	double odd = 0.5 * (dPlus - dMinus);
+	double c3 = (dTwo - d0 - 4 * c2 - 2 * odd) / 6;
+	double c1 = odd - c3;
+
+	double roots[3];
+	int numRoots = SolveCubic(c3, c2, c1, d0, roots);
+	int numSolutions = 0;
+	for (int i = 0; i < numRoots; ++i)
+	{
+		Matrix3f normalisedF = (F2 + roots[i] * difference).cast<float>();
+		if (DenormaliseFundamentalMatrix(normalisedF, normalise1, normalise2, F[numSolutions]))
+		{
+			numSolutions++;
+		}
+	}
+	return numSolutions;
+}
+bool FindFundamentalMatrix(const vector<pair<Feature, Feature>>& matches, Matrix3f& F)
+{
+	if (matches.size() < 8)
+	{
+		return false;
 	}
 
 	// Select some subset - here all - and form a system of linear equations based on the 
 	// epipolar constraint
 	// In theory, it shouldn't matter which 8 we pick
 	// also in theory, we have a strong matching set of points - why not use all?
-	// We should just use the first 8
-	MatrixXf Y;
-	Y.resize(vectorPairs.size(), 9);
-	// The matrix Y follows the constraint of y' E y = 0 where y' is from the second feature
-	// and y is from the first
-	for (int i = 0; i < vectorPairs.size(); ++i)
-	{
-		Point2f y = Point2f(vectorPairs[i].first[0], vectorPairs[i].first[1]);
-		Point2f yprime = Point2f(vectorPairs[i].second[0], vectorPairs[i].second[1]);
-		Y(i, 0) = yprime.x * y.x;
-		Y(i, 1) = yprime.x * y.y;
-		Y(i, 2) = yprime.x;
-		Y(i, 3) = yprime.y * y.x;
-		Y(i, 4) = yprime.y * y.y;
-		Y(i, 5) = yprime.y;
-		Y(i, 6) = y.x;
-		Y(i, 7) = y.y;
-		Y(i, 8) = 1;
-	}
-
-	// Solve with SVD
-	BDCSVD<MatrixXf> svd(Y, ComputeFullU | ComputeFullV);
-	if (!svd.computeV())
-		return false;
-	auto & f = svd.matrixV();
-	auto& d = svd.singularValues();
+	vector<Vector3f> points1(matches.size());
+	vector<Vector3f> points2(matches.size());
+	for (size_t i = 0; i < matches.size(); ++i)
+	{
+		points1[i] = Vector3f(matches[i].first.p.x, matches[i].first.p.y, 1);
+		points2[i] = Vector3f(matches[i].second.p.x, matches[i].second.p.y, 1);
+	}
 
-	// Does this have any constraints on the singular values?
-	// Two things:
-	// - We can enforce the rank 2 constraint
-	// - we can make the f vector have norm 1
-	VectorXf fprime(9);
-	fprime << f(0, 8), f(1, 8), f(2, 8),
-		f(3, 8), f(4, 8), f(5, 8),
-		f(6, 8), f(7, 8), f(8, 8);
-	fprime.normalize();
+	return FindFundamentalMatrix(points1.data(), points2.data(), (int)matches.size(), F);
+}
 
-	Matrix3f normalisedF;
-	normalisedF << fprime(0), fprime(1), fprime(2),
-		fprime(3), fprime(4), fprime(5),
-		fprime(6), fprime(7), fprime(8);
+/*
+	RANSAC for the Fundamental matrix
 
-	// Transform the matrix back to the original coordinate system
-	F = normalise2.transpose() * normalisedF * normalise1;
-	F /= F(2, 2);
+	Each hypothesis is scored by triangulating every match with it, and measuring
+	the reprojection error. The hypothesis with the most inliers wins, with ties going to
+	the lowest average error. RunRANSAC stops early once that many inliers make it
+	unlikely there's a better sample still to draw. The decomposition of E into R and t only depends on the hypothesis,
+	so it is done once per hypothesis, and the per-match work is all fixed-size maths.
 
-	return true;
-}
+	Most matches are nowhere near an epipolar line of a bad hypothesis, so before
+	triangulating we throw out anything whose Sampson distance - the first-order
+	distance to satisfying x'^T F x = 0 - is already past the threshold.
 
-float ReprojectionError(Matrix3f E, Matrix3f R, Vector3f t, Matrix3f K1, Matrix3f K2, Vector3f p1, Vector3f p2)
+	Matches come either as index pairs into two FeatureSets, or as pairs of features.
+	Either way they're reduced to their positions before the search starts.
+*/
+// Support functions
+struct NormalisedMatch
+{
+	Vector3f p1;
+	Vector3f p2;
+	Vector3f point1;
+	Vector3f point2;
+};
+inline bool PassesSampsonTest(const Matrix3f& F, const Vector3f& p1, const Vector3f& p2, float threshold)
+{
+	Vector3f Fp1 = F * p1;
+	Vector3f Ftp2 = F.transpose() * p2;
+	float epipolar = p2.dot(Fp1);
+	float denominator = Fp1(0) * Fp1(0) + Fp1(1) * Fp1(1) + Ftp2(0) * Ftp2(0) + Ftp2(1) * Ftp2(1);
+	// Compare without dividing, so a degenerate denominator is just a failure
+	return epipolar * epipolar <= threshold * threshold * denominator;
+}
+float ReprojectionError(
+	const Matrix3f& E,
+	const Matrix3f& R,
+	const Matrix3f& Rinverse,
+	const Vector3f& t,
+	const Matrix3f& K2,
+	const NormalisedMatch& match)
 {
 	float error = 0;
 
-	Vector3f point1 = K1.inverse() * p1;
-	Vector3f point2 = K2.inverse() * p2;
+	Vector3f point1 = match.point1;
+	Vector3f point2 = match.point2;
 	float d0, d1;
-	if (!Triangulate(d0, d1, point1, point2, E))
+	if (!TriangulateWithPose(d0, d1, point1, point2, E, R, t))
 	{
 		return 1000;
 	}
 
-	Vector3f transformedPoint = R.inverse() * (point1 * d1) - R.inverse() * t;
+	Vector3f transformedPoint = Rinverse * (point1 * d1) - Rinverse * t;
 	transformedPoint /= transformedPoint[2];
 	transformedPoint = K2 * transformedPoint;
 
-	error = (transformedPoint - p1).norm();
+	error = (transformedPoint - match.p1).norm();
 
 	return error;
 }
 
-bool FindFundamentalMatrixWithRANSAC(const vector<pair<Feature, Feature>>& matches, Matrix3f& F, StereoPair& stereo)
+// Put a match into camera coordinates, once rather than once per hypothesis
+inline NormalisedMatch NormaliseMatch(const Point2f& p1, const Point2f& p2, const Matrix3f& K1inverse, const Matrix3f& K2inverse)
+{
+	NormalisedMatch m;
+	m.p1 = Vector3f(p1.x, p1.y, 1);
+	m.p2 = Vector3f(p2.x, p2.y, 1);
+	m.point1 = K1inverse * m.p1;
+	m.point2 = K2inverse * m.p2;
+	return m;
+}
+// The search itself, on matches reduced to their positions
+bool FundamentalMatrixRANSAC(const vector<NormalisedMatch>& normalisedMatches, const vector<int>& order, Matrix3f& F, StereoPair& stereo)
 {
 	// For a number of iterations
-	// pick a random 8 points
+	// pick a random 8 (or 7) points
 	// Check the reprojection error by computing x' * F * x - this should be close to zero
 	// The F with the most inliers wins
-	Matrix3f currentBestFundamentalMatrix;
-	int minError = FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD* MIN_NUM_INLIERS;
-	int iterations = 0;
-	srand(F(0,0));
 
-	// copy the set of points
-	vector<pair<Feature, Feature>> pairs;
+	if (normalisedMatches.size() < 8)
+	{
+		return false;
+	}
 
-	do
+	auto solve = [&normalisedMatches](const int* sample, Matrix3f* hypotheses)
 	{
-		pairs.clear();
-		pairs.insert(pairs.end(), matches.begin(), matches.end());
-		vector<pair<Feature, Feature>> chosenEight;
+		Vector3f sample1[FUNDAMENTAL_RANSAC_SAMPLE_SIZE];
+		Vector3f sample2[FUNDAMENTAL_RANSAC_SAMPLE_SIZE];
+		for (int i = 0; i < FUNDAMENTAL_RANSAC_SAMPLE_SIZE; ++i)
+		{
+			sample1[i] = normalisedMatches[sample[i]].p1;
+			sample2[i] = normalisedMatches[sample[i]].p2;
+		}
+		// The 7-point algorithm can give up to three hypotheses per sample
+#if FUNDAMENTAL_RANSAC_SAMPLE_SIZE == 7
+		return FindFundamentalMatrix7Point(sample1, sample2, hypotheses);
+#else
+		return FindFundamentalMatrix(sample1, sample2, FUNDAMENTAL_RANSAC_SAMPLE_SIZE, hypotheses[0]) ? 1 : 0;
+#endif
+	};
 
-		// pick 8 random
-		while (chosenEight.size() < 8)
+	auto score = [&normalisedMatches, &stereo](const Matrix3f& fundamental, RansacScore& score, unsigned char* inliers)
+	{
+		// Now find reprojection error of points
+		Matrix3f E = stereo.img2.K.transpose() * fundamental * stereo.img1.K;
+		Matrix3f R, R2;
+		R.setZero();
+		R2.setZero();
+		Vector3f t(0, 0, 0);
+		if (!DecomposeEssentialMatrix(E, R2, R, t))
 		{
-			int randNum = rand() % pairs.size();
-			auto featurePair = pairs[randNum];
-			chosenEight.push_back(featurePair);
-			pairs.erase(pairs.begin() + randNum);
+			return false;
 		}
+		Matrix3f Rinverse = R.inverse();
 
-		Matrix3f fundamental;
-		if (FindFundamentalMatrix(chosenEight, fundamental))
+		score.inliers = 0;
+		score.cost = 0;
+		for (size_t i = 0; i < normalisedMatches.size(); ++i)
 		{
-			// Now find reprojection error of points
-			int localInliers = 0;
-			float avgError = 0;
-
-			Matrix3f E = stereo.img2.K.transpose() * fundamental * stereo.img1.K;
-			Matrix3f R, R2;
-			R.setZero();
-			R2.setZero();
-			Vector3f t(0, 0, 0);
-			DecomposeEssentialMatrix(E, R2, R, t);
-			for (auto& m : pairs)
+			auto& m = normalisedMatches[i];
+			inliers[i] = 0;
+			if (!PassesSampsonTest(fundamental, m.p1, m.p2, FUNDAMENTAL_SAMPSON_THRESHOLD))
 			{
-				auto f = Vector3f(m.first.p.x, m.first.p.y, 1);
-				auto fprime = Vector3f(m.second.p.x, m.second.p.y, 1);
-
-				float reprojectionError = ReprojectionError(E, R, t, stereo.img1.K, stereo.img2.K, f, fprime);
-				if (reprojectionError < FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD)
-				{
-					localInliers++;
-					avgError += reprojectionError;
-				}
-				
+				continue;
 			}
-			if (localInliers > 0)
-				avgError /= localInliers;
 
-			if (localInliers > MIN_NUM_INLIERS && avgError < minError)
+			float reprojectionError = ReprojectionError(E, R, Rinverse, t, stereo.img2.K, m);
+			if (reprojectionError < FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD)
 			{
-				minError = avgError;
-				currentBestFundamentalMatrix = fundamental;
+				inliers[i] = 1;
+				score.inliers++;
+				score.cost += reprojectionError;
+			}
+		}
+		if (score.inliers > 0)
+			score.cost /= score.inliers;
+		return true;
+	};
+
+	RansacParams params;
+	params.maxIterations = FUNDAMENTAL_RANSAC_ITERATIONS;
+	params.minInliers = MIN_NUM_INLIERS + 1;
+	RansacResult<FUNDAMENTAL_RANSAC_SAMPLE_SIZE> result;
+	// Try the closest descriptor matches first
+	ProsacSampler sampler(order, FUNDAMENTAL_RANSAC_SAMPLE_SIZE);
+	if (!RunRANSAC<Matrix3f, FUNDAMENTAL_RANSAC_SAMPLE_SIZE, 3>((int)normalisedMatches.size(), params, solve, score, sampler, F, result))
+	{
+		return false;
+	}
 
 #ifdef DEBUG_RANSAC_FUNDAMENTAL
-				cout << "Best one so far is " << localInliers << " inliers with average distance " << avgError << endl;
-
-				// visualise which 8 we picked from
-				//Mat funamental(476, 699, CV_8U, Scalar(0));
-				Mat matchImageScored;
-				Mat img_i(476, 699, CV_8U, Scalar(127));
-				Mat img_j(476, 699, CV_8U, Scalar(127));
-				hconcat(img_i, img_j, matchImageScored);
-				int offset = img_i.cols;
-				for (auto p : chosenEight)
-				{
-					auto f2 = p.second;
-					f2.p.x += offset;
-					circle(matchImageScored, p.first.p, 4, 255, -1);
-					circle(matchImageScored, f2.p, 4, 255, -1);
-					line(matchImageScored, p.first.p, f2.p, (0, 0, 0), 2, 8, 0);
-				}
-				imshow("fundamental", matchImageScored);
-				waitKey(0);
+	cout << "Best is " << result.score.inliers << " inliers with average distance " << result.score.cost;
+	cout << " after " << result.iterations << " iterations" << endl;
+
+	// visualise which points we picked from
+	//Mat funamental(476, 699, CV_8U, Scalar(0));
+	Mat matchImageScored;
+	Mat img_i(476, 699, CV_8U, Scalar(127));
+	Mat img_j(476, 699, CV_8U, Scalar(127));
+	hconcat(img_i, img_j, matchImageScored);
+	int offset = img_i.cols;
+	for (int index : result.sample)
+	{
+		auto& m = normalisedMatches[index];
+		Point2f p1(m.p1(0), m.p1(1));
+		Point2f p2(m.p2(0) + offset, m.p2(1));
+		circle(matchImageScored, p1, 4, 255, -1);
+		circle(matchImageScored, p2, 4, 255, -1);
+		line(matchImageScored, p1, p2, (0, 0, 0), 2, 8, 0);
+	}
+	imshow("fundamental", matchImageScored);
+	waitKey(0);
 #endif
-			}
-		}
 
-		iterations++;
-		//cout << "iteration " << iterations << endl;
-	} while (iterations < FUNDAMENTAL_RANSAC_ITERATIONS);
-	
-	if (minError < FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD * MIN_NUM_INLIERS)
+	return true;
+}
+// Actual functions
+bool FindFundamentalMatrixWithRANSAC(
+	_In_ const FeatureSetView& set1,
+	_In_ const FeatureSetView& set2,
+	_In_ const vector<FeatureMatch>& matches,
+	_In_ const vector<float>& distances,
+	_Out_ Matrix3f& F,
+	_Inout_ StereoPair& stereo)
+{
+	Matrix3f K1inverse = stereo.img1.K.inverse();
+	Matrix3f K2inverse = stereo.img2.K.inverse();
+	vector<NormalisedMatch> normalisedMatches(matches.size());
+	for (size_t i = 0; i < matches.size(); ++i)
 	{
-		F = currentBestFundamentalMatrix;
-		return true;
+		normalisedMatches[i] = NormaliseMatch(set1.Point(matches[i].first), set2.Point(matches[i].second), K1inverse, K2inverse);
+	}
+	return FundamentalMatrixRANSAC(normalisedMatches, OrderMatchesByQuality(distances), F, stereo);
+}
+
+bool FindFundamentalMatrixWithRANSAC(const vector<pair<Feature, Feature>>& matches, Matrix3f& F, StereoPair& stereo)
+{
+	Matrix3f K1inverse = stereo.img1.K.inverse();
+	Matrix3f K2inverse = stereo.img2.K.inverse();
+	vector<NormalisedMatch> normalisedMatches(matches.size());
+	for (size_t i = 0; i < matches.size(); ++i)
+	{
+		normalisedMatches[i] = NormaliseMatch(matches[i].first.p, matches[i].second.p, K1inverse, K2inverse);
 	}
-	return false;
+	return FundamentalMatrixRANSAC(normalisedMatches, OrderMatchesByQuality(matches), F, stereo);
 }
 
 /*
@@ -304,12 +511,12 @@ bool DecomposeEssentialMatrix(
 	_Out_ Eigen::Matrix3f& R2,
 	_Out_ Eigen::Vector3f& t)
 {
-	BDCSVD<MatrixXf> svd_initial(E, ComputeFullU | ComputeFullV);
-	if (!svd_initial.computeV())
-		return false;
-	if (!svd_initial.computeU())
+	// Fixed size, so nothing here allocates. Scaling E doesn't change its singular
+	// vectors, so one decomposition gives both the scale and U and V
+	JacobiSVD<Matrix3f> svd(E, ComputeFullU | ComputeFullV);
+	auto& d = svd.singularValues();
+	if (!(d(0) > 0))
 		return false;
-	auto& d = svd_initial.singularValues();
 
 	// To ensure that we have singular values of 1 1 0, 
 	// we scale E
@@ -317,16 +524,9 @@ bool DecomposeEssentialMatrix(
 	float scalar = d(0);
 	E /= scalar;
 
-	BDCSVD<MatrixXf> svd(E, ComputeFullU | ComputeFullV);
-	if (!svd.computeV())
-		return false;
-	if (!svd.computeU())
-		return false;
-	auto& v = svd.matrixV();
-	auto& u = svd.matrixU();
-
-	MatrixXf V = v.transpose().transpose();
-	MatrixXf U = u.transpose().transpose();
+	const Matrix3f& u = svd.matrixU();
+	Matrix3f V = svd.matrixV();
+	Matrix3f U = u;
 	if ((u * V.transpose()).determinant() == -1)
 	{
 		V *= -1.f;
@@ -351,36 +551,37 @@ bool DecomposeEssentialMatrix(
 
 	return true;
 }
-void LindstromOptimisation(Vector3f& x, Vector3f& xprime, const Matrix3f E)
+void LindstromOptimisation(Vector3f& x, Vector3f& xprime, const Matrix3f& E)
 {
-	MatrixXf S(2, 3);
-	S << 1, 0, 0,
-		0, 1, 0;
-
-	Matrix2f Etilde = S * E * S.transpose();
-
-	Vector2f n = S * E * xprime;
-	Vector2f nprime = S * E.transpose() * x;
-	RowVector2f nT = n.transpose();
-	RowVector2f nprimeT = nprime.transpose();
-	float a = nT * Etilde * nprime;
-	float b = 0.5f * (nT*n + nprimeT*nprime)(0);
-	float c = x.transpose() * E * xprime;
+	// S = [1 0 0; 0 1 0] just picks out the first two rows or columns,
+	// so use blocks instead of multiplying by it
+	Matrix2f Etilde = E.topLeftCorner<2, 2>();
+
+	Vector2f n = (E * xprime).head<2>();
+	Vector2f nprime = (E.transpose() * x).head<2>();
+	float a = n.dot(Etilde * nprime);
+	float b = 0.5f * (n.dot(n) + nprime.dot(nprime));
+	float c = x.dot(E * xprime);
 	float d = sqrt(b*b - a*c);
 	float lambda = c / (b + d);
 	Vector2f x_delta = lambda * n;
 	Vector2f xprime_delta = lambda * nprime;
 	n = n - Etilde * xprime_delta;
-	nT = n.transpose();
 	nprime = nprime - Etilde * x_delta;
-	nprimeT = nprime.transpose();
-	x_delta = ((x_delta.transpose()*n)(0) / (nT*n)(0)) * n;
-	xprime_delta = ((xprime_delta.transpose()*nprime)(0) / (nprimeT*nprime)(0)) * nprime;
-	x = x - S.transpose() * x_delta;
-	xprime = xprime - S.transpose() * xprime_delta;
+	x_delta = (x_delta.dot(n) / n.dot(n)) * n;
+	xprime_delta = (xprime_delta.dot(nprime) / nprime.dot(nprime)) * nprime;
+	x.head<2>() -= x_delta;
+	xprime.head<2>() -= xprime_delta;
 }
-// Actual Function
-bool Triangulate(float& depth0, float& depth1, Vector3f& x, Vector3f& xprime, Matrix3f& E)
+// Actual Functions
+bool TriangulateWithPose(
+	float& depth0,
+	float& depth1,
+	Vector3f& x,
+	Vector3f& xprime,
+	const Matrix3f& E,
+	const Matrix3f& R,
+	const Vector3f& t)
 {
 	// Lindstrom's algorithm gives us the optimal points x and xprime
 	// So we modify p1 and p2, and then use them to compute depth. 
@@ -391,15 +592,6 @@ bool Triangulate(float& depth0, float& depth1, Vector3f& x, Vector3f& xprime, Ma
 	// and finds the point on each ray that minimises the length of this line. 
 	// Basically the most agreeable point. The depth along each ray, then, is the point depth. 
 
-	Vector3f t(0, 0, 0);
-	Matrix3f R, R_other;
-	R.setZero();
-	R_other.setZero();
-	if (!DecomposeEssentialMatrix(E, R_other, R, t))
-	{
-		return false;
-	}
-
 	Vector3f normalisedX = x / x(2);
 	Vector3f normalisedXPrime = xprime / xprime(2);
 	Vector3f u = R * normalisedX;
@@ -430,17 +622,28 @@ bool Triangulate(float& depth0, float& depth1, Vector3f& x, Vector3f& xprime, Ma
 		d1 = (a + b * d0) / c;
 	}
 
-	Vector3f xyz0 = t + d0 * u;
-	Vector3f xyz1 = d1 * v;
-
-	Vector3f midpoint = 0.5 * (xyz0 + xyz1);
-	Vector3f point3D = E.inverse() * midpoint;
+	// The final 3d point would be the midpoint of t + d0 * u and d1 * v,
+	// but all we need is the distance in both cameras
 	depth0 = d0;
 	depth1 = d1;
-	// It's worth noting that we compute the final 3d point, and the distance in both cameras
 
 	return true;
 }
+bool Triangulate(float& depth0, float& depth1, Vector3f& x, Vector3f& xprime, Matrix3f& E)
+{
+	// When triangulating many points against the same E, decompose it once
+	// and call TriangulateWithPose instead
+	Vector3f t(0, 0, 0);
+	Matrix3f R, R_other;
+	R.setZero();
+	R_other.setZero();
+	if (!DecomposeEssentialMatrix(E, R_other, R, t))
+	{
+		return false;
+	}
+
+	return TriangulateWithPose(depth0, depth1, x, xprime, E, R, t);
+}
 
 /*
 	Given a projective matrix P, decompose into K and E = R * t_skew
@@ -572,62 +775,190 @@ void ComputeRectificationRotations(
 /*
 	Given a homography from the original to the rectified image, 
 	and an image, compute the rectified image using projection.
-*/
-// Helper
-uchar BilinearInterpolatePixel(const Mat& img, const float& x, const float& y)
-{
-	// Bilinear interpolation
 
-	// Given an imageand a floating point coordinate,
-	// interpolate the value of the pixel based on the surrounding
-	// four values
-	float x1 = floor(x);
-	float x2 = ceil(x);
-	float y1 = floor(y);
-	float y2 = ceil(y);
+	For every pixel in the rectified image, we project back through the inverse homography
+	into the original, and bilinearly interpolate the value at that sub-pixel location.
 
-	uchar y1Val = ((x2 - x) / (x2 - x1)) * img.at<uchar>(y1, x1) + ((x - x1) / (x2 - x1)) * img.at<uchar>(y1, x2);
-	uchar y2Val = ((x2 - x) / (x2 - x1)) * img.at<uchar>(y2, x1) + ((x - x1) / (x2 - x1)) * img.at<uchar>(y2, x2);
+	The rig geometry doesn't change from frame to frame, so neither does any of that projection.
+	So we do it once, and build a rectification map: for each rectified pixel, the offset of
+	the top-left of the four source pixels around it, and the fixed-point fractions of the way
+	to the next pixel in x and y. Applying the map to a frame is then just four loads and a 
+	weighted sum per pixel, with no divides or matrix maths.
 
-	uchar val = ((y2 - y) / (y2 - y1)) * y1Val + ((y - y1) / (y2 - y1)) * y2Val;
-	return val;
+	Pixels that project outside the original are flagged invalid in the map, and come out black.
+*/
+// Support functions
+void ProjectRectifiedPixel(const Matrix3f& Hinverse, int y, int x, float& sx, float& sy)
+{
+	Vector3f transformedPixel = Hinverse * Vector3f((float)x, (float)y, 1);
+	sx = transformedPixel(0) / transformedPixel(2);
+	sy = transformedPixel(1) / transformedPixel(2);
 }
-// Actual rectification
-void RectifyImage(
-	_In_ const cv::Mat& original,
-	_Out_ cv::Mat& rectified,
-	_In_ const Eigen::Matrix3f& H)
+// Blend the four source pixels around one output pixel.
+// Weights are in 1/RECTIFY_INTER_SCALE, so the product of two is in 1/RECTIFY_INTER_SCALE^2
+inline uchar BlendPixel(const uchar* src, int offset, int step, int fx, int fy)
 {
-	// For the second image, reproject every pixel in the first Mat back into image to be stitched in.
-	// If it isn't there, move on.
-	// If it is there, bilinearly interpolate the value of that sub-pixel location
-	// In the original Mat, if this clashes with a point in the original image,
-	// take the average and place that there
-
-	// TODO: multithread
-	// To multithread, just use openmp on the outer for loop or something
-	// and cap threads at a reasonable number
+	int top = src[offset] * (RECTIFY_INTER_SCALE - fx) + src[offset + 1] * fx;
+	int bottom = src[offset + step] * (RECTIFY_INTER_SCALE - fx) + src[offset + step + 1] * fx;
+	int round = 1 << (2 * RECTIFY_INTER_BITS - 1);
+	return (uchar)((top * (RECTIFY_INTER_SCALE - fy) + bottom * fy + round) >> (2 * RECTIFY_INTER_BITS));
+}
+// Actual functions
+bool BuildRectificationMap(
+	_In_ const Matrix3f& H,
+	_In_ const Size& originalSize,
+	_In_ const Size& rectifiedSize,
+	_Out_ RectificationMap& map)
+{
+	if (originalSize.width < 2 || originalSize.height < 2)
+	{
+		return false;
+	}
 
-	// Iterate over the size of the original image
-	for (unsigned int y = 0; y < rectified.rows; ++y)
+	map.width = rectifiedSize.width;
+	map.height = rectifiedSize.height;
+	map.originalWidth = originalSize.width;
+	map.originalHeight = originalSize.height;
+	size_t numPixels = (size_t)map.width * map.height;
+	map.offsets.assign(numPixels, 0);
+	map.fracX.assign(numPixels, 0);
+	map.fracY.assign(numPixels, 0);
+	map.valid.assign(numPixels, 0);
+
+	// Invert once, not per pixel
+	Matrix3f Hinverse = H.inverse();
+
+#pragma omp parallel for
+	for (int y = 0; y < map.height; ++y)
 	{
-		for (unsigned int x = 0; x < rectified.cols; ++x)
+		for (int x = 0; x < map.width; ++x)
 		{
-			Vector3f pixel(x, y, 1);
-			Vector3f transformedPixel = H.inverse() * pixel;
-			transformedPixel /= transformedPixel(2);
+			float sx, sy;
+			ProjectRectifiedPixel(Hinverse, y, x, sx, sy);
 
-			uchar pixelVal = 0;
-			if (0 < transformedPixel(0) && transformedPixel(0) < original.cols - 1)
+			// Only pixels strictly inside the original, with a neighbour to the right and below, are valid
+			if (!(0 < sx && sx < map.originalWidth - 1 && 0 < sy && sy < map.originalHeight - 1))
 			{
-				if (0 < transformedPixel(1) && transformedPixel(1) < original.rows - 1)
-				{
-					uchar pixelVal = BilinearInterpolatePixel(original, transformedPixel(0), transformedPixel(1));
-					rectified.at<uchar>(y, x) = pixelVal;
-				}
+				continue;
+			}
+			int ix = (int)floor(sx * RECTIFY_INTER_SCALE + 0.5f);
+			int iy = (int)floor(sy * RECTIFY_INTER_SCALE + 0.5f);
+			int x0 = ix >> RECTIFY_INTER_BITS;
+			int y0 = iy >> RECTIFY_INTER_BITS;
+			int fx = ix & (RECTIFY_INTER_SCALE - 1);
+			int fy = iy & (RECTIFY_INTER_SCALE - 1);
+
+			// Rounding can land exactly on the last row or column; take all of the far pixel instead
+			if (x0 >= map.originalWidth - 1)
+			{
+				x0 = map.originalWidth - 2;
+				fx = RECTIFY_INTER_SCALE;
+			}
+			if (y0 >= map.originalHeight - 1)
+			{
+				y0 = map.originalHeight - 2;
+				fy = RECTIFY_INTER_SCALE;
 			}
+
+			size_t i = (size_t)y * map.width + x;
+			map.offsets[i] = y0 * map.originalWidth + x0;
+			map.fracX[i] = (uchar)fx;
+			map.fracY[i] = (uchar)fy;
+			map.valid[i] = 1;
 		}
 	}
+
+	return true;
+}
+bool ApplyRectificationMap(
+	_In_ const Mat& original,
+	_Out_ Mat& rectified,
+	_In_ const RectificationMap& map)
+{
+	// The offsets are only good for the grayscale image size the map was built for
+	if (original.empty() || original.type() != CV_8U ||
+		original.cols != map.originalWidth || original.rows != map.originalHeight)
+	{
+		cout << "Can't rectify an image that isn't " << map.originalWidth << "x" << map.originalHeight << " grayscale" << endl;
+		return false;
+	}
+
+	// Offsets are computed against a continuous image
+	Mat src = original.isContinuous() ? original : original.clone();
+	rectified.create(map.height, map.width, CV_8U);
+
+	const uchar* data = src.ptr<uchar>(0);
+	int step = map.originalWidth;
+
+#pragma omp parallel for
+	for (int y = 0; y < map.height; ++y)
+	{
+		size_t rowStart = (size_t)y * map.width;
+		const int* offsets = &map.offsets[rowStart];
+		const uchar* fracX = &map.fracX[rowStart];
+		const uchar* fracY = &map.fracY[rowStart];
+		const uchar* valid = &map.valid[rowStart];
+		uchar* out = rectified.ptr<uchar>(y);
+
+		int x = 0;
+#if defined(__AVX2__)
+		// Eight pixels at a time. Each gather pulls 32 bits from the top row and from the
+		// bottom row of the source; the bottom gather starts two bytes early so that it never
+		// reads past the end of the image, and the pixels we want are in its top half
+		const __m256i scale = _mm256_set1_epi32(RECTIFY_INTER_SCALE);
+		const __m256i round = _mm256_set1_epi32(1 << (2 * RECTIFY_INTER_BITS - 1));
+		const __m256i lowByte = _mm256_set1_epi32(0xFF);
+		const __m256i bottomOffset = _mm256_set1_epi32(step - 2);
+		for (; x + 8 <= map.width; x += 8)
+		{
+			__m256i offset = _mm256_loadu_si256((const __m256i*)(offsets + x));
+			__m256i top = _mm256_i32gather_epi32((const int*)data, offset, 1);
+			__m256i bottom = _mm256_i32gather_epi32((const int*)data, _mm256_add_epi32(offset, bottomOffset), 1);
+			__m256i p00 = _mm256_and_si256(top, lowByte);
+			__m256i p01 = _mm256_and_si256(_mm256_srli_epi32(top, 8), lowByte);
+			__m256i p10 = _mm256_and_si256(_mm256_srli_epi32(bottom, 16), lowByte);
+			__m256i p11 = _mm256_srli_epi32(bottom, 24);
+
+			__m256i fx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(fracX + x)));
+			__m256i fy = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(fracY + x)));
+			__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(valid + x)));
+			__m256i fx1 = _mm256_sub_epi32(scale, fx);
+			__m256i fy1 = _mm256_sub_epi32(scale, fy);
+
+			__m256i t = _mm256_add_epi32(_mm256_mullo_epi32(p00, fx1), _mm256_mullo_epi32(p01, fx));
+			__m256i b = _mm256_add_epi32(_mm256_mullo_epi32(p10, fx1), _mm256_mullo_epi32(p11, fx));
+			__m256i result = _mm256_add_epi32(_mm256_mullo_epi32(t, fy1), _mm256_mullo_epi32(b, fy));
+			result = _mm256_srli_epi32(_mm256_add_epi32(result, round), 2 * RECTIFY_INTER_BITS);
+			result = _mm256_mullo_epi32(result, v);
+
+			// Pack 8 x 32 bits down to 8 bytes
+			__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+			packed = _mm_packus_epi16(packed, packed);
+			_mm_storel_epi64((__m128i*)(out + x), packed);
+		}
+#endif
+		for (; x < map.width; ++x)
+		{
+			out[x] = valid[x] ? BlendPixel(data, offsets[x], step, fracX[x], fracY[x]) : 0;
+		}
+	}
+
+	return true;
+}
+void RectifyImage(
+	_In_ const cv::Mat& original,
+	_Out_ cv::Mat& rectified,
+	_In_ const Eigen::Matrix3f& H)
+{
+	// For a one-off image, build the map and throw it away.
+	// For a stream of frames from the same rig, build the map once and apply it to each
+	RectificationMap map;
+	Size rectifiedSize = rectified.empty() ? original.size() : rectified.size();
+	if (!BuildRectificationMap(H, original.size(), rectifiedSize, map))
+	{
+		return;
+	}
+	ApplyRectificationMap(original, rectified, map);
 }
 
 /*
@@ -642,51 +973,51 @@ void RectifyImage(
 	But we don't know the Z coordinate?
 	Well, we estimate that by searching for matching pixels along the line.
 
-	What I'm going to do is for each pixel in the first image, search along the 
-	same row in the second for the best-matching pixel. Take the inverse of the x-coordinate distance,
-	and assign this as the pixel value in the depth image for that same point as in the first image
+	For each pixel in the first image we search a bounded range of disparities along the 
+	same row in the second, comparing windows rather than single pixels, and take the 
+	best-matching offset, either independently per pixel (block matching) or with
+	smoothness constraints along paths through the image (SGM). See Disparity.cpp for the details.
+	That x-coordinate distance is assigned as the pixel value in the depth image for that same point
+	as in the first image
 */
+// Support function
+// Pixels with no valid disparity are 0. The depth image is reused if it's already the right size
+void DisparityToDepthImage(
+	_In_ const Mat& disparity,
+	_In_ const DisparityParams& params,
+	_Out_ Mat& depth)
+{
+	// For now, directly set depth to x distance
+	depth.create(disparity.rows, disparity.cols, CV_8U);
+	short invalid = INVALID_DISPARITY(params.minDisparity);
+	for (int y = 0; y < disparity.rows; ++y)
+	{
+		const short* d = disparity.ptr<short>(y);
+		uchar* out = depth.ptr<uchar>(y);
+		for (int x = 0; x < disparity.cols; ++x)
+		{
+			out[x] = d[x] == invalid ? 0 : (uchar)min(abs((int)d[x]), 255);
+		}
+	}
+}
+// Actual function
 Mat ComputeDepthImage(
 	_In_ const Mat& img0,
-	_In_ const Mat& img1)
+	_In_ const Mat& img1,
+	_In_ const DisparityParams& params)
 {
 	// This assumes vertical alignment
 	// and the same image size
-	if (img0.cols != img1.cols || img0.rows != img1.rows)
+	Mat disparity;
+	if (!ComputeDisparity(img0, img1, disparity, params))
 	{
 		cout << "Cannot compute depth!" << endl;
 		return Mat(Size(0,0), CV_8U);
 	}
 
 	// Depth Image
-	Mat depth = Mat::zeros(Size(img0.cols, img0.rows), CV_8U);
-
-	for (int y = 0; y < img0.rows; ++y)
-	{
-		for (int x = 0; x < img0.cols; ++x)
-		{
-			// For each pixel, find the best-matching pixel in the same row in the other image
-			uchar pixel0 = img0.at<uchar>(y,x);
-			if (pixel0 == 0) continue;
-			int xBestMatch = 0;
-			int distance = 255; // biggest distance any two pixel values can be
-			for (int x1 = 0; x1 < img1.cols; ++x1)
-			{
-				uchar pixel1 = img1.at<uchar>(y,x1);
-				if (pixel1 == 0) continue;
-				if (abs(pixel1 - pixel0) < distance)
-				{
-					distance = abs(pixel1 - pixel0);
-					xBestMatch = x1;
-				}
-			}
-
-			// Now that we have the best match
-			// For now, directly set depth to x distance
-			depth.at<uchar>(y,x) = abs(xBestMatch -x);
-		}
-	}
-
+	Mat depth;
+	DisparityToDepthImage(disparity, params, depth);
 	return depth;
 }
 
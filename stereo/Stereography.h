@@ -5,12 +5,23 @@
 #include <utility>
 #include <Eigen/Dense>
 #include "Features.h"
+#include "Disparity.h"
 
 #define BAD_DEPTH -1
 
 #define FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD 70
 #define MIN_NUM_INLIERS 20
 #define FUNDAMENTAL_RANSAC_ITERATIONS 200
+// 8 for the 8-point algorithm, or 7 for the 7-point algorithm, which gives up to three hypotheses per sample
+#define FUNDAMENTAL_RANSAC_SAMPLE_SIZE 8
+// Matches further than this (in pixels, by Sampson distance) from satisfying a hypothesis
+// aren't worth triangulating to score it
+#define FUNDAMENTAL_SAMPSON_THRESHOLD FUNDAMENTAL_REPROJECTION_ERROR_THRESHOLD
+
+// Rectification maps store sub-pixel positions with this many bits of fraction
+// Keep it at or below 7, so four weighted pixels fit comfortably in 32 bits
+#define RECTIFY_INTER_BITS 5
+#define RECTIFY_INTER_SCALE (1 << RECTIFY_INTER_BITS)
 
 struct StereoPair
 {
@@ -20,16 +31,63 @@ struct StereoPair
 	Eigen::Matrix3f E;
 };
 
+/*
+	A precomputed mapping from rectified pixels back into the original image.
+	Entries are row-major over the rectified image. offsets is the index of the
+	top-left of the four original pixels to blend, and fracX/fracY are how far
+	towards the next pixel to go, in 1/RECTIFY_INTER_SCALE (inclusive of a whole pixel).
+	Pixels that fall outside the original have valid = 0.
+*/
+struct RectificationMap
+{
+	int width = 0;
+	int height = 0;
+	int originalWidth = 0;
+	int originalHeight = 0;
+	std::vector<int> offsets;
+	std::vector<uchar> fracX;
+	std::vector<uchar> fracY;
+	std::vector<uchar> valid;
+};
+
 /*
 	Stereography functions
 */
 
 bool FindFundamentalMatrix(const std::vector<std::pair<Feature, Feature>>& matches, Eigen::Matrix3f& F);
 
+bool FindFundamentalMatrix(
+	_In_ const Eigen::Vector3f* points1,
+	_In_ const Eigen::Vector3f* points2,
+	_In_ int numPoints,
+	_Out_ Eigen::Matrix3f& F);
+
+int FindFundamentalMatrix7Point(
+	_In_ const Eigen::Vector3f* points1,
+	_In_ const Eigen::Vector3f* points2,
+	_Out_ Eigen::Matrix3f F[3]);
+
 bool FindFundamentalMatrixWithRANSAC(const std::vector<std::pair<Feature, Feature>>& matches, Eigen::Matrix3f& F, StereoPair& stereo);
 
+bool FindFundamentalMatrixWithRANSAC(
+	_In_ const FeatureSetView& set1,
+	_In_ const FeatureSetView& set2,
+	_In_ const std::vector<FeatureMatch>& matches,
+	_In_ const std::vector<float>& distances,
+	_Out_ Eigen::Matrix3f& F,
+	_Inout_ StereoPair& stereo);
+
 bool Triangulate(float& depth0, float& depth1, Eigen::Vector3f& x, Eigen::Vector3f& xprime, Eigen::Matrix3f& E);
 
+bool TriangulateWithPose(
+	float& depth0,
+	float& depth1,
+	Eigen::Vector3f& x,
+	Eigen::Vector3f& xprime,
+	const Eigen::Matrix3f& E,
+	const Eigen::Matrix3f& R,
+	const Eigen::Vector3f& t);
+
 void DecomposeProjectiveMatrixIntoKAndE(const Eigen::MatrixXf& P, Eigen::Matrix3f& K, Eigen::Matrix3f& E);
 
 bool DecomposeEssentialMatrix(
@@ -45,13 +103,30 @@ void ComputeRectificationRotations(
 	_Out_ Eigen::Matrix3f& R_0,
 	_Out_ Eigen::Matrix3f& R_1);
 
+bool BuildRectificationMap(
+	_In_ const Eigen::Matrix3f& H,
+	_In_ const cv::Size& originalSize,
+	_In_ const cv::Size& rectifiedSize,
+	_Out_ RectificationMap& map);
+
+bool ApplyRectificationMap(
+	_In_ const cv::Mat& original,
+	_Out_ cv::Mat& rectified,
+	_In_ const RectificationMap& map);
+
 void RectifyImage(
 	_In_ const cv::Mat& original,
 	_Out_ cv::Mat& rectified,
 	_In_ const Eigen::Matrix3f& H);
 
+void DisparityToDepthImage(
+	_In_ const cv::Mat& disparity,
+	_In_ const DisparityParams& params,
+	_Out_ cv::Mat& depth);
+
 cv::Mat ComputeDepthImage(
 	_In_ const cv::Mat& img0,
-	_In_ const cv::Mat& img1);
+	_In_ const cv::Mat& img1,
+	_In_ const DisparityParams& params = DisparityParams());
 
 void ReadCalibrationMatricesFromFile(_In_ const std::string& calibFile, _Inout_ std::vector<ImageDescriptor>& images);
\ No newline at end of file
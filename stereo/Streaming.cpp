@@ -0,0 +1,421 @@
+#include "Streaming.h"
+#include "Cache.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+
+using namespace cv;
+using namespace std;
+using namespace Eigen;
+
+/*
+	Open a pair of synchronised streams. With no right stream, the left one is taken to hold
+	both views side by side.
+*/
+bool OpenFramePairSource(
+	_In_ const string& left,
+	_In_ const string& right,
+	_Out_ FramePairSource& source)
+{
+	source.sideBySide = right.empty();
+	if (!source.left.open(left))
+	{
+		cout << "Cannot open frame source " << left << endl;
+		return false;
+	}
+	if (!source.sideBySide && !source.right.open(right))
+	{
+		cout << "Cannot open frame source " << right << endl;
+		source.left.release();
+		return false;
+	}
+	return true;
+}
+
+/*
+	Read the next pair of frames as grayscale.
+	Returns false once either stream runs out.
+*/
+// Support function
+// Writes into gray, reusing it if it's already the right size
+void ConvertFrameToGray(const Mat& frame, Mat& gray)
+{
+	if (frame.channels() == 4)
+	{
+		cvtColor(frame, gray, COLOR_BGRA2GRAY);
+	}
+	else if (frame.channels() == 3)
+	{
+		cvtColor(frame, gray, COLOR_BGR2GRAY);
+	}
+	else
+	{
+		frame.copyTo(gray);
+	}
+}
+// Actual function
+bool ReadFramePair(
+	_Inout_ FramePairSource& source,
+	_Out_ Mat& gray0,
+	_Out_ Mat& gray1)
+{
+	if (!source.left.read(source.frame0) || source.frame0.empty())
+	{
+		return false;
+	}
+	if (source.sideBySide)
+	{
+		int half = source.frame0.cols / 2;
+		ConvertFrameToGray(source.frame0(Rect(0, 0, half, source.frame0.rows)), gray0);
+		ConvertFrameToGray(source.frame0(Rect(half, 0, half, source.frame0.rows)), gray1);
+		return true;
+	}
+	if (!source.right.read(source.frame1) || source.frame1.empty())
+	{
+		return false;
+	}
+	ConvertFrameToGray(source.frame0, gray0);
+	ConvertFrameToGray(source.frame1, gray1);
+	return true;
+}
+
+/*
+	The rectification maps for a calibrated pair.
+	They only depend on the rig, so if we were given a folder to cache them in, try to pull
+	them from there before working them out again, and save them there if we had to.
+*/
+bool GetRectificationMaps(
+	_In_ const StereoPair& stereo,
+	_In_ const string& cacheFolder,
+	_Out_ RectificationMap& map0,
+	_Out_ RectificationMap& map1)
+{
+	Size size0(stereo.img1.width, stereo.img1.height);
+	Size size1(stereo.img2.width, stereo.img2.height);
+
+	Matrix3f R0, R1;
+	string cacheFile = "";
+	uint64_t key = HashRectificationKey(stereo.img1.K, stereo.img2.K, stereo.E, size0, size1);
+	if (!cacheFolder.empty())
+	{
+		cacheFile = GetRectificationCacheFilename(cacheFolder, key);
+		if (LoadRectificationCache(cacheFile, key, R0, R1, map0, map1))
+		{
+			cout << "Read rectification maps from " << cacheFile << endl;
+			return true;
+		}
+	}
+
+	// Compute rectification rotations
+	// These only use the essential matrix, so the images aren't needed
+	Matrix3f E = stereo.E;
+	ComputeRectificationRotations(E, Mat(), Mat(), R0, R1);
+
+	// Apply rotation to images
+	// Sometimes the rectified images don't fit nicely within the original image
+	// frames given. Here I don't tackle that, but it can be necessary
+	if (!BuildRectificationMap(stereo.img1.K * R0 * stereo.img1.K.inverse(), size0, size0, map0) ||
+		!BuildRectificationMap(stereo.img2.K * R1 * stereo.img2.K.inverse(), size1, size1, map1))
+	{
+		cout << "Cannot build rectification maps" << endl;
+		return false;
+	}
+
+	if (!cacheFile.empty() && !SaveRectificationCache(cacheFile, key, R0, R1, map0, map1))
+	{
+		cout << "Saving rectification maps to file failed" << endl;
+	}
+	return true;
+}
+
+/*
+	Set up a stream for a calibrated rig. The first frame searches the full disparity range in params.
+*/
+bool InitialiseStereoStream(
+	_In_ const StereoPair& stereo,
+	_In_ const string& cacheFolder,
+	_In_ const DisparityParams& params,
+	_Out_ StereoStream& stream)
+{
+	stream.params = params;
+	stream.minDisparity = params.minDisparity;
+	stream.maxDisparity = params.maxDisparity;
+	stream.frameIndex = 0;
+	return GetRectificationMaps(stereo, cacheFolder, stream.map0, stream.map1);
+}
+
+/*
+	Warm start the disparity search for the next frame.
+
+	Consecutive frames from a rig see nearly the same scene, so the disparities of one frame
+	are a good guess at those of the next. Searching only the range they covered, plus a margin
+	for motion, cuts the cost of matching in proportion. The range follows the scene: when
+	disparities pile up at one end of it, the percentile lands there and the margin pushes that
+	end out a little further each frame.
+	Something appearing well outside the range can't be seen that way, so the full range is
+	searched again every STREAM_RANGE_REFRESH frames, and whenever too few pixels matched.
+*/
+// Support function
+void ResetDisparityRange(StereoStream& stream)
+{
+	stream.minDisparity = stream.params.minDisparity;
+	stream.maxDisparity = stream.params.maxDisparity;
+}
+// Actual function
+void UpdateDisparityRange(
+	_Inout_ StereoStream& stream,
+	_In_ const StereoFrame& frame)
+{
+	const DisparityParams& frameParams = frame.params;
+	if (STREAM_RANGE_REFRESH > 0 && (frame.index + 1) % STREAM_RANGE_REFRESH == 0)
+	{
+		ResetDisparityRange(stream);
+		return;
+	}
+
+	// Histogram a sparse sample of the valid disparities
+	// Pixels nearer the left edge than the largest disparity could only be matched to part of
+	// the range, and come out small whatever the scene is, so they're left out
+	int range = frameParams.maxDisparity - frameParams.minDisparity + 1;
+	stream.histogram.assign(range, 0);
+	short invalid = INVALID_DISPARITY(frameParams.minDisparity);
+	int numSamples = 0;
+	int numValid = 0;
+	for (int y = 0; y < frame.disparity.rows; y += STREAM_RANGE_SAMPLE_STEP)
+	{
+		const short* d = frame.disparity.ptr<short>(y);
+		for (int x = frameParams.maxDisparity; x < frame.disparity.cols; x += STREAM_RANGE_SAMPLE_STEP)
+		{
+			++numSamples;
+			if (d[x] == invalid || d[x] < frameParams.minDisparity || d[x] > frameParams.maxDisparity)
+			{
+				continue;
+			}
+			++stream.histogram[d[x] - frameParams.minDisparity];
+			++numValid;
+		}
+	}
+	if (numValid == 0 || numValid < STREAM_MIN_VALID_FRACTION * numSamples)
+	{
+		ResetDisparityRange(stream);
+		return;
+	}
+
+	// Trim the outliers off either end
+	int outliers = (int)(STREAM_RANGE_PERCENTILE * numValid);
+	int low = 0;
+	for (int count = stream.histogram[0]; count <= outliers; count += stream.histogram[++low]);
+	int high = range - 1;
+	for (int count = stream.histogram[high]; count <= outliers; count += stream.histogram[--high]);
+
+	stream.minDisparity = max(stream.params.minDisparity, frameParams.minDisparity + low - STREAM_RANGE_MARGIN);
+	stream.maxDisparity = min(stream.params.maxDisparity, frameParams.minDisparity + high + STREAM_RANGE_MARGIN);
+}
+
+/*
+	The stages a frame pair goes through, in order. Each writes into the frame's own buffers,
+	so frames at different stages can be worked on at the same time.
+	The disparity stage has to see the frames in order, as each one's search range
+	comes from the one before.
+*/
+bool RectifyStereoFrame(
+	_In_ const StereoStream& stream,
+	_Inout_ StereoFrame& frame)
+{
+	// The maps were built for the calibrated image size
+	if (frame.gray0.cols != stream.map0.originalWidth || frame.gray0.rows != stream.map0.originalHeight ||
+		frame.gray1.cols != stream.map1.originalWidth || frame.gray1.rows != stream.map1.originalHeight)
+	{
+		cout << "Frame " << frame.index << " is not the size the rig was calibrated for" << endl;
+		return false;
+	}
+
+	return ApplyRectificationMap(frame.gray0, frame.rectified0, stream.map0) &&
+		ApplyRectificationMap(frame.gray1, frame.rectified1, stream.map1);
+}
+
+bool ComputeStereoFrameDisparity(
+	_Inout_ StereoStream& stream,
+	_Inout_ StereoFrame& frame)
+{
+	frame.params = stream.params;
+	frame.params.minDisparity = stream.minDisparity;
+	frame.params.maxDisparity = stream.maxDisparity;
+	if (!ComputeDisparity(frame.rectified0, frame.rectified1, frame.disparity, frame.params))
+	{
+		cout << "Cannot compute depth for frame " << frame.index << endl;
+		return false;
+	}
+	UpdateDisparityRange(stream, frame);
+	return true;
+}
+
+void ComputeStereoFrameDepth(_Inout_ StereoFrame& frame)
+{
+	DisparityToDepthImage(frame.disparity, frame.params, frame.depth);
+}
+
+/*
+	Frame queues between the stages of the pipeline
+*/
+void PushStereoFrame(_Inout_ StereoFrameQueue& queue, _In_ StereoFrame* frame)
+{
+	{
+		lock_guard<mutex> lock(queue.mutex);
+		queue.frames.push_back(frame);
+	}
+	queue.ready.notify_one();
+}
+
+StereoFrame* PopStereoFrame(_Inout_ StereoFrameQueue& queue)
+{
+	unique_lock<mutex> lock(queue.mutex);
+	queue.ready.wait(lock, [&queue] { return queue.closed || !queue.frames.empty(); });
+	if (queue.frames.empty())
+	{
+		return nullptr;
+	}
+	StereoFrame* frame = queue.frames.front();
+	queue.frames.pop_front();
+	return frame;
+}
+
+void CloseStereoFrameQueue(_Inout_ StereoFrameQueue& queue)
+{
+	{
+		lock_guard<mutex> lock(queue.mutex);
+		queue.closed = true;
+	}
+	queue.ready.notify_all();
+}
+
+/*
+	Compute depth maps for every frame pair in a source, handing each to the callback in order.
+
+	The work is split into four stages - decode, rectify, disparity, and depth plus the
+	callback - each on its own thread, passing frames along through queues. So the next
+	frame is read and rectified while this one's disparities are computed, and with
+	enough cores a frame comes out as often as the slowest stage can take one, rather
+	than the sum of them all. The stages themselves still use OpenMP inside; they're
+	threads of their own rather than OpenMP sections so that those loops get a whole
+	team each, instead of running serially as nested regions.
+
+	There are only STREAM_PIPELINE_FRAMES frames, which go back to the decoder once the
+	callback is done with them. The decoder waits when they're all in use, so memory is
+	bounded however far ahead of the slowest stage it could otherwise get.
+	Returns the number of frames processed.
+*/
+// Support functions
+// Runs one middle stage: takes frames from in, and passes on the ones it managed
+// to out. Once anything has failed, frames just go back to the decoder
+template <typename Stage>
+void RunStereoStage(StereoFrameQueue& in, StereoFrameQueue& out, StereoFrameQueue& idle,
+	atomic<bool>& stop, double& busySeconds, Stage stage)
+{
+	while (StereoFrame* frame = PopStereoFrame(in))
+	{
+		if (!stop)
+		{
+			auto start = chrono::steady_clock::now();
+			if (!stage(*frame))
+			{
+				stop = true;
+			}
+			busySeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+		PushStereoFrame(stop ? idle : out, frame);
+	}
+	CloseStereoFrameQueue(out);
+}
+// Actual function
+int RunStereoStream(
+	_Inout_ FramePairSource& source,
+	_Inout_ StereoStream& stream,
+	_In_ const DepthCallback& callback)
+{
+	if (stream.frames.empty())
+	{
+		stream.frames.assign(STREAM_PIPELINE_FRAMES, StereoFrame());
+	}
+	StereoFrameQueue idle, decoded, rectified, matched;
+	for (auto& frame : stream.frames)
+	{
+		idle.frames.push_back(&frame);
+	}
+
+	atomic<bool> stop(false);
+	double decodeSeconds = 0, rectifySeconds = 0, disparitySeconds = 0, depthSeconds = 0;
+	int firstIndex = stream.frameIndex;
+	auto start = chrono::steady_clock::now();
+
+	thread decoder([&]
+	{
+		int index = firstIndex;
+		StereoFrame* frame;
+		while (!stop && (frame = PopStereoFrame(idle)) != nullptr)
+		{
+			auto frameStart = chrono::steady_clock::now();
+			if (stop || !ReadFramePair(source, frame->gray0, frame->gray1))
+			{
+				PushStereoFrame(idle, frame);
+				break;
+			}
+			decodeSeconds += chrono::duration<double>(chrono::steady_clock::now() - frameStart).count();
+			frame->index = index++;
+			PushStereoFrame(decoded, frame);
+		}
+		CloseStereoFrameQueue(decoded);
+	});
+	thread rectifier([&]
+	{
+		RunStereoStage(decoded, rectified, idle, stop, rectifySeconds,
+			[&](StereoFrame& frame) { return RectifyStereoFrame(stream, frame); });
+	});
+	thread matcher([&]
+	{
+		RunStereoStage(rectified, matched, idle, stop, disparitySeconds,
+			[&](StereoFrame& frame) { return ComputeStereoFrameDisparity(stream, frame); });
+	});
+
+	// The last stage runs here, so the callback is always called from the thread that started the stream
+	auto reportStart = start;
+	while (StereoFrame* frame = PopStereoFrame(matched))
+	{
+		if (!stop)
+		{
+			auto frameStart = chrono::steady_clock::now();
+			ComputeStereoFrameDepth(*frame);
+			depthSeconds += chrono::duration<double>(chrono::steady_clock::now() - frameStart).count();
+			if (!callback(frame->depth, frame->index))
+			{
+				stop = true;
+			}
+			++stream.frameIndex;
+
+			if ((stream.frameIndex - firstIndex) % STREAM_REPORT_INTERVAL == 0)
+			{
+				auto now = chrono::steady_clock::now();
+				double seconds = chrono::duration<double>(now - reportStart).count();
+				cout << "Frame " << stream.frameIndex << ": " << STREAM_REPORT_INTERVAL / seconds << " fps" << endl;
+				reportStart = now;
+			}
+		}
+		PushStereoFrame(idle, frame);
+	}
+
+	decoder.join();
+	rectifier.join();
+	matcher.join();
+
+	int numFrames = stream.frameIndex - firstIndex;
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (numFrames > 0)
+	{
+		cout << numFrames << " frames in " << seconds << " s (" << numFrames / seconds << " fps)" << endl;
+		cout << "Per frame: decode " << 1000 * decodeSeconds / numFrames << " ms, rectify " << 1000 * rectifySeconds / numFrames
+			<< " ms, disparity " << 1000 * disparitySeconds / numFrames << " ms, depth " << 1000 * depthSeconds / numFrames << " ms" << endl;
+	}
+	return numFrames;
+}
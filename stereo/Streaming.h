@@ -0,0 +1,144 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "Stereography.h"
+#include "Disparity.h"
+
+// Each frame's disparity search is narrowed to the range the previous frame's disparities
+// fell in, between these low and high percentiles, and widened by the margin either side
+#define STREAM_RANGE_PERCENTILE 0.01f
+#define STREAM_RANGE_MARGIN 8
+// Only every few pixels in each direction are looked at to find that range
+#define STREAM_RANGE_SAMPLE_STEP 4
+// If fewer of the sampled pixels than this were valid, the range can't be trusted
+#define STREAM_MIN_VALID_FRACTION 0.2f
+// Every so many frames the full range is searched, to pick up anything that has come
+// into view outside the narrowed range. 0 never does
+#define STREAM_RANGE_REFRESH 30
+// How many frames can be in flight through the pipeline at once, so how many sets of
+// frame buffers there are. One per stage keeps every stage busy
+#define STREAM_PIPELINE_FRAMES 4
+// Depth maps are reported as a running frame rate every so many frames
+#define STREAM_REPORT_INTERVAL 30
+
+/*
+	Synchronised frame pairs from a rig, either as two videos or image sequences
+	(anything cv::VideoCapture opens, such as "left_%04d.png"), or one side-by-side
+	video with the left view in the left half of each frame.
+	The frames are read into the same buffers each time.
+*/
+struct FramePairSource
+{
+	cv::VideoCapture left;
+	cv::VideoCapture right;
+	bool sideBySide = false;
+	cv::Mat frame0;
+	cv::Mat frame1;
+};
+
+/*
+	The buffers for one frame pair as it goes through the pipeline.
+	params is the disparity search the frame was given.
+*/
+struct StereoFrame
+{
+	int index = 0;
+	cv::Mat gray0;
+	cv::Mat gray1;
+	cv::Mat rectified0;
+	cv::Mat rectified1;
+	cv::Mat disparity;
+	cv::Mat depth;
+	DisparityParams params;
+};
+
+/*
+	A queue of frames between two stages of the pipeline.
+	Popping waits for a frame, and returns nullptr once the queue is closed and empty.
+	It never holds more than the STREAM_PIPELINE_FRAMES frames there are.
+*/
+struct StereoFrameQueue
+{
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<StereoFrame*> frames;
+	bool closed = false;
+};
+
+/*
+	The state carried from one frame to the next.
+	Everything that only depends on the rig (the rectification maps) is built once.
+	params holds the full disparity range; minDisparity and maxDisparity are the
+	narrowed range the next frame will search.
+	The frames are the pipeline's buffers, handed round from stage to stage and reused,
+	so memory doesn't grow with the length of the stream.
+*/
+struct StereoStream
+{
+	RectificationMap map0;
+	RectificationMap map1;
+	DisparityParams params;
+	int minDisparity = MIN_DISPARITY;
+	int maxDisparity = MAX_DISPARITY;
+	int frameIndex = 0;
+	std::vector<int> histogram;
+	std::vector<StereoFrame> frames;
+};
+
+// Called with each depth map and its frame index. Returning false stops the stream
+typedef std::function<bool(const cv::Mat& depth, int frameIndex)> DepthCallback;
+
+/*
+	Streaming functions
+*/
+bool OpenFramePairSource(
+	_In_ const std::string& left,
+	_In_ const std::string& right,
+	_Out_ FramePairSource& source);
+
+bool ReadFramePair(
+	_Inout_ FramePairSource& source,
+	_Out_ cv::Mat& gray0,
+	_Out_ cv::Mat& gray1);
+
+bool GetRectificationMaps(
+	_In_ const StereoPair& stereo,
+	_In_ const std::string& cacheFolder,
+	_Out_ RectificationMap& map0,
+	_Out_ RectificationMap& map1);
+
+bool InitialiseStereoStream(
+	_In_ const StereoPair& stereo,
+	_In_ const std::string& cacheFolder,
+	_In_ const DisparityParams& params,
+	_Out_ StereoStream& stream);
+
+void UpdateDisparityRange(
+	_Inout_ StereoStream& stream,
+	_In_ const StereoFrame& frame);
+
+bool RectifyStereoFrame(
+	_In_ const StereoStream& stream,
+	_Inout_ StereoFrame& frame);
+
+bool ComputeStereoFrameDisparity(
+	_Inout_ StereoStream& stream,
+	_Inout_ StereoFrame& frame);
+
+void ComputeStereoFrameDepth(_Inout_ StereoFrame& frame);
+
+void PushStereoFrame(_Inout_ StereoFrameQueue& queue, _In_ StereoFrame* frame);
+
+StereoFrame* PopStereoFrame(_Inout_ StereoFrameQueue& queue);
+
+void CloseStereoFrameQueue(_Inout_ StereoFrameQueue& queue);
+
+int RunStereoStream(
+	_Inout_ FramePairSource& source,
+	_Inout_ StereoStream& stream,
+	_In_ const DepthCallback& callback);
@@ -0,0 +1,372 @@
+#include "Vocabulary.h"
+#include "Matching.h"
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+
+using namespace std;
+
+/*
+	Build a vocabulary tree by hierarchical k-means
+	https://people.eecs.berkeley.edu/~yang/courses/cs294-6/papers/nister_stewenius_cvpr2006.pdf
+
+	The training descriptors are clustered into branching groups, each group is clustered
+	again, and so on until depth levels down, or until a group is too small to split.
+	The leaves are the words. Looking a descriptor up only compares it to branching centres
+	per level, rather than to every word.
+
+	Clusters are seeded with k-means++, and each assignment step is a nearest neighbour
+	search of the node's descriptors against its few centres, with the brute-force kernels.
+*/
+// Support functions
+// k-means on n contiguous descriptors, giving k centres and the centre each descriptor is assigned to
+void ClusterDescriptors(
+	const float* data,
+	int n,
+	int k,
+	mt19937& rng,
+	vector<float>& centres,
+	vector<int>& assignment)
+{
+	centres.resize((size_t)k * DESC_LENGTH);
+	assignment.assign(n, -1);
+
+	// k-means++: each next centre is drawn with probability proportional to its
+	// squared distance from the centres so far, so they start well spread
+	vector<float> nearest(n, FLT_MAX);
+	int chosen = uniform_int_distribution<int>(0, n - 1)(rng);
+	for (int c = 0; c < k; ++c)
+	{
+		memcpy(&centres[(size_t)c * DESC_LENGTH], data + (size_t)chosen * DESC_LENGTH, DESC_LENGTH * sizeof(float));
+		if (c + 1 == k)
+		{
+			break;
+		}
+		double total = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			nearest[i] = min(nearest[i], SquaredDistanceBetweenDescriptors(data + (size_t)i * DESC_LENGTH, &centres[(size_t)c * DESC_LENGTH]));
+			total += nearest[i];
+		}
+		double target = uniform_real_distribution<double>(0, total)(rng);
+		chosen = n - 1;
+		for (int i = 0; i < n; ++i)
+		{
+			target -= nearest[i];
+			if (target <= 0)
+			{
+				chosen = i;
+				break;
+			}
+		}
+	}
+
+	vector<NeighbourPair> neighbours(n);
+	vector<double> sums((size_t)k * DESC_LENGTH);
+	vector<int> counts(k);
+	for (int iteration = 0; iteration < VOCABULARY_KMEANS_ITERATIONS; ++iteration)
+	{
+		FindTwoNearestNeighboursBruteForce(data, n, centres.data(), k, neighbours.data());
+		bool changed = false;
+		for (int i = 0; i < n; ++i)
+		{
+			changed |= assignment[i] != neighbours[i].closest;
+			assignment[i] = neighbours[i].closest;
+		}
+		if (!changed)
+		{
+			break;
+		}
+
+		// Move each centre to the mean of its descriptors. One left with none stays where it is
+		fill(sums.begin(), sums.end(), 0.0);
+		fill(counts.begin(), counts.end(), 0);
+		for (int i = 0; i < n; ++i)
+		{
+			double* sum = &sums[(size_t)assignment[i] * DESC_LENGTH];
+			const float* d = data + (size_t)i * DESC_LENGTH;
+			for (int j = 0; j < DESC_LENGTH; ++j)
+			{
+				sum[j] += d[j];
+			}
+			counts[assignment[i]]++;
+		}
+		for (int c = 0; c < k; ++c)
+		{
+			if (counts[c] == 0)
+			{
+				continue;
+			}
+			for (int j = 0; j < DESC_LENGTH; ++j)
+			{
+				centres[(size_t)c * DESC_LENGTH + j] = (float)(sums[(size_t)c * DESC_LENGTH + j] / counts[c]);
+			}
+		}
+	}
+}
+// Split a node's training descriptors among its children, and carry on down
+void BuildVocabularyNode(
+	VocabularyTree& tree,
+	int node,
+	const vector<float>& training,
+	const vector<int>& ids,
+	int levelsLeft,
+	int branching,
+	mt19937& rng)
+{
+	if (levelsLeft == 0 || (int)ids.size() <= branching)
+	{
+		tree.nodes[node].word = tree.numWords++;
+		return;
+	}
+
+	vector<int> assignment;
+	vector<float> centres;
+	{
+		// Gather this node's descriptors, so the distance kernels can stream through them
+		vector<float> data(ids.size() * DESC_LENGTH);
+		for (size_t i = 0; i < ids.size(); ++i)
+		{
+			memcpy(&data[i * DESC_LENGTH], &training[(size_t)ids[i] * DESC_LENGTH], DESC_LENGTH * sizeof(float));
+		}
+		ClusterDescriptors(data.data(), (int)ids.size(), branching, rng, centres, assignment);
+	}
+
+	int firstChild = (int)tree.nodes.size();
+	tree.nodes.resize(firstChild + branching);
+	tree.centres.resize(tree.nodes.size() * DESC_LENGTH);
+	memcpy(&tree.centres[(size_t)firstChild * DESC_LENGTH], centres.data(), centres.size() * sizeof(float));
+	tree.nodes[node].firstChild = firstChild;
+	tree.nodes[node].numChildren = branching;
+
+	vector<vector<int>> childIds(branching);
+	for (size_t i = 0; i < ids.size(); ++i)
+	{
+		childIds[assignment[i]].push_back(ids[i]);
+	}
+	for (int c = 0; c < branching; ++c)
+	{
+		BuildVocabularyNode(tree, firstChild + c, training, childIds[c], levelsLeft - 1, branching, rng);
+	}
+}
+// Actual function
+bool BuildVocabularyTree(
+	_In_ const vector<FeatureSetView>& sets,
+	_In_ int branching,
+	_In_ int depth,
+	_Out_ VocabularyTree& tree)
+{
+	tree = VocabularyTree();
+	if (branching < 2 || depth < 1)
+	{
+		cout << "A vocabulary tree needs a branching factor of at least 2 and at least one level" << endl;
+		return false;
+	}
+
+	size_t total = 0;
+	for (auto& set : sets)
+	{
+		total += set.size();
+	}
+	if (total <= (size_t)branching)
+	{
+		cout << "Too few descriptors to build a vocabulary from" << endl;
+		return false;
+	}
+
+	// Draw the training descriptors evenly from all the images
+	size_t numTraining = min(total, (size_t)VOCABULARY_TRAINING_FEATURES);
+	vector<float> training(numTraining * DESC_LENGTH);
+	size_t set = 0;
+	size_t setStart = 0;
+	for (size_t i = 0; i < numTraining; ++i)
+	{
+		size_t feature = i * total / numTraining;
+		while (feature >= setStart + sets[set].size())
+		{
+			setStart += sets[set].size();
+			++set;
+		}
+		sets[set].CopyDescriptor(feature - setStart, &training[i * DESC_LENGTH]);
+	}
+
+	tree.nodes.resize(1);
+	tree.centres.assign(DESC_LENGTH, 0.f);
+	vector<int> ids(numTraining);
+	iota(ids.begin(), ids.end(), 0);
+	mt19937 rng(VOCABULARY_SEED);
+	BuildVocabularyNode(tree, 0, training, ids, depth, branching, rng);
+
+	cout << "Built a vocabulary of " << tree.numWords << " words from " << numTraining << " descriptors" << endl;
+	return true;
+}
+
+/*
+	The word a descriptor falls in, found by going down the tree to the closest centre at each level
+*/
+int FindWord(_In_ const VocabularyTree& tree, _In_ const float* descriptor)
+{
+	int node = 0;
+	while (tree.nodes[node].numChildren > 0)
+	{
+		const VocabularyNode& parent = tree.nodes[node];
+		int best = parent.firstChild;
+		float bestDist = FLT_MAX;
+		for (int c = parent.firstChild; c < parent.firstChild + parent.numChildren; ++c)
+		{
+			float dist = SquaredDistanceBetweenDescriptors(descriptor, &tree.centres[(size_t)c * DESC_LENGTH]);
+			if (dist < bestDist)
+			{
+				bestDist = dist;
+				best = c;
+			}
+		}
+		node = best;
+	}
+	return tree.nodes[node].word;
+}
+
+/*
+	Inverted file with TF-IDF weights.
+	A word's weight in an image is how often it appears there (the term frequency), times
+	log(images / images it appears in) (the inverse document frequency), so words that are
+	everywhere count for little. Each image's weights are then scaled to unit length.
+*/
+// Support functions
+// The words of a set's descriptors, with the number of times each appears, sorted by word
+void CountWords(const VocabularyTree& tree, const FeatureSetView& set, BagOfWords& bag)
+{
+	vector<int> words(set.size());
+	float descriptor[DESC_LENGTH];
+	for (size_t i = 0; i < set.size(); ++i)
+	{
+		set.CopyDescriptor(i, descriptor);
+		words[i] = FindWord(tree, descriptor);
+	}
+	sort(words.begin(), words.end());
+
+	bag.clear();
+	for (size_t i = 0; i < words.size(); ++i)
+	{
+		if (bag.empty() || bag.back().first != words[i])
+		{
+			bag.push_back(make_pair(words[i], 0.f));
+		}
+		bag.back().second += 1;
+	}
+}
+// Turn counts into unit length TF-IDF weights. Words with no weight are dropped
+void WeightBagOfWords(const vector<float>& idf, BagOfWords& bag)
+{
+	float norm = 0;
+	size_t kept = 0;
+	for (auto& word : bag)
+	{
+		float weight = word.second * idf[word.first];
+		if (weight > 0)
+		{
+			bag[kept++] = make_pair(word.first, weight);
+			norm += weight * weight;
+		}
+	}
+	bag.resize(kept);
+	if (norm > 0)
+	{
+		norm = 1 / sqrt(norm);
+		for (auto& word : bag)
+		{
+			word.second *= norm;
+		}
+	}
+}
+// Actual functions
+void BuildInvertedFile(
+	_In_ const VocabularyTree& tree,
+	_In_ const vector<FeatureSetView>& sets,
+	_Out_ InvertedFile& file)
+{
+	file.numImages = (int)sets.size();
+	file.images.assign(sets.size(), BagOfWords());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < file.numImages; ++i)
+	{
+		CountWords(tree, sets[i], file.images[i]);
+	}
+
+	// How many images each word appears in
+	file.idf.assign(tree.numWords, 0.f);
+	for (auto& bag : file.images)
+	{
+		for (auto& word : bag)
+		{
+			file.idf[word.first] += 1;
+		}
+	}
+	for (auto& idf : file.idf)
+	{
+		idf = idf > 0 ? log(file.numImages / idf) : 0.f;
+	}
+
+	file.postings.assign(tree.numWords, vector<pair<int, float>>());
+	for (int i = 0; i < file.numImages; ++i)
+	{
+		WeightBagOfWords(file.idf, file.images[i]);
+		for (auto& word : file.images[i])
+		{
+			file.postings[word.first].push_back(make_pair(i, word.second));
+		}
+	}
+}
+
+// The bag of words for an image that may not be in the file, weighted by the file's IDF
+void ComputeBagOfWords(
+	_In_ const VocabularyTree& tree,
+	_In_ const InvertedFile& file,
+	_In_ const FeatureSetView& set,
+	_Out_ BagOfWords& bag)
+{
+	CountWords(tree, set, bag);
+	WeightBagOfWords(file.idf, bag);
+}
+
+/*
+	The images in the file most similar to a query, best first, as (image, cosine similarity).
+	Only the postings of the query's words are visited. excludeImage is left out of the
+	results, so an image in the file can look for its neighbours; pass -1 to keep them all.
+*/
+void QueryInvertedFile(
+	_In_ const InvertedFile& file,
+	_In_ const BagOfWords& query,
+	_In_ int numResults,
+	_In_ int excludeImage,
+	_Out_ vector<pair<int, float>>& results)
+{
+	vector<float> scores(file.numImages, 0.f);
+	for (auto& word : query)
+	{
+		for (auto& posting : file.postings[word.first])
+		{
+			scores[posting.first] += word.second * posting.second;
+		}
+	}
+
+	results.clear();
+	for (int i = 0; i < file.numImages; ++i)
+	{
+		if (i != excludeImage && scores[i] > 0)
+		{
+			results.push_back(make_pair(i, scores[i]));
+		}
+	}
+	int numKept = min(numResults, (int)results.size());
+	// Equal scores go to the lower index, so the results don't depend on the sort
+	partial_sort(results.begin(), results.begin() + numKept, results.end(), [](const pair<int, float>& a, const pair<int, float>& b)
+	{
+		return a.second > b.second || (a.second == b.second && a.first < b.first);
+	});
+	results.resize(numKept);
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <vector>
+#include <utility>
+#include "Features.h"
+
+// Vocabulary tree parameters, as in Nister and Stewenius.
+// Each node splits its descriptors into this many clusters, this many levels deep,
+// so there are up to branching^depth words
+#define VOCABULARY_BRANCHING 10
+#define VOCABULARY_DEPTH 4
+#define VOCABULARY_KMEANS_ITERATIONS 8
+// The vocabulary is learnt from at most this many descriptors, drawn evenly from all the images
+#define VOCABULARY_TRAINING_FEATURES 50000
+#define VOCABULARY_SEED 0xB0A7
+
+/*
+	A hierarchical k-means vocabulary over descriptors.
+	Nodes are stored flat, with each node's children next to each other from firstChild.
+	A leaf has no children, and is a word. centres holds DESC_LENGTH floats for every node;
+	the root's is unused.
+*/
+struct VocabularyNode
+{
+	int firstChild = -1;
+	int numChildren = 0;
+	int word = -1;
+};
+
+struct VocabularyTree
+{
+	std::vector<VocabularyNode> nodes;
+	std::vector<float> centres;
+	int numWords = 0;
+};
+
+/*
+	A bag of words: the words an image's descriptors fall in, sorted by word,
+	each with its TF-IDF weight. The weights have unit length, so the dot product
+	of two bags is their cosine similarity.
+*/
+typedef std::vector<std::pair<int, float>> BagOfWords;
+
+/*
+	An inverted file over a set of images: for each word, the images it appears in
+	and its weight there. Only images that share a word with a query are ever looked at.
+*/
+struct InvertedFile
+{
+	int numImages = 0;
+	std::vector<float> idf;
+	std::vector<std::vector<std::pair<int, float>>> postings;
+	std::vector<BagOfWords> images;
+};
+
+/*
+	Vocabulary functions
+*/
+bool BuildVocabularyTree(
+	_In_ const std::vector<FeatureSetView>& sets,
+	_In_ int branching,
+	_In_ int depth,
+	_Out_ VocabularyTree& tree);
+
+int FindWord(_In_ const VocabularyTree& tree, _In_ const float* descriptor);
+
+void BuildInvertedFile(
+	_In_ const VocabularyTree& tree,
+	_In_ const std::vector<FeatureSetView>& sets,
+	_Out_ InvertedFile& file);
+
+void ComputeBagOfWords(
+	_In_ const VocabularyTree& tree,
+	_In_ const InvertedFile& file,
+	_In_ const FeatureSetView& set,
+	_Out_ BagOfWords& bag);
+
+void QueryInvertedFile(
+	_In_ const InvertedFile& file,
+	_In_ const BagOfWords& query,
+	_In_ int numResults,
+	_In_ int excludeImage,
+	_Out_ std::vector<std::pair<int, float>>& results);
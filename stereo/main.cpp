@@ -18,6 +18,9 @@
 #include <Windows.h>
 #include "Stereography.h"
 #include "Estimation.h"
+#include "Cache.h"
+#include "Streaming.h"
+#include "MultiView.h"
 #include <stdlib.h>
 #include <omp.h>
 
@@ -104,12 +107,16 @@ inline bool does_file_exist(const std::string& name) {
 
 // Debug function prototypes
 void DebugMatches(
-	const vector<std::pair<Feature, Feature>>& matches,
+	const FeatureSetView& features1,
+	const FeatureSetView& features2,
+	const vector<FeatureMatch>& matches,
 	const vector<ImageDescriptor>& images,
 	const Matrix3f& fundamentalMatrix);
 void DebugEpipolarLines(
 	StereoPair stereo,
-	const vector<std::pair<Feature, Feature>>& matches,
+	const FeatureSetView& features1,
+	const FeatureSetView& features2,
+	const vector<FeatureMatch>& matches,
 	const vector<ImageDescriptor>& images);
 
 // Main
@@ -119,12 +126,20 @@ int main(int argc, char** argv)
 	if (argc < 2 || strcmp(argv[1], "-h") == 0)
 	{
 		cout << "Usage:" << endl;
-		cout << "stereo.exe <Folder to images> <calibration file> -mask [mask image] -features [Folder to save/load features]" << endl;
+		cout << "stereo.exe <Folder to images> <calibration file> -mask [mask image] -features [Folder to save/load features] -rectification [Folder to save/load rectification maps] -left [left video or image sequence] -right [right video or image sequence] -multiview [neighbours per image] -paths [4 or 8 SGM paths]" << endl;
+		cout << "With -left, depth maps are computed for every frame pair, and -output is a folder to write them to. Without -right, the left video has both views side by side" << endl;
+		cout << "With -multiview, every image is matched against that many of the others most likely to overlap it, and the best pair is used" << endl;
+		cout << "-paths 8 gives smoother disparities than the default 4, but holds a cost for every pixel and disparity in memory" << endl;
 		exit(1);
 	}
 	string featurePath = "";
 	bool featureFileGiven = false;
 	string pointCloudOutputPath = "";
+	string rectificationCacheFolder = "";
+	string leftStream = "";
+	string rightStream = "";
+	int multiViewNeighbours = 0;
+	int sgmPaths = SGM_PATHS;
 	Mat maskImage;
 	if (argc >= 3)
 	{
@@ -143,6 +158,28 @@ int main(int argc, char** argv)
 			{
 				pointCloudOutputPath = string(argv[i + 1]);
 			}
+			if (strcmp(argv[i], "-rectification") == 0)
+			{
+				rectificationCacheFolder = string(argv[i + 1]);
+			}
+			if (strcmp(argv[i], "-multiview") == 0)
+			{
+				// Anything that isn't a positive count gets the default
+				int neighbours = atoi(argv[i + 1]);
+				multiViewNeighbours = neighbours > 0 ? neighbours : PAIR_GRAPH_NEIGHBOURS;
+			}
+			if (strcmp(argv[i], "-paths") == 0)
+			{
+				sgmPaths = atoi(argv[i + 1]);
+			}
+			if (strcmp(argv[i], "-left") == 0)
+			{
+				leftStream = string(argv[i + 1]);
+			}
+			if (strcmp(argv[i], "-right") == 0)
+			{
+				rightStream = string(argv[i + 1]);
+			}
 		}
 	}
 
@@ -152,16 +189,34 @@ int main(int argc, char** argv)
 
 	// We have the option of saving the feature descriptors out to a file
 	// If we have done that, we can pull that in to avoid recomputing features every time
+	// The cache is mapped in and its features are used where they lie, so the images
+	// read from it have no feature lists of their own
 	bool featuresRead = false;
+	FeatureCache featureCache;
 	if (featureFileGiven)
 	{
 		std::cout << "Attempting to load features from " << featurePath << std::endl;
 		// If the feature file exists, read the image descriptors from it
 		if (does_file_exist(featurePath))
 		{
-			if (ReadDescriptorsFromFile(featurePath, images))
+			if (OpenFeatureCache(featurePath, featureCache) && featureCache.images.size() < 2)
+			{
+				// Not enough to be worth anything, and it can't be replaced while it's mapped
+				CloseFeatureCache(featureCache);
+			}
+			if (!featureCache.images.empty())
 			{
 				featuresRead = true;
+				for (auto& cached : featureCache.images)
+				{
+					ImageDescriptor img;
+					img.filename = cached.filename;
+					img.width = cached.width;
+					img.height = cached.height;
+					img.K = cached.K;
+					img.E = cached.E;
+					images.push_back(img);
+				}
 				cout << "Read descriptors from " << featurePath << endl;
 			}
 			else
@@ -187,54 +242,103 @@ int main(int argc, char** argv)
 
 		GetImageDescriptorsForImages(images);
 	}
-	// If opted, check for a features file
-	if (featureFileGiven && !featuresRead)
+	// Lay out the features of every image for matching, with their descriptors quantised to bytes.
+	// The sets hold all that matching needs, so the feature lists, with their float descriptors, can go
+	vector<FeatureSet> featureSets(images.size());
+	vector<FeatureSetView> featureViews(images.size());
+	for (size_t i = 0; i < images.size(); ++i)
 	{
-		// If the features file does not exist, save the features out to it
-		if (!does_file_exist(featurePath))
+		if (featuresRead)
 		{
-			if (!SaveImageDescriptorsToFile(featurePath, images))
-			{
-				std::cout << "Saving descriptors to file failed" << std::endl;
-			}
+			featureViews[i] = featureCache.images[i].features;
+		}
+		else
+		{
+			BuildFeatureSet(images[i].features, featureSets[i], true);
+			featureViews[i] = featureSets[i];
+			vector<Feature>().swap(images[i].features);
 		}
 	}
-
-	// THis should be stored in a 2D matrix where the index in the matrix corresponds to array index
-	// and the array holds the fundamental matrix
-	int s = (int)images.size();
-	cout << "Matching features for " << images[0].filename << " and " << images[1].filename << endl;
-	vector<std::pair<Feature, Feature>> matches = MatchDescriptors(images[0].features, images[1].features, MAX_DIST_BETWEEN_MATCHES);
-
-	if (matches.size() < STEREO_OVERLAP_THRESHOLD)
+	// If opted, and the features file was missing or stale, save the features out to it
+	if (featureFileGiven && !featuresRead)
 	{
-		cout << matches.size() << " features - not enough overlap between " << images[0].filename << " and " << images[1].filename << endl;
+		if (!SaveFeatureCache(featurePath, images, featureViews))
+		{
+			std::cout << "Saving descriptors to file failed" << std::endl;
+		}
 	}
-	cout << matches.size() << " features found between " << images[0].filename << " and " << images[1].filename << endl;
 
+	// By default, the first two images are the stereo pair. In multi-view mode, every image
+	// is matched against the ones most likely to overlap it, and the pair graph that gives
+	// holds F and E for each pair that matched. The best connected pair is then used from here on
 	StereoPair stereo;
-	stereo.img1 = images[0];
-	stereo.img2 = images[1];
-	// Compute Fundamental matrix
 	Matrix3f fundamentalMatrix;
-	if (!FindFundamentalMatrixWithRANSAC(matches, fundamentalMatrix, stereo))
+	vector<FeatureMatch> matches;
+	vector<float> matchDistances;
+	FeatureSetView features1, features2;
+	if (multiViewNeighbours > 0)
 	{
-		cout << "Failed to find fundamental matrix for pair " << images[0].filename << " and " << images[1].filename << endl;
+		PairGraph graph;
+		BuildPairGraph(images, featureViews, multiViewNeighbours, graph);
+		for (auto& pair : graph.pairs)
+		{
+			if (pair.valid)
+			{
+				cout << images[pair.image1].filename << " and " << images[pair.image2].filename << ": " << pair.matches.size() << " matches" << endl;
+			}
+		}
+
+		int best = FindStrongestImagePair(graph);
+		if (best < 0)
+		{
+			cout << "No pair of images overlaps enough to go on with" << endl;
+			CloseFeatureCache(featureCache);
+			return 1;
+		}
+		ImagePair& pair = graph.pairs[best];
+		stereo = pair.stereo;
+		fundamentalMatrix = stereo.F;
+		matches.swap(pair.matches);
+		matchDistances.swap(pair.distances);
+		features1 = featureViews[pair.image1];
+		features2 = featureViews[pair.image2];
+		cout << "Using " << stereo.img1.filename << " and " << stereo.img2.filename << endl;
 	}
-	cout << "Fundamental matrix found for pair " << images[0].filename << " and " << images[1].filename << endl;
+	else
+	{
+		cout << "Matching features for " << images[0].filename << " and " << images[1].filename << endl;
+		features1 = featureViews[0];
+		features2 = featureViews[1];
+		MatchFeatureSets(features1, features2, MAX_DIST_BETWEEN_MATCHES, matches, matchDistances);
 
-	// Compute essential matrix
-	// E = KT * F * K
-	stereo.F = fundamentalMatrix;
-	stereo.E = stereo.img2.K.transpose() * stereo.F * stereo.img1.K;
+		if (matches.size() < STEREO_OVERLAP_THRESHOLD)
+		{
+			cout << matches.size() << " features - not enough overlap between " << images[0].filename << " and " << images[1].filename << endl;
+		}
+		cout << matches.size() << " features found between " << images[0].filename << " and " << images[1].filename << endl;
+
+		stereo.img1 = images[0];
+		stereo.img2 = images[1];
+		// Compute Fundamental matrix
+		if (!FindFundamentalMatrixWithRANSAC(features1, features2, matches, matchDistances, fundamentalMatrix, stereo))
+		{
+			cout << "Failed to find fundamental matrix for pair " << images[0].filename << " and " << images[1].filename << endl;
+		}
+		cout << "Fundamental matrix found for pair " << images[0].filename << " and " << images[1].filename << endl;
+
+		// Compute essential matrix
+		// E = KT * F * K
+		stereo.F = fundamentalMatrix;
+		stereo.E = stereo.img2.K.transpose() * stereo.F * stereo.img1.K;
+	}
 
 	// Cheeky debug if you want it
 #ifdef DEBUG_MATCHES
-	DebugMatches(matches, images, fundamentalMatrix);
+	DebugMatches(features1, features2, matches, { stereo.img1, stereo.img2 }, fundamentalMatrix);
 #endif
 
 #ifdef DEBUG_ESSENTIAL_MATRIX
-	DebugEpipolarLines(stereo, matches, images);
+	DebugEpipolarLines(stereo, features1, features2, matches, { stereo.img1, stereo.img2 });
 #endif
 
 #ifdef TRIANGULATION_POINT_CLOUD
@@ -349,24 +453,58 @@ int main(int argc, char** argv)
 	// distance between two pixels. This can map to physical depth, but to create
 	// a depth map, or a point cloud to display, we don't necessarily care about that
 
-	// Compute rectification rotations
-	Matrix3f R0, R1;
-	ComputeRectificationRotations(stereo.E,
-		imread(stereo.img1.filename, 0),
-		imread(stereo.img2.filename, 0),
-		R0, R1);
-
-	// Apply rotation to images
-	// Sometimes the rectified images don't fit nicely within the original image
-	// frames given. Here I don't tackle that, but it can be necessary
-	Mat rectified_img1 = Mat::zeros(Size(stereo.img1.width, stereo.img1.height), CV_8U);
-	RectifyImage(imread(stereo.img1.filename, 0),
-		                rectified_img1,
-		                stereo.img1.K * R0 * stereo.img1.K.inverse());
-	Mat rectified_img2 = Mat::zeros(Size(stereo.img2.width, stereo.img2.height), CV_8U);
-	RectifyImage(imread(stereo.img2.filename, 0),
-		                rectified_img2,
-		                stereo.img2.K* R1 * stereo.img2.K.inverse());
+	// Depth map parameters
+	DisparityParams disparityParams;
+	disparityParams.method = DISPARITY_SGM;
+	disparityParams.cost = COST_CENSUS;
+	disparityParams.sgmP1 = SGM_CENSUS_P1;
+	disparityParams.sgmP2 = SGM_CENSUS_P2;
+	disparityParams.sgmPaths = sgmPaths;
+
+	// With a video from the same rig, the calibration and rectification are worked out once
+	// from the image pair above, and reused for every frame
+	if (!leftStream.empty())
+	{
+		FramePairSource source;
+		StereoStream stream;
+		if (!OpenFramePairSource(leftStream, rightStream, source) ||
+			!InitialiseStereoStream(stereo, rectificationCacheFolder, disparityParams, stream))
+		{
+			CloseFeatureCache(featureCache);
+			return 1;
+		}
+		RunStereoStream(source, stream, [&](const Mat& depth, int frameIndex)
+		{
+			if (pointCloudOutputPath.empty())
+			{
+				imshow("depth", depth);
+				// Any key stops the stream
+				return waitKey(1) < 0;
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "\\depth_%05d.png", frameIndex);
+			return imwrite(pointCloudOutputPath + name, depth);
+		});
+		CloseFeatureCache(featureCache);
+		return 0;
+	}
+
+	// The rotations and maps only depend on the rig, so they can be cached
+	RectificationMap rectificationMap1, rectificationMap2;
+	if (!GetRectificationMaps(stereo, rectificationCacheFolder, rectificationMap1, rectificationMap2))
+	{
+		CloseFeatureCache(featureCache);
+		return 1;
+	}
+
+	Mat rectified_img1, rectified_img2;
+	if (!ApplyRectificationMap(imread(stereo.img1.filename, 0), rectified_img1, rectificationMap1) ||
+		!ApplyRectificationMap(imread(stereo.img2.filename, 0), rectified_img2, rectificationMap2))
+	{
+		cout << "Failed to rectify " << stereo.img1.filename << " and " << stereo.img2.filename << endl;
+		CloseFeatureCache(featureCache);
+		return 1;
+	}
 
 #ifdef DEBUG_RECTIFICATION
 	// Show rectified images
@@ -375,15 +513,14 @@ int main(int argc, char** argv)
 	waitKey(0);
 #endif
 	
-	// Compute depth map
-	// This doesn't work
-	Mat depth = ComputeDepthImage(rectified_img1, rectified_img2);
+	Mat depth = ComputeDepthImage(rectified_img1, rectified_img2, disparityParams);
 
 	// Show depth map
 	imshow("depth", depth);
 	waitKey(0);
 #endif
 
+	CloseFeatureCache(featureCache);
 	return 0;
 }
 
@@ -391,7 +528,9 @@ int main(int argc, char** argv)
     Section for debug functions
    ################################# */
 void DebugMatches(
-	const vector<std::pair<Feature, Feature>>& matches,
+	const FeatureSetView& features1,
+	const FeatureSetView& features2,
+	const vector<FeatureMatch>& matches,
 	const vector<ImageDescriptor>& images,
 	const Matrix3f& fundamentalMatrix)
 {
@@ -404,22 +543,22 @@ void DebugMatches(
 	// Draw the features on the image
 	for (unsigned int i = 0; i < matches.size(); ++i)
 	{
-		Feature f1 = matches[i].first;
-		Feature f2 = matches[i].second;
+		Point2f p1 = features1.Point(matches[i].first);
+		Point2f p2 = features2.Point(matches[i].second);
 
 
-		auto f = Vector3f(matches[i].first.p.x, matches[i].first.p.y, 1);
-		auto fprime = Vector3f(matches[i].second.p.x, matches[i].second.p.y, 1);
+		auto f = Vector3f(p1.x, p1.y, 1);
+		auto fprime = Vector3f(p2.x, p2.y, 1);
 
 
 		auto result = fprime.transpose() * fundamentalMatrix * f;
 		std::cout << "reprojection error: " << result << endl;
 
-		f2.p.x += offset;
+		p2.x += offset;
 
-		circle(matchImageScored, f1.p, 2, (255, 255, 0), -1);
-		circle(matchImageScored, f2.p, 2, (255, 255, 0), -1);
-		line(matchImageScored, f1.p, f2.p, (0, 0, 0), 2, 8, 0);
+		circle(matchImageScored, p1, 2, (255, 255, 0), -1);
+		circle(matchImageScored, p2, 2, (255, 255, 0), -1);
+		line(matchImageScored, p1, p2, (0, 0, 0), 2, 8, 0);
 
 		// Debug display
 		imshow("matches", matchImageScored);
@@ -429,7 +568,9 @@ void DebugMatches(
 
 void DebugEpipolarLines(
 	StereoPair stereo,
-	const vector<std::pair<Feature, Feature>>& matches,
+	const FeatureSetView& features1,
+	const FeatureSetView& features2,
+	const vector<FeatureMatch>& matches,
 	const vector<ImageDescriptor>& images)
 {
 	// Debug the Essential Matrix now
@@ -462,13 +603,12 @@ void DebugEpipolarLines(
 		hconcat(img_1, img_2, epipolarLines);
 		int offset = img_1.cols;
 
-		Point2f img1Point = m.first.p;
-		Point2f img2Point = m.second.p;
-		Feature f2 = m.second;
-		f2.p.x += offset;
+		Point2f img1Point = features1.Point(m.first);
+		Point2f img2Point = features2.Point(m.second);
+		img2Point.x += offset;
 		circle(epipolarLines, img1Point, 6, (255, 255, 0), -1);
-		circle(epipolarLines, f2.p, 6, (255, 255, 0), -1);
-		//cout << "Features are " << img1Point << " and " << f2.p << endl;
+		circle(epipolarLines, img2Point, 6, (255, 255, 0), -1);
+		//cout << "Features are " << img1Point << " and " << img2Point << endl;
 
 		// Here we are NOT normalising
 		// But we are going from image 0 into image 1, as that is the direction in which we computed the fundamental matrix